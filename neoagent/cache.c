@@ -0,0 +1,415 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defines.h"
+
+/**
+ * responses to gets of keys with configured prefixes, shared by the workers
+ * of an environment. it is split into shards by the hash of key, each with
+ * a lock and an equal part of memory_max, so workers contend only for keys
+ * of the same shard. entries expire after ttl and are evicted by CLOCK of
+ * their shard. a write to a key passing through the proxy drops its entry,
+ * and no get of it stores its response until the write is answered, nor
+ * does a get sent before that.
+ */
+
+static const int NA_CACHE_SHARD_MAX  = 16;
+static const int NA_CACHE_BUCKET_MAX = 4096;
+
+// private functions
+static uint32_t na_cache_hash (const char *key, int len);
+static na_cache_shard_t *na_cache_shard (na_cache_t *cache, uint32_t hash);
+static inline int na_cache_bucket (na_cache_t *cache, uint32_t hash);
+static na_cache_entry_t **na_cache_lookup (na_cache_t *cache, na_cache_shard_t *shard, const char *key, int len, uint32_t hash);
+static void na_cache_unlink (na_cache_shard_t *shard, na_cache_entry_t **link);
+static bool na_cache_evict (na_cache_t *cache, na_cache_shard_t *shard, size_t size, double now);
+
+static uint32_t na_cache_hash (const char *key, int len)
+{
+    uint32_t hash;
+
+    hash = FNV_OFFSET_BASIS;
+    for (int i=0;i<len;++i) {
+        hash ^= (uint8_t)key[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static na_cache_shard_t *na_cache_shard (na_cache_t *cache, uint32_t hash)
+{
+    return &cache->shards[hash % cache->shard_cnt];
+}
+
+/**
+ * the bucket of hash in its shard. the bits which chose the shard are left out
+ */
+static inline int na_cache_bucket (na_cache_t *cache, uint32_t hash)
+{
+    return hash / cache->shard_cnt % cache->bucket_cnt;
+}
+
+/**
+ * the link to the entry of key, or to the end of its bucket
+ */
+static na_cache_entry_t **na_cache_lookup (na_cache_t *cache, na_cache_shard_t *shard, const char *key, int len, uint32_t hash)
+{
+    na_cache_entry_t **link;
+
+    for (link = &shard->buckets[na_cache_bucket(cache, hash)];*link != NULL;link = &(*link)->hnext) {
+        if ((*link)->hash == hash && (*link)->key_len == len && memcmp((*link)->data, key, len) == 0) {
+            break;
+        }
+    }
+
+    return link;
+}
+
+static void na_cache_unlink (na_cache_shard_t *shard, na_cache_entry_t **link)
+{
+    na_cache_entry_t *entry;
+
+    entry = *link;
+    *link = entry->hnext;
+    if (entry->next == entry) {
+        shard->hand = NULL;
+    } else {
+        if (shard->hand == entry) {
+            shard->hand = entry->next;
+        }
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+    }
+    shard->memory -= sizeof(na_cache_entry_t) + entry->key_len + entry->size;
+    --shard->entry_cnt;
+    NA_FREE(entry);
+}
+
+/**
+ * make room for size bytes in shard. entries referenced since the hand passed them last get another round
+ */
+static bool na_cache_evict (na_cache_t *cache, na_cache_shard_t *shard, size_t size, double now)
+{
+    na_cache_entry_t *entry;
+
+    if (size > shard->memory_max) {
+        return false;
+    }
+
+    while (shard->memory + size > shard->memory_max) {
+        entry = shard->hand;
+        if (entry->is_referenced && entry->expire > now) {
+            entry->is_referenced = false;
+            shard->hand          = entry->next;
+            continue;
+        }
+        na_cache_unlink(shard, na_cache_lookup(cache, shard, entry->data, entry->key_len, entry->hash));
+        ++shard->eviction_cnt;
+    }
+
+    return true;
+}
+
+na_cache_t *na_cache_create (size_t memory_max, double ttl, char **prefixes, int prefix_cnt)
+{
+    na_cache_t *cache;
+    na_cache_shard_t *shard;
+
+    cache = (na_cache_t *)malloc(sizeof(na_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->shards = calloc(sizeof(na_cache_shard_t), NA_CACHE_SHARD_MAX);
+    if (cache->shards == NULL) {
+        NA_FREE(cache);
+        return NULL;
+    }
+    cache->shard_cnt  = NA_CACHE_SHARD_MAX;
+    cache->bucket_cnt = NA_CACHE_BUCKET_MAX;
+    cache->ttl        = ttl;
+    cache->prefixes   = prefixes;
+    cache->prefix_cnt = prefix_cnt;
+
+    for (int i=0;i<cache->shard_cnt;++i) {
+        shard             = &cache->shards[i];
+        shard->buckets    = calloc(sizeof(na_cache_entry_t *), cache->bucket_cnt);
+        shard->gens       = calloc(sizeof(uint32_t), cache->bucket_cnt);
+        shard->writes     = calloc(sizeof(uint32_t), cache->bucket_cnt);
+        shard->memory_max = memory_max / cache->shard_cnt;
+        pthread_mutex_init(&shard->lock, NULL);
+        if (shard->buckets == NULL || shard->gens == NULL || shard->writes == NULL) {
+            na_cache_destroy(cache);
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+void na_cache_destroy (na_cache_t *cache)
+{
+    na_cache_shard_t *shard;
+
+    if (cache == NULL) {
+        return;
+    }
+    for (int i=0;i<cache->shard_cnt;++i) {
+        shard = &cache->shards[i];
+        while (shard->hand != NULL) {
+            na_cache_unlink(shard, na_cache_lookup(cache, shard, shard->hand->data, shard->hand->key_len, shard->hand->hash));
+        }
+        pthread_mutex_destroy(&shard->lock);
+        NA_FREE(shard->buckets);
+        NA_FREE(shard->gens);
+        NA_FREE(shard->writes);
+    }
+    NA_FREE(cache->shards);
+    NA_FREE(cache);
+}
+
+/**
+ * whether key has one of the prefixes
+ */
+bool na_cache_is_target (na_cache_t *cache, const char *key, int len)
+{
+    int plen;
+
+    for (int i=0;i<cache->prefix_cnt;++i) {
+        plen = strlen(cache->prefixes[i]);
+        if (plen <= len && memcmp(cache->prefixes[i], key, plen) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * copy the response to the get of key into buf, which is grown if it is short.
+ * the size of it, or -1 if there is not
+ */
+int na_cache_get (na_cache_t *cache, const char *key, int len, double now, char **buf, size_t *bufmax)
+{
+    na_cache_shard_t *shard;
+    na_cache_entry_t **link, *entry;
+    uint32_t hash;
+    char *p;
+    int size;
+
+    size  = -1;
+    hash  = na_cache_hash(key, len);
+    shard = na_cache_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    link = na_cache_lookup(cache, shard, key, len, hash);
+    if ((entry = *link) != NULL && entry->expire <= now) {
+        na_cache_unlink(shard, link);
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        ++shard->miss_cnt;
+        goto finally;
+    }
+    if ((size_t)entry->size > *bufmax) {
+        if ((p = (char *)realloc(*buf, entry->size)) == NULL) {
+            goto finally;
+        }
+        *buf    = p;
+        *bufmax = entry->size;
+    }
+    memcpy(*buf, entry->data + entry->key_len, entry->size);
+    size                 = entry->size;
+    entry->is_referenced = true;
+    ++shard->hit_cnt;
+
+ finally:
+    pthread_mutex_unlock(&shard->lock);
+
+    return size;
+}
+
+/**
+ * the generation of key, which a get sent to target server keeps to store its response
+ */
+uint32_t na_cache_generation (na_cache_t *cache, const char *key, int len)
+{
+    uint32_t hash;
+
+    hash = na_cache_hash(key, len);
+
+    return __sync_add_and_fetch(&na_cache_shard(cache, hash)->gens[na_cache_bucket(cache, hash)], 0);
+}
+
+/**
+ * store the response to the get of key, unless key has been written since gen
+ * or a write to a key of its bucket is on the way
+ */
+void na_cache_set (na_cache_t *cache, const char *key, int len, const char *data, int size, uint32_t gen, double now)
+{
+    na_cache_shard_t *shard;
+    na_cache_entry_t **link, *entry;
+    uint32_t hash;
+    size_t esize;
+
+    hash  = na_cache_hash(key, len);
+    shard = na_cache_shard(cache, hash);
+    esize = sizeof(na_cache_entry_t) + len + size;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->gens[na_cache_bucket(cache, hash)] != gen || shard->writes[na_cache_bucket(cache, hash)] > 0) {
+        goto finally;
+    }
+    link = na_cache_lookup(cache, shard, key, len, hash);
+    if (*link != NULL) {
+        na_cache_unlink(shard, link);
+    }
+    if (!na_cache_evict(cache, shard, esize, now)) {
+        goto finally;
+    }
+    if ((entry = (na_cache_entry_t *)malloc(esize)) == NULL) {
+        goto finally;
+    }
+    memcpy(entry->data, key, len);
+    memcpy(entry->data + len, data, size);
+    entry->hash          = hash;
+    entry->key_len       = len;
+    entry->size          = size;
+    entry->expire        = now + cache->ttl;
+    entry->is_referenced = false;
+
+    // the bucket of key may have changed by eviction
+    link          = na_cache_lookup(cache, shard, key, len, hash);
+    entry->hnext  = NULL;
+    *link         = entry;
+
+    // behind the hand, so the entry is the last one the hand reaches
+    if (shard->hand == NULL) {
+        entry->prev = entry;
+        entry->next = entry;
+        shard->hand = entry;
+    } else {
+        entry->next       = shard->hand;
+        entry->prev       = shard->hand->prev;
+        entry->prev->next = entry;
+        shard->hand->prev = entry;
+    }
+    shard->memory += esize;
+    ++shard->entry_cnt;
+
+ finally:
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * a write to key is sent. drop the entry of key, and gets of it on the way or sent until
+ * na_cache_write_end with the hash returned don't store their responses
+ */
+uint32_t na_cache_write_begin (na_cache_t *cache, const char *key, int len)
+{
+    na_cache_shard_t *shard;
+    na_cache_entry_t **link;
+    uint32_t hash;
+    int bucket;
+
+    hash   = na_cache_hash(key, len);
+    shard  = na_cache_shard(cache, hash);
+    bucket = na_cache_bucket(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    ++shard->gens[bucket];
+    ++shard->writes[bucket];
+    link = na_cache_lookup(cache, shard, key, len, hash);
+    if (*link != NULL) {
+        na_cache_unlink(shard, link);
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return hash;
+}
+
+/**
+ * the write is answered or lost. a get sent before it may have read the old value,
+ * so the generation is bumped again
+ */
+void na_cache_write_end (na_cache_t *cache, uint32_t hash)
+{
+    na_cache_shard_t *shard;
+    int bucket;
+
+    shard  = na_cache_shard(cache, hash);
+    bucket = na_cache_bucket(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+    ++shard->gens[bucket];
+    --shard->writes[bucket];
+    pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * totals of the shards for stats. they are read without the locks
+ */
+size_t na_cache_memory (na_cache_t *cache)
+{
+    size_t memory;
+
+    memory = 0;
+    for (int i=0;i<cache->shard_cnt;++i) {
+        memory += cache->shards[i].memory;
+    }
+
+    return memory;
+}
+
+int na_cache_entry_cnt (na_cache_t *cache)
+{
+    int cnt;
+
+    cnt = 0;
+    for (int i=0;i<cache->shard_cnt;++i) {
+        cnt += cache->shards[i].entry_cnt;
+    }
+
+    return cnt;
+}
+
+uint64_t na_cache_hit_cnt (na_cache_t *cache)
+{
+    uint64_t cnt;
+
+    cnt = 0;
+    for (int i=0;i<cache->shard_cnt;++i) {
+        cnt += cache->shards[i].hit_cnt;
+    }
+
+    return cnt;
+}
+
+uint64_t na_cache_miss_cnt (na_cache_t *cache)
+{
+    uint64_t cnt;
+
+    cnt = 0;
+    for (int i=0;i<cache->shard_cnt;++i) {
+        cnt += cache->shards[i].miss_cnt;
+    }
+
+    return cnt;
+}
+
+uint64_t na_cache_eviction_cnt (na_cache_t *cache)
+{
+    uint64_t cnt;
+
+    cnt = 0;
+    for (int i=0;i<cache->shard_cnt;++i) {
+        cnt += cache->shards[i].eviction_cnt;
+    }
+
+    return cnt;
+}
@@ -0,0 +1,106 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defines.h"
+
+/**
+ * free slots of a client pool are kept in a lock-free stack(Treiber stack).
+ * top holds the index of the first free slot in the low 32 bits and a tag
+ * bumped on every update in the high 32 bits, so that a slot which is taken
+ * and given back while another thread is about to pop it does not fool
+ * the compare-and-swap(ABA problem).
+ */
+
+#define NA_CLIENT_POOL_NIL 0xffffffffU
+
+static inline uint64_t na_client_pool_pack (uint32_t tag, uint32_t idx)
+{
+    return ((uint64_t)tag << 32) | idx;
+}
+
+na_client_pool_t *na_client_pool_create (na_env_t *env)
+{
+    na_client_pool_t *pool;
+
+    pool          = calloc(sizeof(na_client_pool_t), 1);
+    pool->clients = calloc(sizeof(na_client_t), env->client_pool_max);
+    pool->next    = calloc(sizeof(uint32_t), env->client_pool_max);
+    pool->max     = env->client_pool_max;
+    pool->used    = 0;
+    pool->tsconn_cnt = env->server_cnt;
+    for (int i=0;i<pool->max;++i) {
+        pool->clients[i].crbuf   = (char *)malloc(env->request_bufsize + 1);
+        pool->clients[i].srbuf   = (char *)malloc(env->response_bufsize + 1);
+        pool->clients[i].tsconns = calloc(sizeof(na_tsconn_t), pool->tsconn_cnt);
+        for (int j=0;j<pool->tsconn_cnt;++j) {
+            pool->clients[i].tsconns[j].fd = -1;
+        }
+        pool->next[i]          = i + 1 < pool->max ? (uint32_t)(i + 1) : NA_CLIENT_POOL_NIL;
+    }
+    pool->top = na_client_pool_pack(0, pool->max > 0 ? 0 : NA_CLIENT_POOL_NIL);
+
+    return pool;
+}
+
+void na_client_pool_destroy (na_client_pool_t *pool)
+{
+    for (int i=0;i<pool->max;++i) {
+        NA_FREE(pool->clients[i].crbuf);
+        NA_FREE(pool->clients[i].srbuf);
+        for (int j=0;j<pool->tsconn_cnt;++j) {
+            NA_FREE(pool->clients[i].tsconns[j].wbuf);
+            NA_FREE(pool->clients[i].tsconns[j].rbuf);
+        }
+        NA_FREE(pool->clients[i].tsconns);
+    }
+    NA_FREE(pool->clients);
+    NA_FREE(pool->next);
+    NA_FREE(pool);
+}
+
+na_client_t *na_client_pool_assign (na_client_pool_t *pool)
+{
+    uint64_t top, new;
+    uint32_t idx, next;
+
+    top = __atomic_load_n(&pool->top, __ATOMIC_ACQUIRE);
+    do {
+        idx = (uint32_t)top;
+        if (idx == NA_CLIENT_POOL_NIL) {
+            return NULL;
+        }
+        // may be stale if the slot was taken meanwhile, but then the tag has changed too
+        next = __atomic_load_n(&pool->next[idx], __ATOMIC_RELAXED);
+        new  = na_client_pool_pack((uint32_t)(top >> 32) + 1, next);
+    } while (!__atomic_compare_exchange_n(&pool->top, &top, new, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    __sync_add_and_fetch(&pool->used, 1);
+
+    return &pool->clients[idx];
+}
+
+void na_client_pool_release (na_client_pool_t *pool, na_client_t *client)
+{
+    uint64_t top, new;
+    uint32_t idx;
+
+    idx = (uint32_t)(client - pool->clients);
+
+    __sync_sub_and_fetch(&pool->used, 1);
+
+    top = __atomic_load_n(&pool->top, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&pool->next[idx], (uint32_t)top, __ATOMIC_RELAXED);
+        new = na_client_pool_pack((uint32_t)(top >> 32) + 1, idx);
+    } while (!__atomic_compare_exchange_n(&pool->top, &top, new, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,163 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defines.h"
+
+/**
+ * gets in flight of a worker, hashed by target server and key.
+ * an identical get which comes while one of them is on the way waits
+ * for its response instead of being forwarded. the table is touched
+ * only from the thread running the worker's loop.
+ */
+
+// private functions
+static uint32_t na_collapse_hash (int server, const char *key, int len);
+static na_request_t **na_collapse_lookup (na_collapse_t *collapse, int server, const char *key, int len, uint32_t hash);
+static void na_collapse_unlink (na_request_t *request);
+
+static uint32_t na_collapse_hash (int server, const char *key, int len)
+{
+    uint32_t hash;
+
+    hash = FNV_OFFSET_BASIS ^ (uint32_t)server;
+    for (int i=0;i<len;++i) {
+        hash ^= (uint8_t)key[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+/**
+ * the link to the request of server and key, or to the end of its bucket
+ */
+static na_request_t **na_collapse_lookup (na_collapse_t *collapse, int server, const char *key, int len, uint32_t hash)
+{
+    na_request_t **link;
+
+    for (link = &collapse->buckets[hash % collapse->bucket_cnt];*link != NULL;link = &(*link)->hnext) {
+        if ((*link)->hash == hash && (*link)->server == server &&
+            (*link)->key_len == len && memcmp((*link)->key, key, len) == 0)
+        {
+            break;
+        }
+    }
+
+    return link;
+}
+
+na_collapse_t *na_collapse_create (int bucket_cnt)
+{
+    na_collapse_t *collapse;
+
+    collapse = (na_collapse_t *)malloc(sizeof(na_collapse_t));
+    if (collapse == NULL) {
+        return NULL;
+    }
+    collapse->buckets = calloc(sizeof(na_request_t *), bucket_cnt);
+    if (collapse->buckets == NULL) {
+        NA_FREE(collapse);
+        return NULL;
+    }
+    collapse->bucket_cnt = bucket_cnt;
+    collapse->cnt        = 0;
+
+    return collapse;
+}
+
+void na_collapse_destroy (na_collapse_t *collapse)
+{
+    if (collapse == NULL) {
+        return;
+    }
+    NA_FREE(collapse->buckets);
+    NA_FREE(collapse);
+}
+
+na_request_t *na_collapse_find (na_collapse_t *collapse, int server, const char *key, int len)
+{
+    if (collapse->cnt == 0) {
+        return NULL;
+    }
+    return *na_collapse_lookup(collapse, server, key, len, na_collapse_hash(server, key, len));
+}
+
+/**
+ * index request as the get of server and key in flight. false if another one is already or no memory
+ */
+bool na_collapse_add (na_collapse_t *collapse, na_request_t *request, int server, const char *key, int len)
+{
+    na_request_t **link;
+    uint32_t hash;
+
+    hash = na_collapse_hash(server, key, len);
+    link = na_collapse_lookup(collapse, server, key, len, hash);
+    if (*link != NULL) {
+        return false;
+    }
+
+    request->key = (char *)malloc(len);
+    if (request->key == NULL) {
+        return false;
+    }
+    memcpy(request->key, key, len);
+    request->key_len  = len;
+    request->server   = server;
+    request->hash     = hash;
+    request->hnext    = NULL;
+    request->collapse = collapse;
+    *link             = request;
+    ++collapse->cnt;
+
+    return true;
+}
+
+/**
+ * unindex request if it is indexed. identical gets which come later are forwarded
+ */
+static void na_collapse_unlink (na_request_t *request)
+{
+    na_collapse_t *collapse;
+    na_request_t **link;
+
+    if ((collapse = request->collapse) == NULL) {
+        return;
+    }
+
+    link = na_collapse_lookup(collapse, request->server, request->key, request->key_len, request->hash);
+    if (*link == request) {
+        *link = request->hnext;
+        --collapse->cnt;
+    }
+    request->collapse = NULL;
+}
+
+/**
+ * unindex request and free the copy of its key
+ */
+void na_collapse_remove (na_request_t *request)
+{
+    na_collapse_unlink(request);
+    NA_FREE(request->key);
+}
+
+/**
+ * a write to the key is on the way, so the get in flight can't answer gets after it.
+ * it keeps its key for the gets collapsed into it so far
+ */
+void na_collapse_invalidate (na_collapse_t *collapse, int server, const char *key, int len)
+{
+    na_request_t *request;
+
+    if ((request = na_collapse_find(collapse, server, key, len)) != NULL) {
+        na_collapse_unlink(request);
+    }
+}
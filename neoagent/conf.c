@@ -47,6 +47,26 @@ typedef enum na_param_t {
     NA_PARAM_SLOW_QUERY_LOG_FORMAT,
     NA_PARAM_SLOW_QUERY_LOG_ACCESS_MASK,
     NA_PARAM_TRY_MAX,
+    NA_PARAM_REUSEPORT,
+    NA_PARAM_WORKER_STEAL_INTERVAL,
+    NA_PARAM_MULTIPLEX_CONN_MAX,
+    NA_PARAM_PIPELINE_MAX,
+    NA_PARAM_TARGET_SERVERS,
+    NA_PARAM_MULTIGET_KEYS_MAX,
+    NA_PARAM_GET_COLLAPSE,
+    NA_PARAM_GET_BATCH_USEC,
+    NA_PARAM_L1_CACHE_PREFIXES,
+    NA_PARAM_L1_CACHE_MEMORY_MAX,
+    NA_PARAM_L1_CACHE_TTL_MSEC,
+    NA_PARAM_HOTKEY_MAX,
+    NA_PARAM_HOTKEY_WINDOW_SEC,
+    NA_PARAM_HC_TIMEOUT_MSEC,
+    NA_PARAM_EJECT_ERROR_RATE,
+    NA_PARAM_EJECT_LATENCY_MSEC,
+    NA_PARAM_EJECT_MIN_REQUESTS,
+    NA_PARAM_READMIT_STEPS,
+    NA_PARAM_BACKUP_STANDBY_MAX,
+    NA_PARAM_BACKUP_SERVERS,
     NA_PARAM_MAX // Always add new codes to the end before this one
 } na_param_t;
 
@@ -57,6 +77,7 @@ typedef enum na_param_t {
     } while(false)
 
 static const int NA_JSON_BUF_MAX = 65536;
+static const int NA_HOTKEY_MAX_LIMIT = 1024;
 
 const char *na_ctl_params[NA_PARAM_MAX] = {
     [NA_CTL_PARAM_BINPATH]         = "binpath",
@@ -89,7 +110,27 @@ const char *na_params[NA_PARAM_MAX] = {
     [NA_PARAM_SLOW_QUERY_LOG_PATH]        = "slow_query_log_path",
     [NA_PARAM_SLOW_QUERY_LOG_FORMAT]      = "slow_query_log_format",
     [NA_PARAM_SLOW_QUERY_LOG_ACCESS_MASK] = "slow_query_log_access_mask",
-    [NA_PARAM_TRY_MAX]                    = "try_max"
+    [NA_PARAM_TRY_MAX]                    = "try_max",
+    [NA_PARAM_REUSEPORT]                  = "reuseport",
+    [NA_PARAM_WORKER_STEAL_INTERVAL]      = "worker_steal_interval",
+    [NA_PARAM_MULTIPLEX_CONN_MAX]         = "multiplex_conn_max",
+    [NA_PARAM_PIPELINE_MAX]               = "pipeline_max",
+    [NA_PARAM_TARGET_SERVERS]             = "target_servers",
+    [NA_PARAM_MULTIGET_KEYS_MAX]          = "multiget_keys_max",
+    [NA_PARAM_GET_COLLAPSE]               = "get_collapse",
+    [NA_PARAM_GET_BATCH_USEC]             = "get_batch_usec",
+    [NA_PARAM_L1_CACHE_PREFIXES]          = "l1_cache_prefixes",
+    [NA_PARAM_L1_CACHE_MEMORY_MAX]        = "l1_cache_memory_max",
+    [NA_PARAM_L1_CACHE_TTL_MSEC]          = "l1_cache_ttl_msec",
+    [NA_PARAM_HOTKEY_MAX]                 = "hotkey_max",
+    [NA_PARAM_HOTKEY_WINDOW_SEC]          = "hotkey_window_sec",
+    [NA_PARAM_HC_TIMEOUT_MSEC]            = "hc_timeout_msec",
+    [NA_PARAM_EJECT_ERROR_RATE]           = "eject_error_rate",
+    [NA_PARAM_EJECT_LATENCY_MSEC]         = "eject_latency_msec",
+    [NA_PARAM_EJECT_MIN_REQUESTS]         = "eject_min_requests",
+    [NA_PARAM_READMIT_STEPS]              = "readmit_steps",
+    [NA_PARAM_BACKUP_STANDBY_MAX]         = "backup_standby_max",
+    [NA_PARAM_BACKUP_SERVERS]             = "backup_servers"
 };
 
 static const char *na_event_models[NA_EVENT_MODEL_MAX] = {
@@ -421,6 +462,193 @@ void na_conf_env_init(struct json_object *environments_obj, na_env_t *na_env, in
             NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
             na_env->try_max = json_object_get_int(param_obj);
             break;
+        case NA_PARAM_REUSEPORT:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_reuseport = json_object_get_boolean(param_obj);
+#ifndef SO_REUSEPORT
+            if (na_env->is_reuseport) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+#endif
+            break;
+        case NA_PARAM_WORKER_STEAL_INTERVAL:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_double);
+            na_env->worker_steal_interval = json_object_get_double(param_obj);
+            break;
+        case NA_PARAM_MULTIPLEX_CONN_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->multiplex_conn_max = json_object_get_int(param_obj);
+            break;
+        case NA_PARAM_PIPELINE_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->pipeline_max = json_object_get_int(param_obj);
+            if (na_env->pipeline_max < 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_TARGET_SERVERS:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_array);
+            na_env->target_server_cnt = json_object_array_length(param_obj);
+            if (na_env->target_server_cnt < 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            na_env->target_servers = calloc(sizeof(na_server_t), na_env->target_server_cnt);
+            for (int j=0;j<na_env->target_server_cnt;++j) {
+                struct json_object *server_obj, *host_obj, *weight_obj;
+                server_obj = json_object_array_get_idx(param_obj, j);
+                NA_PARAM_TYPE_CHECK(server_obj, json_type_object);
+                host_obj   = json_object_object_get(server_obj, "server");
+                weight_obj = json_object_object_get(server_obj, "weight");
+                NA_PARAM_TYPE_CHECK(host_obj, json_type_string);
+                strncpy(host_buf, json_object_get_string(host_obj), NA_HOSTNAME_MAX);
+                host = na_create_host(host_buf);
+                memcpy(&na_env->target_servers[j].host, &host, sizeof(host));
+                na_set_sockaddr(&host, &na_env->target_servers[j].addr);
+                na_env->target_servers[j].weight = 1;
+                if (weight_obj != NULL) {
+                    NA_PARAM_TYPE_CHECK(weight_obj, json_type_int);
+                    na_env->target_servers[j].weight = json_object_get_int(weight_obj);
+                    if (na_env->target_servers[j].weight < 1) {
+                        NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+                    }
+                }
+            }
+            break;
+        case NA_PARAM_MULTIGET_KEYS_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->multiget_keys_max = json_object_get_int(param_obj);
+            if (na_env->multiget_keys_max < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_GET_COLLAPSE:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_boolean);
+            na_env->is_get_collapse = json_object_get_boolean(param_obj);
+            break;
+        case NA_PARAM_GET_BATCH_USEC:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->get_batch_usec = json_object_get_int(param_obj);
+            if (na_env->get_batch_usec < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_L1_CACHE_PREFIXES:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_array);
+            na_env->l1_cache_prefix_cnt = json_object_array_length(param_obj);
+            na_env->l1_cache_prefixes   = calloc(sizeof(char *), na_env->l1_cache_prefix_cnt);
+            for (int j=0;j<na_env->l1_cache_prefix_cnt;++j) {
+                struct json_object *prefix_obj;
+                prefix_obj = json_object_array_get_idx(param_obj, j);
+                NA_PARAM_TYPE_CHECK(prefix_obj, json_type_string);
+                na_env->l1_cache_prefixes[j] = strdup(json_object_get_string(prefix_obj));
+            }
+            break;
+        case NA_PARAM_L1_CACHE_MEMORY_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->l1_cache_memory_max = json_object_get_int(param_obj);
+            if (na_env->l1_cache_memory_max < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_L1_CACHE_TTL_MSEC:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->l1_cache_ttl_msec = json_object_get_int(param_obj);
+            if (na_env->l1_cache_ttl_msec < 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_HOTKEY_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->hotkey_max = json_object_get_int(param_obj);
+            if (na_env->hotkey_max < 0 || na_env->hotkey_max > NA_HOTKEY_MAX_LIMIT) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_HOTKEY_WINDOW_SEC:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->hotkey_window_sec = json_object_get_int(param_obj);
+            if (na_env->hotkey_window_sec < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_HC_TIMEOUT_MSEC:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->hc_timeout_msec = json_object_get_int(param_obj);
+            if (na_env->hc_timeout_msec < 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_EJECT_ERROR_RATE:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_double);
+            na_env->eject_error_rate = json_object_get_double(param_obj);
+            if (na_env->eject_error_rate < 0 || na_env->eject_error_rate > 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_EJECT_LATENCY_MSEC:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->eject_latency_msec = json_object_get_int(param_obj);
+            if (na_env->eject_latency_msec < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_EJECT_MIN_REQUESTS:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->eject_min_requests = json_object_get_int(param_obj);
+            if (na_env->eject_min_requests < 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_READMIT_STEPS:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->readmit_steps = json_object_get_int(param_obj);
+            if (na_env->readmit_steps < 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_BACKUP_STANDBY_MAX:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_int);
+            na_env->backup_standby_max = json_object_get_int(param_obj);
+            if (na_env->backup_standby_max < 0) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            break;
+        case NA_PARAM_BACKUP_SERVERS:
+            NA_PARAM_TYPE_CHECK(param_obj, json_type_array);
+            na_env->backup_server_cnt = json_object_array_length(param_obj);
+            if (na_env->backup_server_cnt < 1) {
+                NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+            }
+            na_env->backup_servers = calloc(sizeof(na_server_t), na_env->backup_server_cnt);
+            for (int j=0;j<na_env->backup_server_cnt;++j) {
+                struct json_object *server_obj, *host_obj, *weight_obj, *priority_obj;
+                server_obj   = json_object_array_get_idx(param_obj, j);
+                NA_PARAM_TYPE_CHECK(server_obj, json_type_object);
+                host_obj     = json_object_object_get(server_obj, "server");
+                weight_obj   = json_object_object_get(server_obj, "weight");
+                priority_obj = json_object_object_get(server_obj, "priority");
+                NA_PARAM_TYPE_CHECK(host_obj, json_type_string);
+                strncpy(host_buf, json_object_get_string(host_obj), NA_HOSTNAME_MAX);
+                host = na_create_host(host_buf);
+                memcpy(&na_env->backup_servers[j].host, &host, sizeof(host));
+                na_set_sockaddr(&host, &na_env->backup_servers[j].addr);
+                na_env->backup_servers[j].weight = 1;
+                if (weight_obj != NULL) {
+                    NA_PARAM_TYPE_CHECK(weight_obj, json_type_int);
+                    na_env->backup_servers[j].weight = json_object_get_int(weight_obj);
+                    if (na_env->backup_servers[j].weight < 1) {
+                        NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+                    }
+                }
+                // without priority, backup servers are failed over to one by one in order
+                na_env->backup_servers[j].priority = j + 1;
+                if (priority_obj != NULL) {
+                    NA_PARAM_TYPE_CHECK(priority_obj, json_type_int);
+                    na_env->backup_servers[j].priority = json_object_get_int(priority_obj);
+                }
+            }
+            na_env->is_use_backup = true;
+            break;
         default:
             // no through
             assert(false);
@@ -428,6 +656,21 @@ void na_conf_env_init(struct json_object *environments_obj, na_env_t *na_env, in
         }
     }
 
+    // failover to backup server is for an environment with one target server
+    if (na_env->is_use_backup && na_env->target_server_cnt > 1) {
+        NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+    }
+
+    // backup_server is the short form of backup_servers with one server
+    if (na_env->backup_server_cnt > 0 && json_object_object_get(environment_obj, na_param_name(NA_PARAM_BACKUP_SERVER)) != NULL) {
+        NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+    }
+
+    // standby connections are kept in backup pools
+    if (na_env->backup_standby_max > na_env->connpool_max) {
+        NA_DIE_WITH_ERROR(na_env, NA_ERROR_INVALID_JSON_CONFIG);
+    }
+
     // open log, if enabled
     if (have_log_path_opt) {
         na_log_open(na_env);
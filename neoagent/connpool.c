@@ -11,125 +11,394 @@
 
 #include "defines.h"
 
+/**
+ * free slots are kept in two lock-free stacks in the same way as client pools,
+ * one of idle connections and one of slots without connection.
+ * a slot is owned by whoever popped it, so its fd and state are changed
+ * without any lock until it is pushed back.
+ * idle slots are checked in place by the support loop. it claims one by
+ * changing its state from idle to checking, and a worker which pops it
+ * meanwhile waits for the check, which never blocks.
+ * switching pools bumps cur_epoch of the pool being left. connections made
+ * before that are closed when they are released or taken next time.
+ */
+
+#define NA_CONNPOOL_NIL 0xffffffffU
+
+static const char *na_connpool_states[NA_CONNPOOL_STATE_MAX] = {
+    [NA_CONNPOOL_STATE_CLOSED]     = "closed",
+    [NA_CONNPOOL_STATE_CONNECTING] = "connecting",
+    [NA_CONNPOOL_STATE_IDLE]       = "idle",
+    [NA_CONNPOOL_STATE_INUSE]      = "inuse",
+    [NA_CONNPOOL_STATE_BROKEN]     = "broken",
+    [NA_CONNPOOL_STATE_CHECKING]   = "checking",
+};
+
 // private functions
-static void na_connpool_deactivate (na_connpool_t *connpool);
+static inline uint64_t na_connpool_pack (uint32_t tag, uint32_t idx);
+static int na_connpool_pop (na_connpool_t *connpool, uint64_t *top);
+static void na_connpool_push (na_connpool_t *connpool, uint64_t *top, int i);
+static void na_connpool_close (na_connpool_t *connpool, int i);
+static bool na_connpool_take_idle (na_connpool_t *connpool, int i);
+static bool na_connpool_check (na_connpool_t *connpool, int i, uint32_t epoch);
+static bool na_connpool_is_alive (int fd);
 
-static void na_connpool_deactivate (na_connpool_t *connpool)
+static inline uint64_t na_connpool_pack (uint32_t tag, uint32_t idx)
 {
-    for (int i=0;i<connpool->max;++i) {
-        if (connpool->fd_pool[i] > 0) {
-            if (connpool->mark[i] == 0) {
-                close(connpool->fd_pool[i]);
-                connpool->fd_pool[i] = 0;
-            }
-            connpool->mark[i]   = 0;
-            connpool->active[i] = 0;
+    return ((uint64_t)tag << 32) | idx;
+}
+
+static int na_connpool_pop (na_connpool_t *connpool, uint64_t *top)
+{
+    uint64_t cur, new;
+    uint32_t idx, next;
+
+    cur = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+    do {
+        idx = (uint32_t)cur;
+        if (idx == NA_CONNPOOL_NIL) {
+            return -1;
         }
+        next = __atomic_load_n(&connpool->next[idx], __ATOMIC_RELAXED);
+        new  = na_connpool_pack((uint32_t)(cur >> 32) + 1, next);
+    } while (!__atomic_compare_exchange_n(top, &cur, new, true,
+                                          __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    return idx;
+}
+
+static void na_connpool_push (na_connpool_t *connpool, uint64_t *top, int i)
+{
+    uint64_t cur, new;
+
+    cur = __atomic_load_n(top, __ATOMIC_RELAXED);
+    do {
+        __atomic_store_n(&connpool->next[i], (uint32_t)cur, __ATOMIC_RELAXED);
+        new = na_connpool_pack((uint32_t)(cur >> 32) + 1, i);
+    } while (!__atomic_compare_exchange_n(top, &cur, new, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void na_connpool_close (na_connpool_t *connpool, int i)
+{
+    if (connpool->fd_pool[i] > 0) {
+        close(connpool->fd_pool[i]);
+    }
+    connpool->fd_pool[i]  = -1;
+    connpool->protocol[i] = NA_MEMPROTO_PROTOCOL_NOT_DETECTED;
+    __atomic_store_n(&connpool->state[i], NA_CONNPOOL_STATE_CLOSED, __ATOMIC_RELEASE);
+}
+
+/**
+ * make the slot popped from the idle stack in use. false if it was closed by a check
+ */
+static bool na_connpool_take_idle (na_connpool_t *connpool, int i)
+{
+    na_connpool_state_t state;
+
+    while (true) {
+        state = __atomic_load_n(&connpool->state[i], __ATOMIC_ACQUIRE);
+        if (state == NA_CONNPOOL_STATE_CHECKING) {
+            continue;
+        }
+        if (state != NA_CONNPOOL_STATE_IDLE) {
+            return false;
+        }
+        if (__atomic_compare_exchange_n(&connpool->state[i], &state, NA_CONNPOOL_STATE_INUSE, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            return true;
+        }
+    }
+}
+
+/**
+ * check the slot in place if it is idle, whether it is in the idle stack or just popped.
+ * a connection which is stale or closed by the server is closed, and the slot
+ * is left in the stack for the next one to connect again. true if it is still idle
+ */
+static bool na_connpool_check (na_connpool_t *connpool, int i, uint32_t epoch)
+{
+    na_connpool_state_t state;
+
+    state = NA_CONNPOOL_STATE_IDLE;
+    if (!__atomic_compare_exchange_n(&connpool->state[i], &state, NA_CONNPOOL_STATE_CHECKING, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return false;
     }
+    if (connpool->epoch[i] != epoch || !na_connpool_is_alive(connpool->fd_pool[i])) {
+        na_connpool_close(connpool, i);
+        return false;
+    }
+    __atomic_store_n(&connpool->state[i], NA_CONNPOOL_STATE_IDLE, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+/**
+ * an idle connection has nothing to read unless the server has closed it
+ */
+static bool na_connpool_is_alive (int fd)
+{
+    char c;
+    ssize_t size;
+
+    size = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
 }
 
 void na_connpool_create (na_connpool_t *connpool, int c)
 {
-    connpool->fd_pool  = calloc(sizeof(int), c);
-    connpool->mark     = calloc(sizeof(int), c);
-    connpool->active   = calloc(sizeof(int), c);
-    connpool->max      = c;
+    connpool->fd_pool   = calloc(sizeof(int), c);
+    connpool->state     = calloc(sizeof(na_connpool_state_t), c);
+    connpool->epoch     = calloc(sizeof(uint32_t), c);
+    connpool->protocol  = calloc(sizeof(na_memproto_protocol_t), c);
+    connpool->next      = calloc(sizeof(uint32_t), c);
+    connpool->max       = c;
+    connpool->cur_epoch = 0;
+    for (int i=0;i<c;++i) {
+        connpool->fd_pool[i]  = -1;
+        connpool->state[i]    = NA_CONNPOOL_STATE_CLOSED;
+        connpool->protocol[i] = NA_MEMPROTO_PROTOCOL_NOT_DETECTED;
+        connpool->next[i]     = i + 1 < c ? (uint32_t)(i + 1) : NA_CONNPOOL_NIL;
+    }
+    connpool->top   = na_connpool_pack(0, NA_CONNPOOL_NIL);
+    connpool->empty = na_connpool_pack(0, c > 0 ? 0 : NA_CONNPOOL_NIL);
 }
 
 void na_connpool_destroy (na_connpool_t *connpool)
 {
+    for (int i=0;i<connpool->max;++i) {
+        if (connpool->fd_pool[i] > 0) {
+            close(connpool->fd_pool[i]);
+        }
+    }
     NA_FREE(connpool->fd_pool);
-    NA_FREE(connpool->mark);
+    NA_FREE(connpool->state);
+    NA_FREE(connpool->epoch);
+    NA_FREE(connpool->protocol);
+    NA_FREE(connpool->next);
 }
 
-void na_connpool_assign_internal (na_env_t *env, na_connpool_t *connpool, int i, int *cur, int *fd, na_server_t *server)
+/**
+ * an idle connection which has spoken another protocol is made again.
+ * NA_MEMPROTO_PROTOCOL_NOT_DETECTED takes any connection.
+ */
+bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server, na_memproto_protocol_t protocol)
 {
-    if (connpool->active[i] == 0) {
-        connpool->active[i] = 1;
+    int i;
+    uint32_t epoch;
+    bool is_idle;
+
+    is_idle = true;
+    if ((i = na_connpool_pop(connpool, &connpool->top)) == -1) {
+        is_idle = false;
+        if ((i = na_connpool_pop(connpool, &connpool->empty)) == -1) {
+            return false;
+        }
+    }
+
+    epoch = __atomic_load_n(&connpool->cur_epoch, __ATOMIC_ACQUIRE);
+    if (is_idle) {
+        is_idle = na_connpool_take_idle(connpool, i);
+    }
+    if (is_idle && connpool->epoch[i] != epoch) {
+        is_idle = false;
+    }
+    if (is_idle                                                    &&
+        protocol              != NA_MEMPROTO_PROTOCOL_NOT_DETECTED &&
+        connpool->protocol[i] != NA_MEMPROTO_PROTOCOL_NOT_DETECTED &&
+        connpool->protocol[i] != protocol)
+    {
+        is_idle = false;
+    }
+
+    if (!is_idle) {
+        // closed, broken or unusable, so make a new connection
+        na_connpool_close(connpool, i);
+        connpool->fd_pool[i] = na_target_server_tcpsock_init();
+        if (connpool->fd_pool[i] <= 0) {
+            connpool->fd_pool[i] = -1;
+            na_connpool_push(connpool, &connpool->empty, i);
+            NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_INVALID_FD);
+            return false;
+        }
+        na_target_server_tcpsock_setup(connpool->fd_pool[i], true);
         if (!na_server_connect(connpool->fd_pool[i], &server->addr)) {
             if (errno != EINPROGRESS && errno != EALREADY) {
-                NA_DIE_WITH_ERROR(env, NA_ERROR_CONNECTION_FAILED);
+                na_connpool_close(connpool, i);
+                na_connpool_push(connpool, &connpool->empty, i);
+                NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_CONNECTION_FAILED);
+                return false;
             }
         }
+        connpool->epoch[i] = epoch;
+        connpool->state[i] = NA_CONNPOOL_STATE_CONNECTING;
+    }
+
+    if (protocol != NA_MEMPROTO_PROTOCOL_NOT_DETECTED) {
+        connpool->protocol[i] = protocol;
     }
-    connpool->mark[i] = 1;
+
     *fd  = connpool->fd_pool[i];
     *cur = i;
+
+    return true;
+}
+
+void na_connpool_release (na_connpool_t *connpool, int cur)
+{
+    if (connpool->state[cur] == NA_CONNPOOL_STATE_BROKEN ||
+        connpool->epoch[cur] != __atomic_load_n(&connpool->cur_epoch, __ATOMIC_ACQUIRE))
+    {
+        na_connpool_close(connpool, cur);
+        na_connpool_push(connpool, &connpool->empty, cur);
+        return;
+    }
+    __atomic_store_n(&connpool->state[cur], NA_CONNPOOL_STATE_IDLE, __ATOMIC_RELEASE);
+    na_connpool_push(connpool, &connpool->top, cur);
 }
 
-bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server)
+na_memproto_protocol_t na_connpool_protocol (na_connpool_t *connpool, int cur)
 {
-    int ri;
+    return connpool->protocol[cur];
+}
 
-    pthread_mutex_lock(&env->lock_connpool);
+void na_connpool_set_protocol (na_connpool_t *connpool, int cur, na_memproto_protocol_t protocol)
+{
+    connpool->protocol[cur] = protocol;
+}
 
-    ri = rand() % env->connpool_max;
-    if (connpool->mark[ri] == 0) {
-        na_connpool_assign_internal(env, connpool, ri, cur, fd, server);
-        pthread_mutex_unlock(&env->lock_connpool);
-        return true;
+void na_connpool_connected (na_connpool_t *connpool, int cur)
+{
+    if (connpool->state[cur] == NA_CONNPOOL_STATE_CONNECTING) {
+        connpool->state[cur] = NA_CONNPOOL_STATE_INUSE;
     }
+}
 
+void na_connpool_broken (na_connpool_t *connpool, int cur)
+{
+    connpool->state[cur] = NA_CONNPOOL_STATE_BROKEN;
+}
 
-    switch (rand() % 2) {
-    case 0:
-        for (int i=env->connpool_max-1;i>=0;--i) {
-            if (connpool->mark[i] == 0) {
-                na_connpool_assign_internal(env, connpool, i, cur, fd, server);
-                pthread_mutex_unlock(&env->lock_connpool);
-                return true;
-            }
-        }
-        break;
-    default:
-        for (int i=0;i<env->connpool_max;++i) {
-            if (connpool->mark[i] == 0) {
-                na_connpool_assign_internal(env, connpool, i, cur, fd, server);
-                pthread_mutex_unlock(&env->lock_connpool);
-                return true;
-            }
+int na_connpool_count (na_connpool_t *connpool, na_connpool_state_t state)
+{
+    int cnt;
+
+    cnt = 0;
+    for (int i=0;i<connpool->max;++i) {
+        if (connpool->state[i] == state) {
+            ++cnt;
         }
-        break;
     }
-    pthread_mutex_unlock(&env->lock_connpool);
-    return false;
+
+    return cnt;
+}
+
+const char *na_connpool_state_name (na_connpool_state_t state)
+{
+    return na_connpool_states[state];
+}
+
+na_connpool_t *na_connpool_select(na_env_t *env, int server, int idx)
+{
+    if (server >= env->target_server_cnt) {
+        return &env->connpool_backup[(server - env->target_server_cnt) * env->connpool_cnt + idx];
+    }
+    return &env->connpool_active[server * env->connpool_cnt + idx];
 }
 
-void na_connpool_init (na_env_t *env)
+/**
+ * leave the pools of the servers of tier from. idle connections are closed right now,
+ * and the others when they are released
+ */
+void na_connpool_switch (na_env_t *env, int from)
 {
-    for (int i=0;i<env->connpool_max;++i) {
-        env->connpool_active.fd_pool[i] = na_target_server_tcpsock_init();
-        na_target_server_tcpsock_setup(env->connpool_active.fd_pool[i], true);
-        if (env->connpool_active.fd_pool[i] <= 0) {
-            NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+    na_tier_t *tier;
+    na_connpool_t *connpool;
+
+    tier = &env->tiers[from];
+    for (int i=tier->first;i<tier->first + tier->cnt;++i) {
+        for (int j=0;j<env->connpool_cnt;++j) {
+            connpool = na_connpool_select(env, i, j);
+            __sync_add_and_fetch(&connpool->cur_epoch, 1);
+            na_connpool_check_idle(connpool);
         }
     }
 }
 
-na_connpool_t *na_connpool_select(na_env_t *env)
+/**
+ * close idle connections which are stale or closed by the server,
+ * and return the number of the idle ones left. slots are checked in place,
+ * so workers can take the others meanwhile
+ */
+int na_connpool_check_idle (na_connpool_t *connpool)
 {
-    if (env->is_refused_active) {
-        return &env->connpool_backup;
+    int cnt;
+    uint32_t epoch;
+
+    epoch = __atomic_load_n(&connpool->cur_epoch, __ATOMIC_ACQUIRE);
+    cnt   = 0;
+    for (int i=0;i<connpool->max;++i) {
+        if (na_connpool_check(connpool, i, epoch)) {
+            ++cnt;
+        }
     }
-    return &env->connpool_active;
+
+    return cnt;
 }
 
-void na_connpool_switch (na_env_t *env)
+/**
+ * take a free slot without connection and start connecting to server on it.
+ * the slot is kept out of the pool until na_connpool_standby_done is called
+ */
+bool na_connpool_standby (na_connpool_t *connpool, na_server_t *server, int *cur, int *fd)
 {
-    na_connpool_t *connpool;
-    if (env->is_refused_active) {
-        na_connpool_deactivate(&env->connpool_active);
-        connpool = &env->connpool_backup;
-    } else {
-        na_connpool_deactivate(&env->connpool_backup);
-        connpool = &env->connpool_active;
+    int i;
+    bool is_started;
+
+    if ((i = na_connpool_pop(connpool, &connpool->empty)) == -1) {
+        // a slot closed by a check is left in the idle stack. the top one is taken only if it is such one
+        if ((i = na_connpool_pop(connpool, &connpool->top)) == -1) {
+            return false;
+        }
+        if (__atomic_load_n(&connpool->state[i], __ATOMIC_ACQUIRE) != NA_CONNPOOL_STATE_CLOSED) {
+            na_connpool_push(connpool, &connpool->top, i);
+            return false;
+        }
     }
 
-    for (int i=0;i<env->connpool_max;++i) {
-        connpool->fd_pool[i] = na_target_server_tcpsock_init();
+    na_connpool_close(connpool, i);
+    is_started = false;
+    if ((connpool->fd_pool[i] = na_target_server_tcpsock_init()) > 0) {
         na_target_server_tcpsock_setup(connpool->fd_pool[i], true);
-        if (connpool->fd_pool[i] <= 0) {
-            NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
-        }
+        is_started = na_server_connect(connpool->fd_pool[i], &server->addr) ||
+                     errno == EINPROGRESS || errno == EALREADY;
+    }
+    if (!is_started) {
+        na_connpool_close(connpool, i);
+        na_connpool_push(connpool, &connpool->empty, i);
+        return false;
+    }
+    connpool->epoch[i] = __atomic_load_n(&connpool->cur_epoch, __ATOMIC_ACQUIRE);
+    connpool->state[i] = NA_CONNPOOL_STATE_CONNECTING;
+
+    *fd  = connpool->fd_pool[i];
+    *cur = i;
+
+    return true;
+}
+
+/**
+ * put the slot taken by na_connpool_standby back, idle if it got connected
+ */
+void na_connpool_standby_done (na_connpool_t *connpool, int cur, bool is_connected)
+{
+    if (!is_connected) {
+        na_connpool_close(connpool, cur);
+        na_connpool_push(connpool, &connpool->empty, cur);
+        return;
     }
+    __atomic_store_n(&connpool->state[cur], NA_CONNPOOL_STATE_IDLE, __ATOMIC_RELEASE);
+    na_connpool_push(connpool, &connpool->top, cur);
 }
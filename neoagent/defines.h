@@ -30,7 +30,7 @@
 #define NA_HOSTNAME_MAX     256
 #define NA_NAME_MAX          64
 #define NA_PATH_MAX         256
-#define NA_BM_SKIP_SIZE     256
+#define NA_CACHELINE_SIZE    64
 
 /**
  * time
@@ -51,10 +51,9 @@ typedef struct na_host_t {
 void na_set_nonblock (int fd);
 int na_target_server_tcpsock_init (void);
 void na_target_server_tcpsock_setup (int tsfd, bool is_keepalive);
-void na_target_server_hcsock_setup (int tsfd);
 void na_set_sockaddr (na_host_t *host, struct sockaddr_in *addr);
 na_host_t na_create_host(char *host);
-int na_front_server_tcpsock_init (uint16_t port, int conn_max);
+int na_front_server_tcpsock_init (uint16_t port, int conn_max, bool is_reuseport);
 int na_front_server_unixsock_init (char *sockpath, mode_t mask, int conn_max);
 int na_stat_server_unixsock_init (char *sockpath, mode_t mask);
 int na_stat_server_tcpsock_init (uint16_t port);
@@ -74,13 +73,72 @@ typedef enum na_memproto_cmd_t {
     NA_MEMPROTO_CMD_QUIT,
     NA_MEMPROTO_CMD_UNKNOWN,
     NA_MEMPROTO_CMD_NOT_DETECTED,
+    NA_MEMPROTO_CMD_GETS,
+    NA_MEMPROTO_CMD_REPLACE,
+    NA_MEMPROTO_CMD_APPEND,
+    NA_MEMPROTO_CMD_PREPEND,
+    NA_MEMPROTO_CMD_CAS,
+    NA_MEMPROTO_CMD_TOUCH,
+    NA_MEMPROTO_CMD_BINARY, // any binary protocol command but quit
+    NA_MEMPROTO_CMD_MG,
+    NA_MEMPROTO_CMD_MS,
+    NA_MEMPROTO_CMD_MD,
+    NA_MEMPROTO_CMD_MA,
+    NA_MEMPROTO_CMD_MN,
     NA_MEMPROTO_CMD_MAX // Always add new codes to the end before this one
 } na_memproto_cmd_t;
 
-void na_memproto_bm_skip_init (void);
-na_memproto_cmd_t na_memproto_detect_command (char *buf);
-int na_memproto_count_request_get(char *buf, int bufsize);
-int na_memproto_count_response_get(char *buf, int bufsize);
+typedef enum na_memproto_protocol_t {
+    NA_MEMPROTO_PROTOCOL_NOT_DETECTED,
+    NA_MEMPROTO_PROTOCOL_TEXT,
+    NA_MEMPROTO_PROTOCOL_BINARY,
+    NA_MEMPROTO_PROTOCOL_MAX // Always add new codes to the end before this one
+} na_memproto_protocol_t;
+
+#define NA_MEMPROTO_BINARY_HEADER_SIZE 24
+#define NA_MEMPROTO_NOOP_SIZE_MAX NA_MEMPROTO_BINARY_HEADER_SIZE
+
+typedef enum na_memproto_parse_state_t {
+    NA_MEMPROTO_PARSE_STATE_LINE,   // waiting for the end of command line or binary header
+    NA_MEMPROTO_PARSE_STATE_DATA,   // waiting for the end of data block
+    NA_MEMPROTO_PARSE_STATE_FRAMED, // a request was framed by the last call
+    NA_MEMPROTO_PARSE_STATE_MAX // Always add new codes to the end before this one
+} na_memproto_parse_state_t;
+
+typedef enum na_memproto_parse_result_t {
+    NA_MEMPROTO_PARSE_AGAIN, // need more bytes
+    NA_MEMPROTO_PARSE_DONE,  // a request is framed
+    NA_MEMPROTO_PARSE_ERROR,
+    NA_MEMPROTO_PARSE_MAX // Always add new codes to the end before this one
+} na_memproto_parse_result_t;
+
+typedef struct na_memproto_parser_t {
+    na_memproto_protocol_t protocol; // detected from the first byte of requests
+    na_memproto_parse_state_t state;
+    na_memproto_cmd_t cmd; // command of the request being parsed or framed last
+    uint8_t opcode;        // opcode of binary protocol command
+    bool is_quiet;         // the request framed last has no response on success
+    bool is_noreply;       // the request framed last has no response at all
+    int start;             // offset where the request being parsed begins
+    int line;              // offset where the line or binary header being parsed begins. the last one of a framed response
+    int off;               // offset parsed so far
+    int bytes;             // bytes of data block left including CRLF
+    int key_cnt;           // count of keys in a retrieval command or VALUEs in its response
+    int key;               // offset of the first key of the request framed last
+    int key_len;           // length of it, or 0 if the request has no key
+} na_memproto_parser_t;
+
+void na_memproto_parser_init (na_memproto_parser_t *parser);
+void na_memproto_parser_shift (na_memproto_parser_t *parser, int size);
+na_memproto_parse_result_t na_memproto_parse_request (na_memproto_parser_t *parser, char *buf, int bufsize);
+na_memproto_parse_result_t na_memproto_parse_response (na_memproto_parser_t *parser, na_memproto_cmd_t cmd, char *buf, int bufsize);
+int na_memproto_noop (na_memproto_protocol_t protocol, char *buf);
+bool na_memproto_is_write (na_memproto_parser_t *parser);
+char *na_memproto_next_key (char *p, char *end, int *len);
+bool na_memproto_is_end (char *line, char *end);
+bool na_memproto_is_server_error (char *line, char *end);
+bool na_memproto_find_value (char *buf, char *end, const char *key, int len, char **block, int *size);
+char *na_memproto_value_key (char *buf, char *end, int *len);
 
 /**
  * env
@@ -113,15 +171,153 @@ typedef enum na_log_format_t {
 typedef struct na_server_t {
     na_host_t host;
     struct sockaddr_in addr;
+    int weight;   // share of keys among the servers of the same tier
+    int priority; // order of backup servers to fail over to, smaller first
 } na_server_t;
 
+typedef struct na_ketama_point_t {
+    uint32_t hash;
+    int server;
+} na_ketama_point_t;
+
+typedef struct na_ketama_t {
+    na_ketama_point_t *points; // sorted by hash
+    int point_cnt;
+} na_ketama_t;
+
+typedef enum na_connpool_state_t {
+    NA_CONNPOOL_STATE_CLOSED,
+    NA_CONNPOOL_STATE_CONNECTING,
+    NA_CONNPOOL_STATE_IDLE,
+    NA_CONNPOOL_STATE_INUSE,
+    NA_CONNPOOL_STATE_BROKEN,
+    NA_CONNPOOL_STATE_CHECKING, // idle one being checked in place by the support loop
+    NA_CONNPOOL_STATE_MAX // Always add new codes to the end before this one
+} na_connpool_state_t;
+
 typedef struct na_connpool_t {
     int *fd_pool;
-    int *mark;
-    int *active;
+    na_connpool_state_t *state;
+    uint32_t *epoch; // epoch of the pool when the connection was made
+    na_memproto_protocol_t *protocol; // memcached fixes it by the first byte of connection
+    uint32_t *next;  // next free slot of each slot
+    uint64_t top;    // first idle slot and ABA tag
+    uint64_t empty;  // first free slot without connection and ABA tag
+    uint32_t cur_epoch;
     int max;
 } na_connpool_t;
 
+/**
+ * servers which keys are distributed over together. target servers are the first tier,
+ * and backup servers of the same priority make each of the others.
+ * servers are numbered from target servers through backup servers in order of priority.
+ */
+typedef struct na_tier_t {
+    int first; // number of the first server
+    int cnt;
+    na_ketama_t *ketama;
+} na_tier_t;
+
+typedef struct na_worker_t na_worker_t;
+
+typedef struct na_cache_entry_t {
+    struct na_cache_entry_t *hnext; // in the bucket
+    struct na_cache_entry_t *prev;  // on the clock
+    struct na_cache_entry_t *next;
+    uint32_t hash;
+    int key_len;
+    int size;      // of the response
+    double expire;
+    bool is_referenced; // hit since the hand passed it last
+    char data[];        // key followed by the response
+} na_cache_entry_t;
+
+/**
+ * the part of L1 cache for the keys of some buckets, with a lock, a clock and memory of its own
+ */
+typedef struct na_cache_shard_t {
+    na_cache_entry_t **buckets;
+    uint32_t *gens;   // bumped by writes to the keys of each bucket
+    uint32_t *writes; // writes to the keys of each bucket on the way
+    na_cache_entry_t *hand;
+    size_t memory; // of entries
+    size_t memory_max;
+    int entry_cnt;
+    uint64_t hit_cnt;
+    uint64_t miss_cnt;
+    uint64_t eviction_cnt;
+    pthread_mutex_t lock;
+    char pad[NA_CACHELINE_SIZE];
+} na_cache_shard_t;
+
+typedef struct na_cache_t {
+    na_cache_shard_t *shards;
+    int shard_cnt;
+    int bucket_cnt; // of each shard
+    double ttl;
+    char **prefixes;
+    int prefix_cnt;
+} na_cache_t;
+
+#define NA_HOTKEY_KEY_MAX 250
+
+typedef struct na_hotkey_slot_t {
+    uint32_t seq; // odd while the slot is written
+    uint32_t gen; // bumped when another key takes the slot
+    uint32_t hash;
+    int key_len;
+    uint64_t count;
+    uint64_t error; // count may be over by this at most
+    uint64_t bytes; // of responses
+    char key[NA_HOTKEY_KEY_MAX + 1];
+} na_hotkey_slot_t;
+
+/**
+ * slots of the same count are linked in a bucket, and buckets are linked in order of count
+ */
+typedef struct na_hotkey_bucket_t {
+    uint64_t count;
+    int head; // first slot
+    int prev; // bucket of fewer count, or -1
+    int next; // bucket of more count, or -1. next free one while it is free
+} na_hotkey_bucket_t;
+
+typedef struct na_hotkey_node_t {
+    int bucket;
+    int prev;  // in the bucket
+    int next;
+    int hnext; // in the chain of hash table
+} na_hotkey_node_t;
+
+typedef struct na_hotkey_t {
+    na_hotkey_slot_t *slots;
+    na_hotkey_node_t *nodes;     // of each slot
+    na_hotkey_bucket_t *buckets; // slot_max ones at most are in use
+    int *table;                  // chains of slots by hash of key
+    int table_mask;
+    int bucket_min;  // bucket of the fewest count, or -1
+    int bucket_free; // first free bucket
+    int slot_max;
+    int slot_cnt;
+    double window; // seconds after which counts are reset, or 0
+    double window_start;
+} na_hotkey_t;
+
+#define NA_HEALTH_ADMIT_FULL 100
+
+typedef struct na_health_t {
+    uint64_t req_cnt; // counted by workers
+    uint64_t err_cnt;
+    uint64_t latency_usec;
+    uint64_t last_req_cnt; // at the last evaluation
+    uint64_t last_err_cnt;
+    uint64_t last_latency_usec;
+    double error_rate; // EWMA
+    double latency;    // EWMA of mean latency in seconds
+    int admit;         // keys of the server whose hash % NA_HEALTH_ADMIT_FULL is under this go to it
+    uint64_t eject_cnt;
+} na_health_t;
+
 typedef struct na_ctl_env_t {
     char       binpath[NA_PATH_MAX + 1];
     int        fd;
@@ -142,29 +338,31 @@ typedef struct na_env_t {
     uint16_t fsport;
     int stfd;
     uint16_t stport;
-    int tsfd;
     char fssockpath[NA_PATH_MAX + 1];
     char stsockpath[NA_PATH_MAX + 1];
     mode_t access_mask;
     na_server_t target_server;
-    na_server_t backup_server;
-    int current_conn;
+    na_server_t backup_server;   // the first of backup_servers
+    na_server_t *target_servers; // keys are sharded among them
+    int target_server_cnt;
+    na_server_t *backup_servers; // failed over to in order of priority
+    int backup_server_cnt;
+    int server_cnt;              // target servers and backup servers
+    na_tier_t *tiers;
+    int tier_cnt;
     int current_conn_max;
     int request_bufsize;
     int response_bufsize;
     ev_io fs_watcher;
     bool is_use_backup;
-    bool is_refused_active;
-    bool is_refused_accept;
-    bool *is_worker_busy;
-    na_connpool_t connpool_active;
-    na_connpool_t connpool_backup;
-    pthread_mutex_t lock_connpool;
-    pthread_mutex_t lock_current_conn;
-    pthread_mutex_t lock_tid;
+    int active_tier;       // tier requests go to. 0 is target servers
+    uint32_t failover_gen; // bumped each time active_tier is switched
+    bool is_reuseport;
+    na_worker_t *workers;
+    na_connpool_t *connpool_active; // one for each worker in reuseport mode, for each target server
+    na_connpool_t *connpool_backup; // one for each worker in reuseport mode, for each backup server
+    int connpool_cnt;
     pthread_mutex_t lock_loop;
-    pthread_rwlock_t lock_refused;
-    pthread_rwlock_t *lock_worker_busy;
     na_event_model_t event_model;
     int worker_max;
     int conn_max;
@@ -172,6 +370,28 @@ typedef struct na_env_t {
     int client_pool_max;
     int loop_max;
     int try_max;
+    int hc_timeout_msec;
+    double eject_error_rate;
+    int eject_latency_msec;
+    int eject_min_requests;
+    int readmit_steps;
+    na_health_t *healths; // for each server. NULL unless ejection is enabled
+    struct na_hc_t *hc;   // NULL unless backup_server or ejection is used
+    int backup_standby_max;
+    struct na_standby_t *standby; // NULL unless backup_standby_max is set with backup servers
+    double worker_steal_interval;
+    int multiplex_conn_max;
+    int pipeline_max;
+    int multiget_keys_max;
+    bool is_get_collapse;
+    int get_batch_usec;
+    char **l1_cache_prefixes;
+    int l1_cache_prefix_cnt;
+    int l1_cache_memory_max;
+    int l1_cache_ttl_msec;
+    na_cache_t *l1_cache; // NULL if no prefix is configured
+    int hotkey_max;
+    int hotkey_window_sec;
     struct timespec slow_query_sec;
     char logpath[NA_PATH_MAX + 1];
     FILE *log_fp;
@@ -182,32 +402,213 @@ typedef struct na_env_t {
     mode_t slow_query_log_access_mask;
 } na_env_t;
 
+#define NA_HC_BUF_MAX 1024
+
+typedef enum na_hc_state_t {
+    NA_HC_STATE_IDLE,
+    NA_HC_STATE_CONNECTING,
+    NA_HC_STATE_SET,
+    NA_HC_STATE_GET,
+    NA_HC_STATE_DELETE,
+    NA_HC_STATE_RETRY,
+    NA_HC_STATE_MAX // Always add new codes to the end before this one
+} na_hc_state_t;
+
+/**
+ * health check of a server. a round of set, get and delete of the test key
+ * is tried up to try_max times on a connection kept between checks.
+ */
+typedef struct na_hc_probe_t {
+    struct na_hc_t *hc;
+    na_server_t *server;
+    int fd;
+    na_hc_state_t state;
+    int try_cnt;
+    const char *wbuf; // command in flight
+    size_t wbufsize;
+    size_t wbufoff;
+    const char *expected; // response to it
+    char rbuf[NA_HC_BUF_MAX];
+    size_t rbufsize;
+    ev_io watcher;
+    ev_timer timer; // timeout of a step, or interval before a retry
+    double start;   // of the round in progress
+    double latency; // seconds the last successful round took, or -1
+    bool is_healthy;
+    int fail_cnt;   // checks failed in a row
+    uint64_t check_cnt;
+} na_hc_probe_t;
+
+/**
+ * health checks run on the support loop. the servers are checked concurrently,
+ * and the next check starts after all of them are done. servers ejected for
+ * live traffic are readmitted by them.
+ */
+typedef struct na_hc_t {
+    na_env_t *env;
+    struct ev_loop *loop;
+    na_hc_probe_t *probes; // target servers, then backup server if it is used
+    int probe_cnt;
+    int pending;           // probes not done in the current check
+    double timeout;
+    ev_timer watcher;
+    ev_timer eject_watcher; // evaluation of healths from live traffic
+    char scmd[NA_HC_BUF_MAX]; // set
+    char gcmd[NA_HC_BUF_MAX]; // get
+    char dcmd[NA_HC_BUF_MAX]; // delete
+    char gres[NA_HC_BUF_MAX]; // get response
+} na_hc_t;
+
+#define NA_STANDBY_BUF_MAX 64
+
+/**
+ * connection being made to a backup server on a slot of its pool
+ */
+typedef struct na_standby_conn_t {
+    struct na_standby_t *standby;
+    na_connpool_t *connpool;
+    int cur;           // slot taken, or -1
+    bool is_connected; // version has been sent, and its response is read
+    char rbuf[NA_STANDBY_BUF_MAX];
+    size_t rbufsize;
+    ev_io watcher;
+    ev_timer timer;
+} na_standby_conn_t;
+
+/**
+ * standby connections to the backup servers failed over to next, kept in their pools
+ */
+typedef struct na_standby_t {
+    na_env_t *env;
+    na_standby_conn_t *conns; // backup_standby_max for each backup pool
+    int conn_cnt;
+    double timeout;
+    ev_timer watcher;
+} na_standby_t;
+
+/**
+ * connection to target server. it is owned by a client, or shared by
+ * the clients of a worker in multiplex mode. requests written to it wait
+ * in a fifo until their responses come back in the same order.
+ */
+typedef struct na_tsconn_t {
+    int fd;
+    int server;   // number of the server. see na_tier_t
+    int cur_pool; // slot in connpool, or -1
+    na_connpool_t *connpool;
+    na_env_t *env;
+    struct ev_loop *loop;
+    ev_io watcher;
+    uint32_t failover_gen; // of env when it was opened
+    bool is_shared;
+    bool is_draining; // left with requests on the way by failover
+    na_memproto_protocol_t protocol;
+    char *wbuf;
+    size_t wbufsize;
+    size_t wbufoff;
+    size_t wbufmax;
+    char *rbuf;
+    size_t rbufsize;
+    size_t rbufmax;
+    size_t wtotal; // bytes queued since connected
+    size_t wdone;  // bytes written since connected
+    struct na_request_t *head;
+    struct na_request_t *tail;
+    int request_cnt;
+    na_memproto_parser_t parser; // for responses in rbuf
+    struct na_request_t *batch; // gets of single key merged into one, not written yet
+    int batch_cnt;              // count of keys in it
+    char *bbuf;                 // request line of the merged get without CRLF
+    size_t bbufsize;
+    size_t bbufmax;
+    ev_timer batch_watcher;
+} na_tsconn_t;
+
+typedef struct na_collapse_t {
+    struct na_request_t **buckets;
+    int bucket_cnt;
+    int cnt;
+} na_collapse_t;
+
+/**
+ * a request is on the queue of a connection until it is answered, and on
+ * the queue of its client until the response is returned in order.
+ * a get collapsed into an identical one in flight or merged into a batch is on the waiters of it instead of a connection.
+ */
+typedef struct na_request_t {
+    struct na_client_t *client; // NULL once the client has gone
+    struct na_request_t *next;  // on the connection
+    struct na_request_t *cnext; // on the client
+    struct na_tsconn_t *tsconn; // connection it is queued on, or NULL if it waits for another one
+    struct na_request_t *waiters; // gets collapsed into this one
+    struct na_request_t *wnext;   // among waiters
+    na_collapse_t *collapse;      // table indexing this one, or NULL
+    struct na_request_t *hnext;   // in the bucket of collapse table
+    char *key;                    // copy of key for collapse table, or the request line of a merged get
+    int key_len;
+    int server;
+    uint32_t hash;
+    bool is_batch; // a get merged from gets of single key, which are the waiters of it
+    int boff;      // offset of key in the request line of the merged get
+    bool is_cache_fill;  // the response is stored into L1 cache
+    uint32_t cache_gen;  // generation of key in L1 cache when this one is sent
+    na_hotkey_slot_t *hslot; // hot key slot of the first key, which the size of response is added to
+    uint32_t hgen;
+    uint32_t *cache_writes; // hashes of keys in L1 cache it writes, not cached until it is answered
+    int cache_write_cnt;
+    double start; // when it is queued on the connection
+    na_memproto_cmd_t cmd;
+    int res_cnt; // responses still expected. 0 for noreply
+    size_t wend; // wtotal of the connection at the end of this request
+    bool is_written;
+    bool is_noop_appended; // the response to noop added after quiet commands is not returned
+    bool is_end_dropped;   // a part of multi-get but the last, whose END is not returned
+    bool is_done; // answered. the response waits in rbuf for earlier ones
+    char *rbuf;
+    size_t rbufsize;
+    size_t rbufmax;
+} na_request_t;
+
+typedef struct na_multiget_key_t {
+    int off; // in crbuf
+    int len;
+    int server;
+} na_multiget_key_t;
+
 typedef struct na_client_t {
     int cfd;
-    int tsfd;
     char *crbuf;
     char *srbuf;
     int crbufsize;
     int cwbufsize;
     int srbufsize;
-    int swbufsize;
     int request_bufsize;
     int response_bufsize;
     na_memproto_cmd_t cmd;
-    bool is_refused_active;
-    bool is_use_connpool;
     bool is_use_client_pool;
-    bool is_used;
     na_env_t *env;
+    na_worker_t *worker;
+    struct na_client_t *prev; // clients of the same worker
+    struct na_client_t *next;
     na_event_state_t event_state;
-    na_connpool_t *connpool;
-    int req_cnt;
-    int res_cnt;
+    struct na_client_pool_t *client_pool;
+    na_tsconn_t *tsconns; // one for each server. not used in multiplex mode
+    uint32_t failover_gen; // of env when its connections were checked last
+    na_request_t *rhead; // requests in the order responses are returned
+    na_request_t *rtail;
+    int request_cnt; // requests waiting for response
+    int cfwdsize; // bytes of crbuf already forwarded
+    int cqstart; // start of quiet commands not forwarded yet, or -1
+    int cqserver; // target server of them
+    na_hotkey_slot_t *hslot; // hot key slot of the request being forwarded
+    uint32_t hgen;
+    uint32_t *cache_writes; // of the writes framed but not forwarded yet
+    int cache_write_cnt;
+    int cache_write_max;
+    bool is_quit; // close after responses on the way are returned
+    na_memproto_parser_t parser;
     int loop_cnt;
-    int cur_pool;
     ev_io c_watcher;
-    ev_io ts_watcher;
-    pthread_mutex_t lock_use;
     struct timespec na_from_ts_time_begin;
     struct timespec na_from_ts_time_end;
     struct timespec na_to_ts_time_begin;
@@ -216,9 +617,36 @@ typedef struct na_client_t {
     struct timespec na_to_client_time_end;
 } na_client_t;
 
+struct na_worker_t {
+    int id;
+    int fsfd;
+    na_env_t *env;
+    struct ev_loop *loop;
+    ev_io fs_watcher;
+    ev_async async_watcher;
+    ev_timer steal_watcher;
+    struct na_event_queue_t *queue;
+    struct na_client_pool_t *client_pool;
+    na_client_t *clients;
+    na_tsconn_t *tsconns; // shared by clients in multiplex mode. for each server, text protocol ones first and binary ones follow
+    uint32_t failover_gen; // of env when tsconns were checked last
+    int client_cnt; // live clients served by this worker
+    int request_cnt;
+    int steal_cnt;
+    int migrate_to; // id of the worker asking for idle clients, or -1
+    na_collapse_t *collapse; // gets in flight which identical ones are collapsed into, or NULL if disabled
+    int collapse_cnt; // gets answered with the response to another
+    char *cache_buf;  // a response copied out of L1 cache
+    size_t cache_bufmax;
+    na_hotkey_t *hotkey; // most requested keys, or NULL if disabled
+};
+
 void na_ctl_env_setup_default(na_ctl_env_t *ctl_env);
 void na_env_setup_default(na_env_t *env, int idx);
 void na_env_init(na_env_t *env);
+na_server_t *na_env_server(na_env_t *env, int server);
+na_tier_t *na_env_active_tier(na_env_t *env);
+int na_env_current_conn(na_env_t *env);
 
 void na_connpool_create (na_connpool_t *connpool, int c);
 void na_connpool_destroy (na_connpool_t *connpool);
@@ -266,6 +694,7 @@ typedef enum na_error_t {
     NA_ERROR_INVALID_CTL_CMD,
     NA_ERROR_FAILED_EXECUTE_CTM_CMD,
     NA_ERROR_UNKNOWN,
+    NA_ERROR_INVALID_RESPONSE,
     NA_ERROR_MAX // Always add new codes to the end before this one
 } na_error_t;
 
@@ -332,32 +761,122 @@ void na_ctl_die_with_error(na_ctl_env_t *env, na_error_t na_error, na_error_info
 void *na_event_loop (void *args);
 
 /**
- * bm
+ * scan
  */
-void na_bm_create_table (char *pattern, int *skip, size_t skip_size);
-int na_bm_search (char *haystack, char *pattern, int *skip, int hlen, int plen);
+void na_scan_init (void);
+const char *na_scan_kernel_name (void);
+char *na_scan_lf (char *buf, size_t len);
 
 /**
  * connpool
  */
-void na_connpool_create (na_connpool_t *connpool, int c);
-void na_connpool_destroy (na_connpool_t *connpool);
-bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server);
-void na_connpool_init (na_env_t *env);
-na_connpool_t *na_connpool_select(na_env_t *env);
-void na_connpool_switch (na_env_t *env);
+bool na_connpool_assign (na_env_t *env, na_connpool_t *connpool, int *cur, int *fd, na_server_t *server, na_memproto_protocol_t protocol);
+void na_connpool_release (na_connpool_t *connpool, int cur);
+na_memproto_protocol_t na_connpool_protocol (na_connpool_t *connpool, int cur);
+void na_connpool_set_protocol (na_connpool_t *connpool, int cur, na_memproto_protocol_t protocol);
+void na_connpool_connected (na_connpool_t *connpool, int cur);
+void na_connpool_broken (na_connpool_t *connpool, int cur);
+int na_connpool_count (na_connpool_t *connpool, na_connpool_state_t state);
+const char *na_connpool_state_name (na_connpool_state_t state);
+na_connpool_t *na_connpool_select(na_env_t *env, int server, int idx);
+void na_connpool_switch (na_env_t *env, int from);
+int na_connpool_check_idle (na_connpool_t *connpool);
+bool na_connpool_standby (na_connpool_t *connpool, na_server_t *server, int *cur, int *fd);
+void na_connpool_standby_done (na_connpool_t *connpool, int cur, bool is_connected);
+
+/**
+ * collapse
+ */
+na_collapse_t *na_collapse_create (int bucket_cnt);
+void na_collapse_destroy (na_collapse_t *collapse);
+na_request_t *na_collapse_find (na_collapse_t *collapse, int server, const char *key, int len);
+bool na_collapse_add (na_collapse_t *collapse, na_request_t *request, int server, const char *key, int len);
+void na_collapse_remove (na_request_t *request);
+void na_collapse_invalidate (na_collapse_t *collapse, int server, const char *key, int len);
+
+/**
+ * cache
+ */
+na_cache_t *na_cache_create (size_t memory_max, double ttl, char **prefixes, int prefix_cnt);
+void na_cache_destroy (na_cache_t *cache);
+bool na_cache_is_target (na_cache_t *cache, const char *key, int len);
+int na_cache_get (na_cache_t *cache, const char *key, int len, double now, char **buf, size_t *bufmax);
+uint32_t na_cache_generation (na_cache_t *cache, const char *key, int len);
+void na_cache_set (na_cache_t *cache, const char *key, int len, const char *data, int size, uint32_t gen, double now);
+uint32_t na_cache_write_begin (na_cache_t *cache, const char *key, int len);
+void na_cache_write_end (na_cache_t *cache, uint32_t hash);
+size_t na_cache_memory (na_cache_t *cache);
+int na_cache_entry_cnt (na_cache_t *cache);
+uint64_t na_cache_hit_cnt (na_cache_t *cache);
+uint64_t na_cache_miss_cnt (na_cache_t *cache);
+uint64_t na_cache_eviction_cnt (na_cache_t *cache);
+
+/**
+ * hotkey
+ */
+na_hotkey_t *na_hotkey_create (int slot_max, double window);
+void na_hotkey_destroy (na_hotkey_t *hotkey);
+na_hotkey_slot_t *na_hotkey_count (na_hotkey_t *hotkey, const char *key, int len, double now, uint32_t *gen);
+void na_hotkey_add_bytes (na_hotkey_slot_t *slot, uint32_t gen, int size);
+int na_hotkey_snapshot (na_hotkey_t *hotkey, na_hotkey_slot_t *snapshot, double now);
+
+/**
+ * health
+ */
+na_health_t *na_health_create (int cnt);
+void na_health_count (na_health_t *health, bool is_error, double latency);
+bool na_health_evaluate (na_health_t *health, int min_requests);
+void na_health_eject (na_health_t *health);
+int na_health_admit (na_health_t *health);
+void na_health_readmit (na_health_t *health, int steps);
+int na_health_first (na_health_t *healths, int cnt);
+
+/**
+ * ketama
+ */
+na_ketama_t *na_ketama_create (na_server_t *servers, int server_cnt);
+void na_ketama_destroy (na_ketama_t *ketama);
+uint32_t na_ketama_key_hash (const char *key, int len);
+int na_ketama_lookup (na_ketama_t *ketama, const char *key, int len, na_health_t *healths);
+
+/**
+ * clientpool
+ */
+typedef struct na_client_pool_t {
+    na_client_t *clients;
+    uint32_t *next; // next free slot of each slot
+    uint64_t top;   // first free slot and ABA tag
+    int max;
+    int used;
+    int tsconn_cnt; // connections of each client
+} na_client_pool_t;
+
+na_client_pool_t *na_client_pool_create (na_env_t *env);
+void na_client_pool_destroy (na_client_pool_t *pool);
+na_client_t *na_client_pool_assign (na_client_pool_t *pool);
+void na_client_pool_release (na_client_pool_t *pool, na_client_t *client);
 
 /**
  * queue
  */
+typedef struct na_event_queue_cell_t {
+    size_t seq;
+    na_client_t *client;
+} na_event_queue_cell_t;
+
+/**
+ * bounded lock-free multi-producer/multi-consumer ring.
+ * consumers do not block on it; idle workers sleep in their event loop
+ * and are woken by ev_async after a push.
+ */
 typedef struct na_event_queue_t {
-    na_client_t **queue;
-    size_t top;
-    size_t bot;
-    size_t cnt;
-    size_t max;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    na_event_queue_cell_t *cells;
+    size_t mask;
+    char pad0[NA_CACHELINE_SIZE];
+    size_t enq;
+    char pad1[NA_CACHELINE_SIZE - sizeof(size_t)];
+    size_t deq;
+    char pad2[NA_CACHELINE_SIZE - sizeof(size_t)];
 } na_event_queue_t;
 
 na_event_queue_t *na_event_queue_create(int c);
@@ -373,7 +892,14 @@ void *na_ctl_loop (void *args);
 /**
  * hc
  */
-void na_hc_callback (EV_P_ ev_timer *w, int revents);
+na_hc_t *na_hc_create (na_env_t *env);
+void na_hc_start (EV_P_ na_hc_t *hc);
+
+/**
+ * standby
+ */
+na_standby_t *na_standby_create (na_env_t *env);
+void na_standby_start (EV_P_ na_standby_t *standby);
 
 /**
  * log
@@ -21,6 +21,16 @@ static const int  NA_ACCESS_MASK_DEFAULT      = 0664;
 static const int  NA_BUFSIZE_DEFAULT          = 65536;
 static const int  NA_WORKER_MAX_DEFAULT       = 1;
 static const int  NA_TRY_MAX_DEFAULT          = 3;
+static const int  NA_PIPELINE_MAX_DEFAULT     = 64;
+static const int  NA_L1_CACHE_MEMORY_MAX_DEFAULT = 16777216;
+static const int  NA_L1_CACHE_TTL_MSEC_DEFAULT   = 1000;
+static const int  NA_HOTKEY_WINDOW_SEC_DEFAULT   = 60;
+static const int  NA_HC_TIMEOUT_MSEC_DEFAULT     = 4000;
+static const int  NA_EJECT_MIN_REQUESTS_DEFAULT  = 10;
+static const int  NA_READMIT_STEPS_DEFAULT       = 4;
+
+// private functions
+static void na_env_tiers_init (na_env_t *env);
 
 void na_ctl_env_setup_default(na_ctl_env_t *ctl_env)
 {
@@ -45,7 +55,37 @@ void na_env_setup_default(na_env_t *env, int idx)
     env->connpool_max            = NA_CONNPOOL_MAX_DEFAULT;
     env->client_pool_max         = NA_CLIENT_POOL_MAX_DEFAULT;
     env->try_max                 = NA_TRY_MAX_DEFAULT;
+    env->hc_timeout_msec         = NA_HC_TIMEOUT_MSEC_DEFAULT;
+    env->eject_error_rate        = 0;
+    env->eject_latency_msec      = 0;
+    env->eject_min_requests      = NA_EJECT_MIN_REQUESTS_DEFAULT;
+    env->readmit_steps           = NA_READMIT_STEPS_DEFAULT;
+    env->healths                 = NULL;
+    env->hc                      = NULL;
+    env->backup_standby_max      = 0;
+    env->standby                 = NULL;
     env->is_use_backup           = false;
+    env->is_reuseport            = false;
+    env->worker_steal_interval   = 0.0;
+    env->multiplex_conn_max      = 0;
+    env->pipeline_max            = NA_PIPELINE_MAX_DEFAULT;
+    env->multiget_keys_max       = 0;
+    env->is_get_collapse         = false;
+    env->get_batch_usec          = 0;
+    env->l1_cache_prefixes       = NULL;
+    env->l1_cache_prefix_cnt     = 0;
+    env->l1_cache_memory_max     = NA_L1_CACHE_MEMORY_MAX_DEFAULT;
+    env->l1_cache_ttl_msec       = NA_L1_CACHE_TTL_MSEC_DEFAULT;
+    env->l1_cache                = NULL;
+    env->hotkey_max              = 0;
+    env->hotkey_window_sec       = NA_HOTKEY_WINDOW_SEC_DEFAULT;
+    env->target_servers          = NULL;
+    env->target_server_cnt       = 0;
+    env->backup_servers          = NULL;
+    env->backup_server_cnt       = 0;
+    env->server_cnt              = 0;
+    env->tiers                   = NULL;
+    env->tier_cnt                = 0;
     env->request_bufsize         = NA_BUFSIZE_DEFAULT;
     env->response_bufsize        = NA_BUFSIZE_DEFAULT;
     memset(&env->slow_query_sec, 0, sizeof(struct timespec));
@@ -58,25 +98,143 @@ void na_env_setup_default(na_env_t *env, int idx)
 
 void na_env_init(na_env_t *env)
 {
-    env->current_conn      = 0;
-    env->is_refused_active = false;
-    env->is_refused_accept = false;
-    env->is_worker_busy    = calloc(sizeof(bool), env->worker_max);
-    for (int j=0;j<env->worker_max;++j) {
-        env->is_worker_busy[j] = false;
-    }
+    env->active_tier      = 0;
+    env->failover_gen     = 0;
     env->current_conn_max = 0;
-    pthread_mutex_init(&env->lock_connpool,     NULL);
-    pthread_mutex_init(&env->lock_current_conn, NULL);
-    pthread_mutex_init(&env->lock_tid,          NULL);
-    pthread_mutex_init(&env->lock_loop,         NULL);
-    pthread_rwlock_init(&env->lock_refused, NULL);
-    env->lock_worker_busy = calloc(sizeof(pthread_rwlock_t), env->worker_max);
-    for (int j=0;j<env->worker_max;++j) {
-        pthread_rwlock_init(&env->lock_worker_busy[j], NULL);
-    }
-    na_connpool_create(&env->connpool_active, env->connpool_max);
-    if (env->is_use_backup) {
-        na_connpool_create(&env->connpool_backup, env->connpool_max);
+    pthread_mutex_init(&env->lock_loop, NULL);
+    if (env->target_server_cnt == 0) {
+        env->target_server_cnt = 1;
+        env->target_servers    = calloc(sizeof(na_server_t), 1);
+        memcpy(&env->target_servers[0], &env->target_server, sizeof(na_server_t));
+        env->target_servers[0].weight = 1;
+    } else {
+        memcpy(&env->target_server, &env->target_servers[0], sizeof(na_server_t));
+    }
+    if (env->is_use_backup && env->backup_server_cnt == 0) {
+        env->backup_server_cnt = 1;
+        env->backup_servers    = calloc(sizeof(na_server_t), 1);
+        memcpy(&env->backup_servers[0], &env->backup_server, sizeof(na_server_t));
+        env->backup_servers[0].weight   = 1;
+        env->backup_servers[0].priority = 1;
+    }
+    na_env_tiers_init(env);
+    if (env->l1_cache_prefix_cnt > 0 && env->l1_cache_memory_max > 0) {
+        env->l1_cache = na_cache_create(env->l1_cache_memory_max, env->l1_cache_ttl_msec / 1000.0,
+                                        env->l1_cache_prefixes, env->l1_cache_prefix_cnt);
+        if (env->l1_cache == NULL) {
+            NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+        }
+    }
+    // ejection moves keys to other target servers, or fails over to backup server
+    if ((env->eject_error_rate > 0 || env->eject_latency_msec > 0) &&
+        (env->is_use_backup || env->target_server_cnt > 1))
+    {
+        env->healths = na_health_create(env->server_cnt);
+        if (env->healths == NULL) {
+            NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+        }
+    }
+    if (env->is_use_backup || env->healths != NULL) {
+        env->hc = na_hc_create(env);
+        if (env->hc == NULL) {
+            NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+        }
+    }
+    env->connpool_cnt    = env->is_reuseport ? env->worker_max : 1;
+    env->connpool_active = calloc(sizeof(na_connpool_t), env->connpool_cnt * env->target_server_cnt);
+    env->connpool_backup = calloc(sizeof(na_connpool_t), env->connpool_cnt * env->backup_server_cnt);
+    for (int j=0;j<env->connpool_cnt * env->target_server_cnt;++j) {
+        na_connpool_create(&env->connpool_active[j], env->connpool_max);
+    }
+    for (int j=0;j<env->connpool_cnt * env->backup_server_cnt;++j) {
+        na_connpool_create(&env->connpool_backup[j], env->connpool_max);
+    }
+    if (env->is_use_backup && env->backup_standby_max > 0) {
+        env->standby = na_standby_create(env);
+        if (env->standby == NULL) {
+            NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+        }
+    }
+}
+
+/**
+ * sort backup servers by priority in a stable way, and make tiers of them after target servers
+ */
+static void na_env_tiers_init (na_env_t *env)
+{
+    na_server_t server;
+    na_server_t *servers;
+    int j;
+
+    for (int i=1;i<env->backup_server_cnt;++i) {
+        memcpy(&server, &env->backup_servers[i], sizeof(na_server_t));
+        for (j=i;j>0 && env->backup_servers[j - 1].priority > server.priority;--j) {
+            memcpy(&env->backup_servers[j], &env->backup_servers[j - 1], sizeof(na_server_t));
+        }
+        memcpy(&env->backup_servers[j], &server, sizeof(na_server_t));
+    }
+    if (env->backup_server_cnt > 0) {
+        memcpy(&env->backup_server, &env->backup_servers[0], sizeof(na_server_t));
+    }
+    env->server_cnt = env->target_server_cnt + env->backup_server_cnt;
+
+    env->tiers = calloc(sizeof(na_tier_t), env->backup_server_cnt + 1);
+    if (env->tiers == NULL) {
+        NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+    }
+    env->tiers[0].first = 0;
+    env->tiers[0].cnt   = env->target_server_cnt;
+    env->tier_cnt       = 1;
+    for (int i=0;i<env->backup_server_cnt;++i) {
+        if (i == 0 || env->backup_servers[i].priority != env->backup_servers[i - 1].priority) {
+            env->tiers[env->tier_cnt].first = env->target_server_cnt + i;
+            ++env->tier_cnt;
+        }
+        ++env->tiers[env->tier_cnt - 1].cnt;
+    }
+
+    for (int i=0;i<env->tier_cnt;++i) {
+        servers = na_env_server(env, env->tiers[i].first);
+        env->tiers[i].ketama = na_ketama_create(servers, env->tiers[i].cnt);
+        if (env->tiers[i].ketama == NULL) {
+            NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+        }
     }
 }
+
+/**
+ * target servers are numbered first, then backup servers
+ */
+na_server_t *na_env_server(na_env_t *env, int server)
+{
+    if (server < env->target_server_cnt) {
+        return &env->target_servers[server];
+    }
+    return &env->backup_servers[server - env->target_server_cnt];
+}
+
+/**
+ * tier requests go to now. it is switched by failover on the support loop
+ */
+na_tier_t *na_env_active_tier(na_env_t *env)
+{
+    return &env->tiers[__atomic_load_n(&env->active_tier, __ATOMIC_ACQUIRE)];
+}
+
+/**
+ * clients connected now. each worker counts its own clients, so they are summed
+ */
+int na_env_current_conn(na_env_t *env)
+{
+    int cnt;
+
+    cnt = 0;
+    if (env->workers == NULL) {
+        return 0;
+    }
+    for (int i=0;i<env->worker_max;++i) {
+        cnt += __atomic_load_n(&env->workers[i].client_cnt, __ATOMIC_RELAXED);
+    }
+
+    return cnt;
+}
@@ -39,7 +39,8 @@ const char *na_error_messages[NA_ERROR_MAX] = {
     [NA_ERROR_FAILED_CREATE_PROCESS] = "failed to create process",
     [NA_ERROR_INVALID_CTL_CMD]       = "invalid ctl command",
     [NA_ERROR_FAILED_EXECUTE_CTM_CMD]= "failed to execute ctl command",
-    [NA_ERROR_UNKNOWN]               = "unknown error"
+    [NA_ERROR_UNKNOWN]               = "unknown error",
+    [NA_ERROR_INVALID_RESPONSE]      = "invalid response from server"
 };
 
 #define NA_ERROR_OUTPUT_INTERNAL(env, message, info)                    \
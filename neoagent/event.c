@@ -15,30 +15,75 @@
 
 #include "defines.h"
 
+static const int NA_COLLAPSE_BUCKET_MAX = 1024;
+static const int NA_GET_BATCH_KEYS_MAX  = 100;
+
 #define NA_EVENT_FAIL(na_error, loop, w, client, env) do {  \
         na_event_stop(loop, w, client, env);                \
         NA_ERROR_OUTPUT_MESSAGE(env, na_error);                   \
     } while(false)
 
 // globals
-static na_client_t *ClientPool;
-static na_event_queue_t *EventQueue = NULL;
+static na_client_pool_t *ClientPool;
 
 // refs to external globals
 na_graceful_phase_t  GracefulPhase;
 
 // private functions
 inline static void na_event_stop (EV_P_ struct ev_io *w, na_client_t *client, na_env_t *env);
-inline static void na_event_switch (EV_P_ struct ev_io *old, ev_io *new, int fd, int revent);
 
 static struct ev_loop *na_event_loop_create (na_event_model_t model);
-static int na_client_assign (na_env_t *env);
+static void na_client_start (EV_P_ na_client_t *client);
+static void na_client_unlink (na_client_t *client);
+static void na_client_migrate (na_client_t *client, na_worker_t *to);
 static void na_client_close (EV_P_ na_client_t *client, na_env_t *env);
-static void na_target_server_callback (EV_P_ struct ev_io *w, int revents);
+static void na_buf_reserve (char **buf, size_t *bufmax, size_t size);
+static na_request_t *na_request_create (na_client_t *client, na_memproto_cmd_t cmd, int res_cnt);
+static void na_request_handover (EV_P_ na_request_t *request);
+static void na_request_abandon (EV_P_ na_request_t *request);
+static bool na_tsconn_open (na_env_t *env, na_tsconn_t *tsconn, int server, int pool_idx, na_memproto_protocol_t protocol);
+static void na_tsconn_close (na_tsconn_t *tsconn);
+static void na_tsconn_update (na_tsconn_t *tsconn);
+static void na_tsconn_fail (EV_P_ na_tsconn_t *tsconn, na_error_t na_error);
+static void na_tsconn_retire (EV_P_ na_tsconn_t *tsconn);
+static na_health_t *na_tsconn_health (na_tsconn_t *tsconn);
+static na_tsconn_t *na_tsconn_select (na_worker_t *worker, int server, na_memproto_protocol_t protocol);
+static void na_tsconn_deliver (EV_P_ na_request_t *request, char *buf, int size);
+static void na_tsconn_deliver_batch (EV_P_ na_request_t *batch, char *buf, int size);
+static void na_tsconn_fill_cache (EV_P_ na_request_t *request, char *buf, int size);
+static void na_tsconn_flush_batch (na_tsconn_t *tsconn);
+static void na_tsconn_batch_callback (EV_P_ ev_timer *w, int revents);
+static na_request_t *na_tsconn_shift (na_tsconn_t *tsconn);
+static void na_tsconn_enqueue (EV_P_ na_tsconn_t *tsconn, na_request_t *request, char *buf, int size);
+static void na_tsconn_complete_noreply (EV_P_ na_tsconn_t *tsconn);
+static void na_tsconn_callback (EV_P_ struct ev_io *w, int revents);
+static int na_client_route (na_client_t *client);
+static int na_client_route_key (na_env_t *env, na_tier_t *tier, const char *key, int len);
+static bool na_client_is_tier_split (na_env_t *env, na_tier_t *tier);
+static void na_client_failover (EV_P_ na_client_t *client);
+static na_tsconn_t *na_client_tsconn (EV_P_ na_client_t *client, int server);
+static na_request_t *na_client_forward (EV_P_ na_client_t *client, char *buf, int size, int server, na_memproto_cmd_t cmd, int res_cnt, bool is_noop_appended);
+static bool na_client_is_multiget_split (na_client_t *client);
+static bool na_client_forward_multiget (EV_P_ na_client_t *client);
+static bool na_client_is_single_get (na_client_t *client);
+static bool na_client_forward_get (EV_P_ na_client_t *client, int start, int server);
+static bool na_client_can_join (na_client_t *client, na_request_t *leader, int server);
+static na_request_t *na_client_batch_get (EV_P_ na_client_t *client, int server);
+static na_request_t *na_client_forward_multiget_part (EV_P_ na_client_t *client, char *buf, int size, int server);
+static bool na_client_flush_quiet (EV_P_ na_client_t *client, int end);
+static void na_client_write_begin (na_client_t *client, int server);
+static void na_request_write_end (na_request_t *request);
+static void na_client_update (EV_P_ na_client_t *client);
+static void na_client_compact (na_client_t *client);
 static void na_client_callback (EV_P_ struct ev_io *w, int revents);
+static na_client_t *na_front_server_accept (na_env_t *env, int fsfd, na_client_pool_t *client_pool, int pool_idx);
 static void na_front_server_callback (EV_P_ struct ev_io *w, int revents);
-static bool na_is_worker_busy(na_env_t *env);
-static void *na_event_observer(void *args);
+static void na_front_server_worker_callback (EV_P_ struct ev_io *w, int revents);
+static na_worker_t *na_worker_select(na_env_t *env);
+static void na_worker_async_callback (EV_P_ ev_async *w, int revents);
+static void na_worker_release_idle (na_worker_t *worker);
+static void na_worker_steal_callback (EV_P_ ev_timer *w, int revents);
+static void *na_event_worker(void *args);
 static void *na_support_loop (void *args);
 
 inline static void na_event_stop (EV_P_ struct ev_io *w, na_client_t *client, na_env_t *env)
@@ -47,13 +92,6 @@ inline static void na_event_stop (EV_P_ struct ev_io *w, na_client_t *client, na
     na_client_close(EV_A_ client, env);
 }
 
-inline static void na_event_switch (EV_P_ struct ev_io *old, struct ev_io *new, int fd, int revent)
-{
-    ev_io_stop(EV_A_ old);
-    ev_io_set(new, fd, revent);
-    ev_io_start(EV_A_ new);
-}
-
 static struct ev_loop *na_event_loop_create(na_event_model_t model)
 {
     struct ev_loop *loop;
@@ -78,251 +116,1566 @@ static struct ev_loop *na_event_loop_create(na_event_model_t model)
     return loop;
 }
 
-static int na_client_assign (na_env_t *env)
+static void na_client_start (EV_P_ na_client_t *client)
 {
-    int ri;
-
-    ri = rand() % env->client_pool_max;
-    pthread_mutex_lock(&ClientPool[ri].lock_use);
-    if (ClientPool[ri].is_used == false) {
-        ClientPool[ri].is_used = true;
-        pthread_mutex_unlock(&ClientPool[ri].lock_use);
-        return ri;
+    na_worker_t *worker;
+
+    // clients are linked only from the thread running the worker's loop
+    worker       = client->worker;
+    client->prev = NULL;
+    client->next = worker->clients;
+    if (worker->clients != NULL) {
+        worker->clients->prev = client;
     }
-    pthread_mutex_unlock(&ClientPool[ri].lock_use);
+    worker->clients = client;
 
-    switch (rand() % 2) {
-    case 0:
-        for (int i=env->client_pool_max-1;i>=0;--i) {
-            pthread_mutex_lock(&ClientPool[i].lock_use);
-            if (ClientPool[i].is_used == false) {
-                ClientPool[i].is_used = true;
-                pthread_mutex_unlock(&ClientPool[i].lock_use);
-                return i;
-            }
-            pthread_mutex_unlock(&ClientPool[i].lock_use);
-        }
-        break;
-    default:
-        for (int i=0;i<env->client_pool_max;++i) {
-            pthread_mutex_lock(&ClientPool[i].lock_use);
-            if (ClientPool[i].is_used == false) {
-                ClientPool[i].is_used = true;
-                pthread_mutex_unlock(&ClientPool[i].lock_use);
-                return i;
-            }
-            pthread_mutex_unlock(&ClientPool[i].lock_use);
-        }
-        break;
+    ev_io_init(&client->c_watcher, na_client_callback, client->cfd, EV_READ);
+    ev_io_start(EV_A_ &client->c_watcher);
+}
+
+static void na_client_unlink (na_client_t *client)
+{
+    na_worker_t *worker;
+
+    worker = client->worker;
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else if (worker->clients == client) {
+        worker->clients = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
     }
-    return -1;
+    client->prev = NULL;
+    client->next = NULL;
+}
+
+static void na_client_migrate (na_client_t *client, na_worker_t *to)
+{
+    na_worker_t *from;
+
+    from           = client->worker;
+    client->worker = to;
+    __sync_sub_and_fetch(&from->client_cnt, 1);
+    __sync_add_and_fetch(&to->client_cnt, 1);
 }
 
 static void na_client_close (EV_P_ na_client_t *client, na_env_t *env)
 {
+    na_worker_t *worker;
+    na_request_t *request, *next;
+
+    worker = client->worker;
     close(client->cfd);
     ev_io_stop(EV_A_ &client->c_watcher);
-    ev_io_stop(EV_A_ &client->ts_watcher);
     client->cfd = -1;
-    pthread_mutex_lock(&env->lock_connpool);
-    if (client->is_use_connpool) {
-        if (client->connpool->mark[client->cur_pool] == 0) {
-            close(client->connpool->fd_pool[client->cur_pool]);
+
+    // responses on the way are thrown away when they arrive
+    for (request = client->rhead;request != NULL;request = next) {
+        next = request->cnext;
+        if (request->is_done) {
+            NA_FREE(request->rbuf);
+            NA_FREE(request);
+        } else {
+            request->client = NULL;
         }
-        client->tsfd = -1;
-        client->connpool->mark[client->cur_pool] = 0;
-    } else {
-        close(client->tsfd);
-        client->tsfd = -1;
     }
-    pthread_mutex_unlock(&env->lock_connpool);
+    client->rhead       = NULL;
+    client->rtail       = NULL;
+    client->request_cnt = 0;
+    for (int i=0;i<client->cache_write_cnt;++i) {
+        na_cache_write_end(env->l1_cache, client->cache_writes[i]);
+    }
+    NA_FREE(client->cache_writes);
+    client->cache_write_cnt = 0;
+    client->cache_write_max = 0;
+    for (int i=0;i<env->server_cnt;++i) {
+        for (request = client->tsconns[i].head;request != NULL;request = request->next) {
+            na_request_handover(EV_A_ request);
+        }
+        na_tsconn_close(&client->tsconns[i]);
+    }
+
+    if (worker != NULL) {
+        na_client_unlink(client);
+        client->worker = NULL;
+        __sync_sub_and_fetch(&worker->client_cnt, 1);
+    }
 
     if (client->is_use_client_pool) {
-        pthread_mutex_lock(&client->lock_use);
-        client->is_used = false;
-        pthread_mutex_unlock(&client->lock_use);
+        na_client_pool_release(client->client_pool, client);
     } else {
         NA_FREE(client->crbuf);
         NA_FREE(client->srbuf);
+        for (int i=0;i<env->server_cnt;++i) {
+            NA_FREE(client->tsconns[i].wbuf);
+            NA_FREE(client->tsconns[i].rbuf);
+        }
+        NA_FREE(client->tsconns);
         NA_FREE(client);
     }
 
-    pthread_mutex_lock(&env->lock_current_conn);
-    if (env->current_conn > 0) {
-        --env->current_conn;
-        if (GracefulPhase == NA_GRACEFUL_PHASE_STOP_ACCEPT && env->current_conn == 0) {
-            GracefulPhase = NA_GRACEFUL_PHASE_COMPLETED;
+    if (GracefulPhase == NA_GRACEFUL_PHASE_STOP_ACCEPT && na_env_current_conn(env) == 0) {
+        __sync_bool_compare_and_swap(&GracefulPhase, NA_GRACEFUL_PHASE_STOP_ACCEPT, NA_GRACEFUL_PHASE_COMPLETED);
+    }
+}
+
+static void na_buf_reserve (char **buf, size_t *bufmax, size_t size)
+{
+    size_t es;
+
+    if (size <= *bufmax) {
+        return;
+    }
+
+    es = *bufmax > 0 ? *bufmax : size;
+    while (es < size) {
+        es *= 2;
+    }
+    *buf    = (char *)realloc(*buf, es + 1);
+    *bufmax = es;
+}
+
+/**
+ * a request of client put on the queue of it. a merged get has no client
+ */
+static na_request_t *na_request_create (na_client_t *client, na_memproto_cmd_t cmd, int res_cnt)
+{
+    na_request_t *request;
+
+    request = (na_request_t *)malloc(sizeof(na_request_t));
+    if (request == NULL) {
+        return NULL;
+    }
+
+    request->client     = client;
+    request->next       = NULL;
+    request->cnext      = NULL;
+    request->tsconn     = NULL;
+    request->waiters    = NULL;
+    request->wnext      = NULL;
+    request->collapse   = NULL;
+    request->hnext      = NULL;
+    request->key        = NULL;
+    request->cmd        = cmd;
+    request->res_cnt    = res_cnt;
+    request->wend       = 0;
+    request->is_written = false;
+    request->is_noop_appended = false;
+    request->is_end_dropped   = false;
+    request->is_done    = false;
+    request->is_batch   = false;
+    request->boff       = 0;
+    request->is_cache_fill = false;
+    request->cache_gen     = 0;
+    request->hslot         = client != NULL ? client->hslot : NULL;
+    request->hgen          = client != NULL ? client->hgen : 0;
+    request->cache_writes    = NULL;
+    request->cache_write_cnt = 0;
+    request->start         = 0;
+    request->rbuf       = NULL;
+    request->rbufsize   = 0;
+    request->rbufmax    = 0;
+    if (client == NULL) {
+        return request;
+    }
+    if (client->rtail != NULL) {
+        client->rtail->cnext = request;
+    } else {
+        client->rhead = request;
+    }
+    client->rtail = request;
+
+    if (client->request_cnt++ == 0) {
+        na_slow_query_gettime(client->env, &client->na_to_ts_time_begin);
+    }
+
+    return request;
+}
+
+/**
+ * the get leaves the connection of its client which has gone, so the gets collapsed into it
+ * go on without it. the first one is sent again on the connection of its own client,
+ * and the others wait for that one
+ */
+static void na_request_handover (EV_P_ na_request_t *request)
+{
+    na_request_t *waiters, *waiter, *next, *leader;
+    na_collapse_t *collapse;
+    na_tsconn_t *tsconn;
+    char *buf;
+    int len;
+
+    // a get invalidated by a write still has its key
+    if (request->is_batch || request->waiters == NULL || request->key == NULL) {
+        return;
+    }
+
+    waiters = request->waiters;
+    len     = request->key_len;
+    buf     = (char *)malloc(len + 6);
+    if (buf != NULL) {
+        memcpy(buf, "get ", 4);
+        memcpy(buf + 4, request->key, len);
+        memcpy(buf + 4 + len, "\r\n", 2);
+    }
+    na_collapse_remove(request);
+    request->waiters = NULL;
+
+    leader = NULL;
+    for (waiter = waiters;waiter != NULL;waiter = next) {
+        next          = waiter->wnext;
+        waiter->wnext = NULL;
+        if (waiter->client == NULL) {
+            NA_FREE(waiter);
+            continue;
+        }
+        if (leader != NULL) {
+            waiter->wnext   = leader->waiters;
+            leader->waiters = waiter;
+            continue;
+        }
+        if (buf != NULL && (tsconn = na_client_tsconn(EV_A_ waiter->client, request->server)) != NULL) {
+            if (tsconn->batch != NULL) {
+                na_tsconn_flush_batch(tsconn);
+            }
+            na_tsconn_enqueue(EV_A_ tsconn, waiter, buf, len + 6);
+            if ((collapse = waiter->client->worker->collapse) != NULL) {
+                na_collapse_add(collapse, waiter, request->server, buf + 4, len);
+            }
+            leader = waiter;
+            continue;
         }
+        waiter->is_done = true;
+        na_client_close(EV_A_ waiter->client, waiter->client->env);
     }
-    pthread_mutex_unlock(&env->lock_current_conn);
+
+    NA_FREE(buf);
 }
 
-static void na_target_server_callback (EV_P_ struct ev_io *w, int revents)
+/**
+ * the request leaves its connection without response, so the clients of gets collapsed or merged into it are closed
+ */
+static void na_request_abandon (EV_P_ na_request_t *request)
 {
-    int cfd, tsfd, size;
-    na_client_t *client;
+    na_request_t *waiter, *next;
+
+    na_request_write_end(request);
+    na_collapse_remove(request);
+    if (request->is_batch) {
+        NA_FREE(request->key);
+    }
+    for (waiter = request->waiters;waiter != NULL;waiter = next) {
+        next            = waiter->wnext;
+        na_request_abandon(EV_A_ waiter);
+        waiter->is_done = true;
+        if (waiter->client == NULL) {
+            NA_FREE(waiter);
+        } else {
+            na_client_close(EV_A_ waiter->client, waiter->client->env);
+        }
+    }
+    request->waiters = NULL;
+}
+
+static bool na_tsconn_open (na_env_t *env, na_tsconn_t *tsconn, int server, int pool_idx, na_memproto_protocol_t protocol)
+{
+    int fd, cur_pool;
+    na_connpool_t *connpool;
+    na_server_t *target;
+
+    fd       = -1;
+    cur_pool = -1;
+
+    connpool = na_connpool_select(env, server, pool_idx);
+    target   = na_env_server(env, server);
+    tsconn->failover_gen = __atomic_load_n(&env->failover_gen, __ATOMIC_ACQUIRE);
+
+    if (!na_connpool_assign(env, connpool, &cur_pool, &fd, target, protocol)) {
+        fd = na_target_server_tcpsock_init();
+        if (fd < 0) {
+            NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_INVALID_FD);
+            return false;
+        }
+        na_target_server_tcpsock_setup(fd, true);
+
+        if (!na_server_connect(fd, &target->addr)) {
+            if (errno != EINPROGRESS && errno != EALREADY) {
+                close(fd);
+                if (env->healths != NULL) {
+                    na_health_count(&env->healths[server], true, 0);
+                }
+                NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_CONNECTION_FAILED);
+                return false;
+            }
+        }
+    }
+
+    tsconn->fd          = fd;
+    tsconn->cur_pool    = cur_pool;
+    tsconn->connpool    = connpool;
+    tsconn->env         = env;
+    tsconn->server      = server;
+    tsconn->protocol    = cur_pool != -1 ? na_connpool_protocol(connpool, cur_pool) : protocol;
+    tsconn->wbufsize    = 0;
+    tsconn->wbufoff     = 0;
+    tsconn->rbufsize    = 0;
+    tsconn->wtotal      = 0;
+    tsconn->wdone       = 0;
+    tsconn->head        = NULL;
+    tsconn->tail        = NULL;
+    tsconn->request_cnt = 0;
+    tsconn->is_draining = false;
+    na_memproto_parser_init(&tsconn->parser);
+    tsconn->watcher.data = tsconn;
+    ev_io_init(&tsconn->watcher, na_tsconn_callback, fd, EV_NONE);
+
+    return true;
+}
+
+static void na_tsconn_close (na_tsconn_t *tsconn)
+{
+    na_request_t *request, *next;
+    bool is_busy;
+
+    if (tsconn->fd < 0) {
+        return;
+    }
+
+    if (tsconn->loop != NULL) {
+        ev_io_stop(tsconn->loop, &tsconn->watcher);
+    }
+
+    if (tsconn->batch != NULL) {
+        ev_timer_stop(tsconn->loop, &tsconn->batch_watcher);
+        na_request_abandon(tsconn->loop, tsconn->batch);
+        NA_FREE(tsconn->batch);
+        tsconn->batch_cnt = 0;
+    }
+
+    // a connection with responses on the way can't be used by anyone else
+    is_busy = tsconn->head != NULL || tsconn->wbufoff < tsconn->wbufsize;
+    for (request = tsconn->head;request != NULL;request = next) {
+        next = request->next;
+        na_request_abandon(tsconn->loop, request);
+        if (request->client == NULL) {
+            NA_FREE(request);
+        } else {
+            // never answered, so the client returns nothing for it
+            request->is_done = true;
+        }
+    }
+    tsconn->head        = NULL;
+    tsconn->tail        = NULL;
+    tsconn->request_cnt = 0;
+
+    if (tsconn->cur_pool != -1) {
+        if (is_busy) {
+            na_connpool_broken(tsconn->connpool, tsconn->cur_pool);
+        }
+        na_connpool_release(tsconn->connpool, tsconn->cur_pool);
+    } else {
+        close(tsconn->fd);
+    }
+    tsconn->fd = -1;
+}
+
+static void na_tsconn_update (na_tsconn_t *tsconn)
+{
+    int events;
+
+    events = 0;
+    if (tsconn->wbufoff < tsconn->wbufsize) {
+        events |= EV_WRITE;
+    }
+    if (tsconn->head != NULL) {
+        events |= EV_READ;
+    }
+
+    if (ev_is_active(&tsconn->watcher) && (tsconn->watcher.events & (EV_READ | EV_WRITE)) == events) {
+        return;
+    }
+
+    ev_io_stop(tsconn->loop, &tsconn->watcher);
+    if (events != 0) {
+        ev_io_set(&tsconn->watcher, tsconn->fd, events);
+        ev_io_start(tsconn->loop, &tsconn->watcher);
+    }
+}
+
+/**
+ * the connection is unusable, so close every client waiting on it
+ */
+static void na_tsconn_fail (EV_P_ na_tsconn_t *tsconn, na_error_t na_error)
+{
+    na_request_t *request, *next;
+    na_health_t *health;
     na_env_t *env;
 
-    tsfd   = w->fd;
-    client = (na_client_t *)w->data;
-    env    = client->env;
-    cfd    = client->cfd;
+    env     = tsconn->env;
+    request = tsconn->head;
 
-    pthread_rwlock_rdlock(&env->lock_refused);
-    if ((client->is_refused_active != env->is_refused_active) || env->is_refused_accept) {
-        pthread_rwlock_unlock(&env->lock_refused);
-        NA_EVENT_FAIL(NA_ERROR_INVALID_CONNPOOL, EV_A, w, client, env);
-        goto finally; // request fail
+    if ((health = na_tsconn_health(tsconn)) != NULL) {
+        for (int i=0;i<(tsconn->request_cnt > 0 ? tsconn->request_cnt : 1);++i) {
+            na_health_count(health, true, 0);
+        }
     }
-    pthread_rwlock_unlock(&env->lock_refused);
 
-    if (env->loop_max > 0 && client->loop_cnt++ > env->loop_max) {
-        NA_EVENT_FAIL(NA_ERROR_OUTOF_LOOP, EV_A, w, client, env);
-        goto finally; // request fail
+    tsconn->head        = NULL;
+    tsconn->tail        = NULL;
+    tsconn->request_cnt = 0;
+    if (tsconn->cur_pool != -1) {
+        na_connpool_broken(tsconn->connpool, tsconn->cur_pool);
     }
+    na_tsconn_close(tsconn);
 
-    if (revents & EV_READ) {
+    NA_ERROR_OUTPUT_MESSAGE(env, na_error);
 
-        if ((client->na_from_ts_time_begin.tv_sec == 0) &&
-            (client->na_from_ts_time_begin.tv_nsec == 0))
-        {
-            na_slow_query_gettime(env, &client->na_from_ts_time_begin);
+    // closing a client orphans the rest of its requests, so each client is closed once
+    for (;request != NULL;request = next) {
+        next             = request->next;
+        request->is_done = true;
+        na_request_abandon(EV_A_ request);
+        if (request->client == NULL) {
+            NA_FREE(request);
+        } else {
+            na_client_close(EV_A_ request->client, env);
         }
+    }
+}
 
-        if (client->srbufsize >= client->response_bufsize) {
-            size_t es;
-            es = (client->response_bufsize - 1) * 2;
-            client->srbuf = (char *)realloc(client->srbuf, es + 1);
-            client->response_bufsize = es;
+/**
+ * the connection is to the server switched from by failover. requests on the way are
+ * left to a copy of it, which is freed once they are answered, and the next request
+ * opens a connection to the server switched to
+ */
+static void na_tsconn_retire (EV_P_ na_tsconn_t *tsconn)
+{
+    na_tsconn_t *drain;
+    na_request_t *request;
+
+    if (tsconn->batch != NULL) {
+        na_tsconn_flush_batch(tsconn);
+    }
+
+    if (tsconn->head == NULL) {
+        na_tsconn_close(tsconn);
+        return;
+    }
+
+    drain = (na_tsconn_t *)malloc(sizeof(na_tsconn_t));
+    if (drain == NULL) {
+        na_tsconn_fail(EV_A_ tsconn, NA_ERROR_OUTOF_MEMORY);
+        return;
+    }
+    ev_io_stop(tsconn->loop, &tsconn->watcher);
+    memcpy(drain, tsconn, sizeof(na_tsconn_t));
+    drain->is_draining  = true;
+    drain->watcher.data = drain;
+    for (request = drain->head;request != NULL;request = request->next) {
+        request->tsconn = drain;
+    }
+    na_tsconn_update(drain);
+
+    tsconn->fd          = -1;
+    tsconn->wbuf        = NULL;
+    tsconn->wbufsize    = 0;
+    tsconn->wbufoff     = 0;
+    tsconn->wbufmax     = 0;
+    tsconn->rbuf        = NULL;
+    tsconn->rbufsize    = 0;
+    tsconn->rbufmax     = 0;
+    tsconn->head        = NULL;
+    tsconn->tail        = NULL;
+    tsconn->request_cnt = 0;
+}
+
+/**
+ * health of the server the connection is to, or NULL unless ejection is enabled
+ */
+static na_health_t *na_tsconn_health (na_tsconn_t *tsconn)
+{
+    na_env_t *env;
+
+    env = tsconn->env;
+    if (env->healths == NULL) {
+        return NULL;
+    }
+
+    return &env->healths[tsconn->server];
+}
+
+static na_tsconn_t *na_tsconn_select (na_worker_t *worker, int server, na_memproto_protocol_t protocol)
+{
+    na_tsconn_t *tsconns, *tsconn;
+    int max;
+
+    max     = worker->env->multiplex_conn_max;
+    tsconns = &worker->tsconns[(server * 2 + (protocol == NA_MEMPROTO_PROTOCOL_BINARY ? 1 : 0)) * max];
+    tsconn  = &tsconns[0];
+    for (int i=1;i<max;++i) {
+        if (tsconns[i].request_cnt < tsconn->request_cnt) {
+            tsconn = &tsconns[i];
         }
+    }
 
-        size = read(tsfd,
-                    client->srbuf + client->srbufsize,
-                    client->response_bufsize - client->srbufsize);
+    return tsconn;
+}
 
-        if (size <= 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-                goto finally; // not ready yet
-            }
-            NA_EVENT_FAIL(NA_ERROR_FAILED_READ, EV_A, w, client, env);
-            goto finally; // request fail
+/**
+ * return the response to the client, after the responses to its earlier requests
+ */
+static void na_tsconn_deliver (EV_P_ na_request_t *request, char *buf, int size)
+{
+    na_client_t *client;
+    na_request_t *waiter, *next;
+    size_t bufmax;
+
+    if (request->is_batch) {
+        na_tsconn_deliver_batch(EV_A_ request, buf, size);
+        return;
+    }
+
+    if (request->is_cache_fill) {
+        na_tsconn_fill_cache(EV_A_ request, buf, size);
+    }
+    if (request->hslot != NULL) {
+        na_hotkey_add_bytes(request->hslot, request->hgen, size);
+    }
+    na_request_write_end(request);
+
+    // gets collapsed into this one get the same response
+    na_collapse_remove(request);
+    for (waiter = request->waiters;waiter != NULL;waiter = next) {
+        next = waiter->wnext;
+        na_tsconn_deliver(EV_A_ waiter, buf, size);
+    }
+    request->waiters = NULL;
+
+    client           = request->client;
+    request->is_done = true;
+    if (client == NULL) {
+        NA_FREE(request);
+        return;
+    }
+
+    // requests to other target servers may be answered later
+    if (request != client->rhead) {
+        na_buf_reserve(&request->rbuf, &request->rbufmax, size);
+        if (size > 0) {
+            memcpy(request->rbuf, buf, size);
         }
+        request->rbufsize = size;
+        return;
+    }
 
+    for (;;) {
+        bufmax = client->response_bufsize;
+        na_buf_reserve(&client->srbuf, &bufmax, client->srbufsize + size);
+        client->response_bufsize = bufmax;
+        if (size > 0) {
+            memcpy(client->srbuf + client->srbufsize, buf, size);
+        }
         client->srbufsize                += size;
         client->srbuf[client->srbufsize]  = '\0';
 
-        if (client->cmd == NA_MEMPROTO_CMD_GET) {
-            client->res_cnt = na_memproto_count_response_get(client->srbuf, client->srbufsize);
-            if (client->res_cnt >= client->req_cnt) {
-                client->event_state = NA_EVENT_STATE_CLIENT_WRITE;
-                na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_WRITE);
-                na_slow_query_gettime(env, &client->na_from_ts_time_end);
-                goto finally;
-            }
-        } else if (client->srbufsize > 2 &&
-                   client->srbuf[client->srbufsize - 2] == '\r' &&
-                   client->srbuf[client->srbufsize - 1] == '\n')
-        {
-            client->event_state = NA_EVENT_STATE_CLIENT_WRITE;
-            na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_WRITE);
-            na_slow_query_gettime(env, &client->na_from_ts_time_end);
+        client->rhead = request->cnext;
+        if (client->rhead == NULL) {
+            client->rtail = NULL;
+        }
+        NA_FREE(request->rbuf);
+        NA_FREE(request);
+        --client->request_cnt;
+        __sync_add_and_fetch(&client->worker->request_cnt, 1);
+
+        request = client->rhead;
+        if (request == NULL || !request->is_done) {
+            break;
         }
+        buf  = request->rbuf;
+        size = request->rbufsize;
+    }
 
-    } else if (revents & EV_WRITE) {
+    client->event_state = NA_EVENT_STATE_CLIENT_WRITE;
+    na_slow_query_gettime(client->env, &client->na_from_ts_time_end);
+    na_client_update(EV_A_ client);
+}
 
-        if ((client->na_to_ts_time_begin.tv_sec == 0) &&
-            (client->na_to_ts_time_begin.tv_nsec == 0))
-        {
-            na_slow_query_gettime(env, &client->na_to_ts_time_begin);
+/**
+ * split the response to a merged get into the one to each get merged
+ */
+static void na_tsconn_deliver_batch (EV_P_ na_request_t *batch, char *buf, int size)
+{
+    na_request_t *member, *next;
+    char *rbuf, *block;
+    int bsize;
+
+    if (size < 5 || memcmp(buf + size - 5, "END\r\n", 5) != 0) {
+        // an error is the response to every get
+        rbuf = NULL;
+    } else if ((rbuf = (char *)malloc(size)) == NULL) {
+        NA_ERROR_OUTPUT_MESSAGE(batch->tsconn->env, NA_ERROR_OUTOF_MEMORY);
+        na_request_abandon(EV_A_ batch);
+        NA_FREE(batch);
+        return;
+    }
+
+    for (member = batch->waiters;member != NULL;member = next) {
+        next = member->wnext;
+        if (rbuf == NULL) {
+            na_tsconn_deliver(EV_A_ member, buf, size);
+        } else if (na_memproto_find_value(buf, buf + size, batch->key + member->boff, member->key_len, &block, &bsize)) {
+            memcpy(rbuf, block, bsize);
+            memcpy(rbuf + bsize, "END\r\n", 5);
+            na_tsconn_deliver(EV_A_ member, rbuf, bsize + 5);
+        } else {
+            na_tsconn_deliver(EV_A_ member, "END\r\n", 5);
         }
+    }
+
+    NA_FREE(rbuf);
+    NA_FREE(batch->key);
+    NA_FREE(batch);
+}
 
-        size = write(tsfd,
-                     client->crbuf + client->swbufsize,
-                     client->crbufsize - client->swbufsize);
+/**
+ * store the response to a get of single key into L1 cache. misses and errors are not stored
+ */
+static void na_tsconn_fill_cache (EV_P_ na_request_t *request, char *buf, int size)
+{
+    char *key;
+    int len;
+
+    if (size < 5 || memcmp(buf + size - 5, "END\r\n", 5) != 0) {
+        return;
+    }
+    if ((key = na_memproto_value_key(buf, buf + size, &len)) == NULL) {
+        return;
+    }
+    na_cache_set(request->tsconn->env->l1_cache, key, len, buf, size, request->cache_gen, ev_now(EV_A));
+}
+
+/**
+ * write the merged get, after which other requests may go on the connection
+ */
+static void na_tsconn_flush_batch (na_tsconn_t *tsconn)
+{
+    na_request_t *batch;
+    size_t size;
+
+    batch = tsconn->batch;
+    ev_timer_stop(tsconn->loop, &tsconn->batch_watcher);
+    tsconn->batch     = NULL;
+    tsconn->batch_cnt = 0;
+
+    if (tsconn->wbufoff > 0 && tsconn->wbufoff == tsconn->wbufsize) {
+        tsconn->wbufoff  = 0;
+        tsconn->wbufsize = 0;
+    }
+    size = tsconn->bbufsize + 2;
+    na_buf_reserve(&tsconn->wbuf, &tsconn->wbufmax, tsconn->wbufsize + size);
+    memcpy(tsconn->wbuf + tsconn->wbufsize, tsconn->bbuf, tsconn->bbufsize);
+    memcpy(tsconn->wbuf + tsconn->wbufsize + tsconn->bbufsize, "\r\n", 2);
+    tsconn->wbufsize += size;
+    tsconn->wtotal   += size;
+
+    // keys of the gets merged are looked up in the response
+    batch->key        = tsconn->bbuf;
+    batch->key_len    = tsconn->bbufsize;
+    tsconn->bbuf      = NULL;
+    tsconn->bbufsize  = 0;
+    tsconn->bbufmax   = 0;
+
+    batch->tsconn = tsconn;
+    batch->wend   = tsconn->wtotal;
+    batch->start  = ev_now(tsconn->loop);
+    if (tsconn->tail != NULL) {
+        tsconn->tail->next = batch;
+    } else {
+        tsconn->head = batch;
+    }
+    tsconn->tail = batch;
+    ++tsconn->request_cnt;
+
+    na_tsconn_update(tsconn);
+}
+
+static void na_tsconn_batch_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_tsconn_flush_batch((na_tsconn_t *)w->data);
+}
+
+/**
+ * take the request at the head of queue
+ */
+static na_request_t *na_tsconn_shift (na_tsconn_t *tsconn)
+{
+    na_request_t *request;
+
+    request      = tsconn->head;
+    tsconn->head = request->next;
+    if (tsconn->head == NULL) {
+        tsconn->tail = NULL;
+    }
+    --tsconn->request_cnt;
+    return request;
+}
+
+/**
+ * write buf for the request and queue it for the response, with noop if it is appended
+ */
+static void na_tsconn_enqueue (EV_P_ na_tsconn_t *tsconn, na_request_t *request, char *buf, int size)
+{
+    if (tsconn->wbufoff > 0 && tsconn->wbufoff == tsconn->wbufsize) {
+        tsconn->wbufoff  = 0;
+        tsconn->wbufsize = 0;
+    }
+    na_buf_reserve(&tsconn->wbuf, &tsconn->wbufmax, tsconn->wbufsize + size + NA_MEMPROTO_NOOP_SIZE_MAX);
+    memcpy(tsconn->wbuf + tsconn->wbufsize, buf, size);
+    if (request->is_noop_appended) {
+        size += na_memproto_noop(tsconn->protocol, tsconn->wbuf + tsconn->wbufsize + size);
+    }
+    tsconn->wbufsize += size;
+    tsconn->wtotal   += size;
+
+    request->tsconn = tsconn;
+    request->wend   = tsconn->wtotal;
+    request->start  = ev_now(EV_A);
+    if (tsconn->tail != NULL) {
+        tsconn->tail->next = request;
+    } else {
+        tsconn->head = request;
+    }
+    tsconn->tail = request;
+    ++tsconn->request_cnt;
+
+    na_tsconn_update(tsconn);
+}
+
+/**
+ * requests with noreply are done when they are written and every request before them is answered
+ */
+static void na_tsconn_complete_noreply (EV_P_ na_tsconn_t *tsconn)
+{
+    na_request_t *request;
+
+    while ((request = tsconn->head) != NULL && request->res_cnt == 0 && request->is_written) {
+        na_tsconn_shift(tsconn);
+        na_tsconn_deliver(EV_A_ request, NULL, 0);
+    }
+}
+
+static void na_tsconn_callback (EV_P_ struct ev_io *w, int revents)
+{
+    int size, off, end;
+    na_tsconn_t *tsconn;
+    na_request_t *request;
+    na_health_t *health;
+    na_env_t *env;
+    na_memproto_parse_result_t result;
+    bool is_draining;
+
+    tsconn = (na_tsconn_t *)w->data;
+    env    = tsconn->env;
+    // a connection owned by a client is freed with it when a failure closes the client
+    is_draining = tsconn->is_draining;
+
+    if (revents & EV_WRITE) {
+
+        size = write(tsconn->fd,
+                     tsconn->wbuf + tsconn->wbufoff,
+                     tsconn->wbufsize - tsconn->wbufoff);
 
         if (size == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-                goto finally; // not ready yet
-            } else if (client->is_use_connpool) {
-                int i = client->cur_pool;
-                na_server_t *server;
-                pthread_rwlock_rdlock(&env->lock_refused);
-                if (env->is_use_backup) {
-                    server = env->is_refused_active ? &env->backup_server : &env->target_server;
-                } else {
-                    server = &env->target_server;
-                }
-                pthread_rwlock_unlock(&env->lock_refused);
-                pthread_mutex_lock(&env->lock_connpool);
-                if (client->connpool->fd_pool[i] > 0) {
-                    close(client->connpool->fd_pool[i]);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                na_tsconn_fail(EV_A_ tsconn, errno == EPIPE ? NA_ERROR_BROKEN_PIPE : NA_ERROR_FAILED_WRITE);
+                goto finally; // request fail
+            }
+        } else {
+            tsconn->wbufoff += size;
+            tsconn->wdone   += size;
+            if (tsconn->wbufoff == tsconn->wbufsize) {
+                tsconn->wbufoff  = 0;
+                tsconn->wbufsize = 0;
+            }
+            for (request = tsconn->head;request != NULL && !request->is_written;request = request->next) {
+                if (request->wend > tsconn->wdone) {
+                    break;
                 }
-                client->connpool->fd_pool[i] = na_target_server_tcpsock_init();
-                na_target_server_tcpsock_setup(client->connpool->fd_pool[i], true);
-                if (client->connpool->fd_pool[i] <= 0) {
-                    pthread_mutex_unlock(&env->lock_connpool);
-                    NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+                request->is_written = true;
+                if (request->client != NULL) {
+                    request->client->event_state = NA_EVENT_STATE_TARGET_READ;
+                    na_slow_query_gettime(env, &request->client->na_to_ts_time_end);
                 }
+            }
+            na_tsconn_complete_noreply(EV_A_ tsconn);
+        }
+    }
+
+    if (revents & EV_READ) {
+
+        na_buf_reserve(&tsconn->rbuf, &tsconn->rbufmax, tsconn->rbufsize + env->response_bufsize);
+
+        size = read(tsconn->fd,
+                    tsconn->rbuf + tsconn->rbufsize,
+                    tsconn->rbufmax - tsconn->rbufsize);
+
+        if (size == 0) {
+            na_tsconn_fail(EV_A_ tsconn, NA_ERROR_FAILED_READ);
+            goto finally; // request fail
+        } else if (size == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                na_tsconn_fail(EV_A_ tsconn, NA_ERROR_FAILED_READ);
+                goto finally; // request fail
+            }
+            size = 0;
+        }
+
+        if (size > 0 && tsconn->head != NULL && tsconn->head->client != NULL) {
+            na_client_t *client = tsconn->head->client;
+            if ((client->na_from_ts_time_begin.tv_sec == 0) &&
+                (client->na_from_ts_time_begin.tv_nsec == 0))
+            {
+                na_slow_query_gettime(env, &client->na_from_ts_time_begin);
+            }
+        }
+
+        tsconn->rbufsize += size;
+
+        // responses come back in the order requests were written
+        off = 0;
+        while ((request = tsconn->head) != NULL) {
+            result = na_memproto_parse_response(&tsconn->parser, request->cmd, tsconn->rbuf, tsconn->rbufsize);
+            if (result == NA_MEMPROTO_PARSE_AGAIN) {
+                break;
+            } else if (result == NA_MEMPROTO_PARSE_ERROR) {
+                na_tsconn_fail(EV_A_ tsconn, NA_ERROR_INVALID_RESPONSE);
+                goto finally; // request fail
+            }
+            if (--request->res_cnt > 0) {
+                continue;
+            }
+            // the response to the appended noop is the last frame, and so is END
+            if (request->is_noop_appended ||
+                (request->is_end_dropped && na_memproto_is_end(tsconn->rbuf + tsconn->parser.line, tsconn->rbuf + tsconn->parser.off)))
+            {
+                end = tsconn->parser.line;
+            } else {
+                end = tsconn->parser.off;
+            }
+            na_tsconn_shift(tsconn);
+            if ((health = na_tsconn_health(tsconn)) != NULL) {
+                na_health_count(health, na_memproto_is_server_error(tsconn->rbuf + off, tsconn->rbuf + end), ev_now(EV_A) - request->start);
+            }
+            na_tsconn_deliver(EV_A_ request, tsconn->rbuf + off, end - off);
+            off = tsconn->parser.off;
+            na_tsconn_complete_noreply(EV_A_ tsconn);
+        }
+
+        if (tsconn->head == NULL && off < tsconn->rbufsize) {
+            na_tsconn_fail(EV_A_ tsconn, NA_ERROR_INVALID_RESPONSE);
+            goto finally; // request fail
+        }
+
+        if (off > 0) {
+            memmove(tsconn->rbuf, tsconn->rbuf + off, tsconn->rbufsize - off);
+            tsconn->rbufsize -= off;
+            na_memproto_parser_shift(&tsconn->parser, off);
+        }
+    }
+
+    na_tsconn_update(tsconn);
+
+ finally:
+    if (is_draining && (tsconn->fd < 0 || tsconn->head == NULL)) {
+        na_tsconn_close(tsconn);
+        NA_FREE(tsconn->wbuf);
+        NA_FREE(tsconn->rbuf);
+        NA_FREE(tsconn);
+    }
+}
+
+/**
+ * server of the active tier for the request framed last. commands without key go to the first one,
+ * unless they close quiet commands held
+ */
+static int na_client_route (na_client_t *client)
+{
+    na_env_t *env;
+    na_tier_t *tier;
+
+    env  = client->env;
+    tier = na_env_active_tier(env);
+    if (client->parser.key_len == 0) {
+        if (client->cqstart >= 0) {
+            return client->cqserver;
+        }
+        if (tier->cnt == 1 || env->healths == NULL) {
+            return tier->first;
+        }
+        return tier->first + na_health_first(&env->healths[tier->first], tier->cnt);
+    }
+    return na_client_route_key(env, tier, client->crbuf + client->parser.key, client->parser.key_len);
+}
+
+/**
+ * server for key from tier on. the only server of a tier being readmitted gets the share of keys
+ * it is readmitted for, and the rest go to the next tier. with more servers, keys of one
+ * being readmitted go to the others of the same tier
+ */
+static int na_client_route_key (na_env_t *env, na_tier_t *tier, const char *key, int len)
+{
+    na_health_t *healths;
+    int server, admit;
+
+    while (tier->cnt == 1 && env->healths != NULL && tier < &env->tiers[env->tier_cnt - 1]) {
+        admit = na_health_admit(&env->healths[tier->first]);
+        if (admit == 0 || admit == NA_HEALTH_ADMIT_FULL ||
+            na_ketama_key_hash(key, len) % NA_HEALTH_ADMIT_FULL < (uint32_t)admit)
+        {
+            return tier->first;
+        }
+        ++tier;
+    }
+    if (tier->cnt == 1) {
+        return tier->first;
+    }
+
+    healths = env->healths != NULL ? &env->healths[tier->first] : NULL;
+    server  = na_ketama_lookup(tier->ketama, key, len, healths);
+    return tier->first + (server < 0 ? 0 : server);
+}
+
+/**
+ * whether keys of the tier go to more than one server
+ */
+static bool na_client_is_tier_split (na_env_t *env, na_tier_t *tier)
+{
+    int admit;
 
-                if (!na_server_connect(client->connpool->fd_pool[i], &server->addr)) {
-                    if (errno != EINPROGRESS && errno != EALREADY) {
-                        pthread_mutex_unlock(&env->lock_connpool);
-                        NA_DIE_WITH_ERROR(env, NA_ERROR_CONNECTION_FAILED);
-                    }
+    if (tier->cnt > 1) {
+        return true;
+    }
+    if (env->healths == NULL || tier == &env->tiers[env->tier_cnt - 1]) {
+        return false;
+    }
+    admit = na_health_admit(&env->healths[tier->first]);
+
+    return admit > 0 && admit < NA_HEALTH_ADMIT_FULL;
+}
+
+/**
+ * retire the connections opened before the last failover. ones to the tier switched to
+ * were opened on its pools before they were left, so they go too
+ */
+static void na_client_failover (EV_P_ na_client_t *client)
+{
+    na_env_t *env;
+    na_worker_t *worker;
+    uint32_t failover_gen;
+
+    env          = client->env;
+    worker       = client->worker;
+    failover_gen = *(volatile uint32_t *)&env->failover_gen;
+
+    if (env->multiplex_conn_max > 0) {
+        if (worker->failover_gen != failover_gen) {
+            for (int i=0;i<env->server_cnt * env->multiplex_conn_max * 2;++i) {
+                if (worker->tsconns[i].fd >= 0 && worker->tsconns[i].failover_gen != failover_gen) {
+                    na_tsconn_retire(EV_A_ &worker->tsconns[i]);
                 }
-                pthread_mutex_unlock(&env->lock_connpool);
             }
+            worker->failover_gen = failover_gen;
+        }
+    } else {
+        for (int i=0;i<env->server_cnt;++i) {
+            if (client->tsconns[i].fd >= 0 && client->tsconns[i].failover_gen != failover_gen) {
+                na_tsconn_retire(EV_A_ &client->tsconns[i]);
+            }
+        }
+    }
+    client->failover_gen = failover_gen;
+}
+
+/**
+ * the connection to target server which the next request of client goes on, opened if it is not
+ */
+static na_tsconn_t *na_client_tsconn (EV_P_ na_client_t *client, int server)
+{
+    na_env_t *env;
+    na_tsconn_t *tsconn;
+    na_request_t *request;
+    na_memproto_protocol_t protocol;
+
+    env      = client->env;
+    protocol = client->parser.protocol;
+
+    // failover takes effect at the boundary of requests, so clients are kept
+    if (client->failover_gen != *(volatile uint32_t *)&env->failover_gen) {
+        na_client_failover(EV_A_ client);
+    }
+
+    if (env->multiplex_conn_max > 0) {
+        // responses are put back in order on the client side, but requests to the same server
+        // must reach it in order, so follow the ones on the way
+        tsconn = NULL;
+        for (request = client->rhead;request != NULL;request = request->cnext) {
+            if (!request->is_done && request->tsconn != NULL && request->tsconn->server == server &&
+                !request->tsconn->is_draining)
+            {
+                tsconn = request->tsconn;
+            }
+        }
+        if (tsconn == NULL) {
+            tsconn = na_tsconn_select(client->worker, server, protocol);
+        }
+    } else {
+        tsconn = &client->tsconns[server];
+    }
+
+    if (env->multiplex_conn_max == 0) {
+        if (tsconn->fd >= 0 && tsconn->head == NULL &&
+            tsconn->protocol != NA_MEMPROTO_PROTOCOL_NOT_DETECTED && tsconn->protocol != protocol)
+        {
+            na_tsconn_close(tsconn);
+        }
+    }
+
+    if (tsconn->fd < 0 && !na_tsconn_open(env, tsconn, server, env->is_reuseport ? client->worker->id : 0, protocol)) {
+        return NULL;
+    }
+    tsconn->loop = EV_A;
+    if (tsconn->protocol == NA_MEMPROTO_PROTOCOL_NOT_DETECTED) {
+        tsconn->protocol = protocol;
+        if (tsconn->cur_pool != -1) {
+            na_connpool_set_protocol(tsconn->connpool, tsconn->cur_pool, protocol);
+        }
+    }
+
+    return tsconn;
+}
+
+/**
+ * queue the request in buf on the connection to target server
+ */
+static na_request_t *na_client_forward (EV_P_ na_client_t *client, char *buf, int size, int server, na_memproto_cmd_t cmd, int res_cnt, bool is_noop_appended)
+{
+    na_env_t *env;
+    na_tsconn_t *tsconn;
+    na_request_t *request;
+
+    env = client->env;
+
+    if ((tsconn = na_client_tsconn(EV_A_ client, server)) == NULL) {
+        return NULL;
+    }
+    // gets merged earlier are answered first
+    if (tsconn->batch != NULL) {
+        na_tsconn_flush_batch(tsconn);
+    }
+
+    request = na_request_create(client, cmd, res_cnt);
+    if (request == NULL) {
+        NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
+        return NULL;
+    }
+    request->is_noop_appended = is_noop_appended;
+    // writes framed since the last request forwarded are in buf
+    request->cache_writes     = client->cache_writes;
+    request->cache_write_cnt  = client->cache_write_cnt;
+    client->cache_writes      = NULL;
+    client->cache_write_cnt   = 0;
+    client->cache_write_max   = 0;
+    na_tsconn_enqueue(EV_A_ tsconn, request, buf, size);
+
+    client->event_state = NA_EVENT_STATE_TARGET_WRITE;
+
+    return request;
+}
+
+/**
+ * whether the request framed last is a get with keys on more than one server of the active tier or too many keys
+ */
+static bool na_client_is_multiget_split (na_client_t *client)
+{
+    na_env_t *env;
+
+    env = client->env;
+    if (client->parser.cmd != NA_MEMPROTO_CMD_GET && client->parser.cmd != NA_MEMPROTO_CMD_GETS) {
+        return false;
+    }
+    if (client->parser.key_cnt < 2) {
+        return false;
+    }
+    return na_client_is_tier_split(env, na_env_active_tier(env)) ||
+           (env->multiget_keys_max > 0 && client->parser.key_cnt > env->multiget_keys_max);
+}
+
+/**
+ * split the multi-get framed last into parts for each server its keys go to with multiget_keys_max keys at most.
+ * the parts are sent at once and END of every response but the last is dropped,
+ * so the client gets one response.
+ */
+static bool na_client_forward_multiget (EV_P_ na_client_t *client)
+{
+    na_env_t *env;
+    na_tier_t *tier;
+    na_multiget_key_t *keys;
+    na_request_t *request, *last;
+    na_hotkey_slot_t *hslot, *first_hslot;
+    char *buf, *name, *p, *end, *tok;
+    int len, cnt, max, size, n;
+    uint32_t hgen, first_hgen;
+    bool is_ok;
+
+    env  = client->env;
+    keys = (na_multiget_key_t *)malloc(sizeof(na_multiget_key_t) * client->parser.key_cnt);
+    buf  = (char *)malloc(client->parser.off - client->parser.start + 2);
+    if (keys == NULL || buf == NULL) {
+        NA_FREE(keys);
+        NA_FREE(buf);
+        NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
+        return false;
+    }
+
+    // every key is routed from the same tier even if failover happens on the way
+    tier = na_env_active_tier(env);
+
+    cnt = 0;
+    p   = client->crbuf + client->parser.key;
+    end = client->crbuf + client->parser.off;
+    while (cnt < client->parser.key_cnt && (tok = na_memproto_next_key(p, end, &len)) != NULL) {
+        keys[cnt].off    = tok - client->crbuf;
+        keys[cnt].len    = len;
+        keys[cnt].server = na_client_route_key(env, tier, tok, len);
+        ++cnt;
+        p = tok + len;
+    }
+
+    name        = client->parser.cmd == NA_MEMPROTO_CMD_GETS ? "gets" : "get";
+    max         = env->multiget_keys_max > 0 ? env->multiget_keys_max : cnt;
+    last        = NULL;
+    is_ok       = true;
+    first_hslot = client->hslot;
+    first_hgen  = client->hgen;
+    for (int server=tier->first;server<env->server_cnt && is_ok;++server) {
+        n    = 0;
+        size = 0;
+        for (int i=0;i<cnt && is_ok;++i) {
+            if (keys[i].server != server) {
+                continue;
+            }
+            // every key is counted, and the response to each part is added to the first key of it
+            hslot = first_hslot;
+            hgen  = first_hgen;
+            if (i > 0 && client->worker->hotkey != NULL) {
+                hslot = na_hotkey_count(client->worker->hotkey, client->crbuf + keys[i].off, keys[i].len, ev_now(EV_A), &hgen);
+            }
+            if (n == 0) {
+                size = strlen(name);
+                memcpy(buf, name, size);
+                client->hslot = hslot;
+                client->hgen  = hgen;
+            }
+            buf[size++] = ' ';
+            memcpy(buf + size, client->crbuf + keys[i].off, keys[i].len);
+            size += keys[i].len;
+            if (++n == max) {
+                is_ok = (request = na_client_forward_multiget_part(EV_A_ client, buf, size, server)) != NULL;
+                last  = request;
+                n     = 0;
+            }
+        }
+        if (is_ok && n > 0) {
+            is_ok = (request = na_client_forward_multiget_part(EV_A_ client, buf, size, server)) != NULL;
+            last  = request;
+        }
+    }
+    if (is_ok && last != NULL) {
+        last->is_end_dropped = false;
+    }
+
+    NA_FREE(keys);
+    NA_FREE(buf);
+
+    return is_ok;
+}
+
+/**
+ * whether the request framed last is a get of a key which can be answered from L1 cache,
+ * wait for an identical one in flight or be merged with gets from other clients
+ */
+static bool na_client_is_single_get (na_client_t *client)
+{
+    return (client->env->l1_cache != NULL || client->worker->collapse != NULL ||
+            (client->env->get_batch_usec > 0 && client->env->multiplex_conn_max > 0)) &&
+           client->parser.protocol == NA_MEMPROTO_PROTOCOL_TEXT &&
+           client->parser.cmd == NA_MEMPROTO_CMD_GET &&
+           client->parser.key_cnt == 1;
+}
+
+/**
+ * the get framed last is answered from L1 cache or waits for the identical one in flight,
+ * or is forwarded or merged to be waited for
+ */
+static bool na_client_forward_get (EV_P_ na_client_t *client, int start, int server)
+{
+    na_collapse_t *collapse;
+    na_cache_t *cache;
+    na_worker_t *worker;
+    na_request_t *leader, *request;
+    char *key;
+    int len, size;
+    uint32_t gen;
+    bool is_cache_fill;
+
+    worker   = client->worker;
+    collapse = worker->collapse;
+    cache    = client->env->l1_cache;
+    key      = client->crbuf + client->parser.key;
+    len      = client->parser.key_len;
+
+    is_cache_fill = false;
+    gen           = 0;
+    if (cache != NULL && na_cache_is_target(cache, key, len)) {
+        if ((size = na_cache_get(cache, key, len, ev_now(EV_A), &worker->cache_buf, &worker->cache_bufmax)) >= 0) {
+            request = na_request_create(client, NA_MEMPROTO_CMD_GET, 1);
+            if (request == NULL) {
+                NA_ERROR_OUTPUT_MESSAGE(client->env, NA_ERROR_OUTOF_MEMORY);
+                return false;
+            }
+            na_tsconn_deliver(EV_A_ request, worker->cache_buf, size);
+            return true;
+        }
+        // a write passing through after this get is on the way keeps its response out
+        is_cache_fill = true;
+        gen           = na_cache_generation(cache, key, len);
+    }
+
+    if (collapse != NULL && (leader = na_collapse_find(collapse, server, key, len)) != NULL &&
+        na_client_can_join(client, leader, server))
+    {
+        request = na_request_create(client, NA_MEMPROTO_CMD_GET, 1);
+        if (request == NULL) {
+            NA_ERROR_OUTPUT_MESSAGE(client->env, NA_ERROR_OUTOF_MEMORY);
+            return false;
+        }
+        request->wnext      = leader->waiters;
+        leader->waiters     = request;
+        client->event_state = NA_EVENT_STATE_TARGET_READ;
+        __sync_add_and_fetch(&client->worker->collapse_cnt, 1);
+        return true;
+    }
+
+    if (client->env->get_batch_usec > 0 && client->env->multiplex_conn_max > 0) {
+        request = na_client_batch_get(EV_A_ client, server);
+    } else {
+        request = na_client_forward(EV_A_ client, client->crbuf + start, client->parser.off - start, server, NA_MEMPROTO_CMD_GET, 1, false);
+    }
+    if (request == NULL) {
+        return false;
+    }
+    request->is_cache_fill = is_cache_fill;
+    request->cache_gen     = gen;
+    // without memory for the key, identical gets are just forwarded
+    if (collapse != NULL) {
+        na_collapse_add(collapse, request, server, key, len);
+    }
+
+    return true;
+}
+
+/**
+ * a get in flight on another connection may reach target server before the requests
+ * of client on the way to it, so it is joined only when client has none of them
+ * or they are on the same connection as the get
+ */
+static bool na_client_can_join (na_client_t *client, na_request_t *leader, int server)
+{
+    na_request_t *request;
+
+    for (request = client->rhead;request != NULL;request = request->cnext) {
+        if (!request->is_done && request->tsconn != NULL && request->tsconn->server == server &&
+            request->tsconn != leader->tsconn)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * merge the get framed last into the one held on the connection for get_batch_usec.
+ * it is written when the time is up, it has enough keys or another request goes on the connection.
+ */
+static na_request_t *na_client_batch_get (EV_P_ na_client_t *client, int server)
+{
+    na_env_t *env;
+    na_tsconn_t *tsconn;
+    na_request_t *batch, *request, *member;
+    char *key;
+    int len, max;
+
+    env = client->env;
+    key = client->crbuf + client->parser.key;
+    len = client->parser.key_len;
+    max = env->multiget_keys_max > 0 && env->multiget_keys_max < NA_GET_BATCH_KEYS_MAX ? env->multiget_keys_max : NA_GET_BATCH_KEYS_MAX;
+
+    if ((tsconn = na_client_tsconn(EV_A_ client, server)) == NULL) {
+        return NULL;
+    }
+
+    if ((batch = tsconn->batch) == NULL) {
+        batch = na_request_create(NULL, NA_MEMPROTO_CMD_GET, 1);
+        if (batch == NULL) {
+            NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
+            return NULL;
+        }
+        batch->is_batch = true;
+        tsconn->batch   = batch;
+        na_buf_reserve(&tsconn->bbuf, &tsconn->bbufmax, 3);
+        memcpy(tsconn->bbuf, "get", 3);
+        tsconn->bbufsize = 3;
+        ev_timer_set(&tsconn->batch_watcher, env->get_batch_usec / 1000000.0, 0.);
+        ev_timer_start(EV_A_ &tsconn->batch_watcher);
+    }
+
+    request = na_request_create(client, NA_MEMPROTO_CMD_GET, 1);
+    if (request == NULL) {
+        NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
+        return NULL;
+    }
+    request->tsconn  = tsconn;
+    request->key_len = len;
+
+    // a key is asked once however many gets of it are merged
+    for (member = batch->waiters;member != NULL;member = member->wnext) {
+        if (member->key_len == len && memcmp(tsconn->bbuf + member->boff, key, len) == 0) {
+            break;
+        }
+    }
+    if (member != NULL) {
+        request->boff = member->boff;
+    } else {
+        na_buf_reserve(&tsconn->bbuf, &tsconn->bbufmax, tsconn->bbufsize + 1 + len);
+        tsconn->bbuf[tsconn->bbufsize++] = ' ';
+        request->boff = tsconn->bbufsize;
+        memcpy(tsconn->bbuf + tsconn->bbufsize, key, len);
+        tsconn->bbufsize += len;
+        ++tsconn->batch_cnt;
+    }
+    request->wnext      = batch->waiters;
+    batch->waiters      = request;
+    client->event_state = NA_EVENT_STATE_TARGET_WRITE;
+
+    if (tsconn->batch_cnt >= max) {
+        na_tsconn_flush_batch(tsconn);
+    }
+
+    return request;
+}
+
+static na_request_t *na_client_forward_multiget_part (EV_P_ na_client_t *client, char *buf, int size, int server)
+{
+    na_request_t *request;
+
+    buf[size++] = '\r';
+    buf[size++] = '\n';
+    if ((request = na_client_forward(EV_A_ client, buf, size, server, client->parser.cmd, 1, false)) != NULL) {
+        request->is_end_dropped = true;
+    }
+
+    return request;
+}
+
+/**
+ * quiet commands have no response on success, so they are held until the next
+ * command which is not quiet(binary protocol) or mn(meta commands). when the
+ * client sends another command or stops before it, a noop is appended
+ * instead and its response is not returned.
+ */
+static bool na_client_flush_quiet (EV_P_ na_client_t *client, int end)
+{
+    na_memproto_cmd_t cmd;
+
+    if (client->cqstart < 0) {
+        return true;
+    }
+    cmd = client->parser.protocol == NA_MEMPROTO_PROTOCOL_BINARY ? NA_MEMPROTO_CMD_BINARY : NA_MEMPROTO_CMD_MN;
+    if (na_client_forward(EV_A_ client, client->crbuf + client->cqstart, end - client->cqstart, client->cqserver, cmd, 1, true) == NULL) {
+        return false;
+    }
+    client->cqstart  = -1;
+    client->cfwdsize = end;
+    return true;
+}
+
+/**
+ * the request framed last is sent to server soon. if it writes to its key, gets in flight
+ * may be answered before the key is updated, so they take no more gets and L1 cache stores
+ * no response to the key until the next request forwarded, which takes the write, is answered
+ */
+static void na_client_write_begin (na_client_t *client, int server)
+{
+    na_cache_t *cache;
+    char *key;
+    int len;
 
-            if (errno == EPIPE) {
-                NA_EVENT_FAIL(NA_ERROR_BROKEN_PIPE, EV_A, w, client, env);
-            } else {
-                NA_EVENT_FAIL(NA_ERROR_FAILED_WRITE, EV_A, w, client, env);
-            }
-            goto finally; // request fail
+    if (client->parser.key_len == 0 || !na_memproto_is_write(&client->parser)) {
+        return;
+    }
+    key   = client->crbuf + client->parser.key;
+    len   = client->parser.key_len;
+    cache = client->env->l1_cache;
+    if (client->worker->collapse != NULL) {
+        na_collapse_invalidate(client->worker->collapse, server, key, len);
+    }
+    if (cache == NULL || !na_cache_is_target(cache, key, len)) {
+        return;
+    }
+    if (client->cache_write_cnt == client->cache_write_max) {
+        uint32_t *writes;
+        int max;
+        max    = client->cache_write_max > 0 ? client->cache_write_max * 2 : 4;
+        writes = (uint32_t *)realloc(client->cache_writes, sizeof(uint32_t) * max);
+        if (writes == NULL) {
+            // gets on the way don't store their responses anyway
+            na_cache_write_end(cache, na_cache_write_begin(cache, key, len));
+            return;
         }
+        client->cache_writes    = writes;
+        client->cache_write_max = max;
+    }
+    client->cache_writes[client->cache_write_cnt++] = na_cache_write_begin(cache, key, len);
+}
 
-        client->swbufsize += size;
+/**
+ * the writes of request to keys in L1 cache are done, whether it is answered or not
+ */
+static void na_request_write_end (na_request_t *request)
+{
+    for (int i=0;i<request->cache_write_cnt;++i) {
+        na_cache_write_end(request->tsconn->env->l1_cache, request->cache_writes[i]);
+    }
+    NA_FREE(request->cache_writes);
+    request->cache_write_cnt = 0;
+}
 
-        if (client->swbufsize < client->crbufsize) {
-            na_event_switch(EV_A_ w, &client->ts_watcher, tsfd, EV_WRITE);
-        } else {
-            client->event_state = NA_EVENT_STATE_TARGET_READ;
-            na_event_switch(EV_A_ w, &client->ts_watcher, tsfd, EV_READ);
-            na_slow_query_gettime(env, &client->na_to_ts_time_end);
-        }
-        goto finally;
+/**
+ * watch for requests while the pipeline has room and for responses not written yet
+ */
+static void na_client_update (EV_P_ na_client_t *client)
+{
+    int events;
+
+    events = 0;
+    if (!client->is_quit && client->request_cnt < client->env->pipeline_max) {
+        events |= EV_READ;
+    }
+    if (client->cwbufsize < client->srbufsize) {
+        events |= EV_WRITE;
+    }
+    if (client->request_cnt == 0 && client->srbufsize == 0 && (client->cfwdsize > 0 || client->is_quit)) {
+        // requests with noreply are done without any response, so finish them on the write side as well
+        events |= EV_WRITE;
     }
 
- finally:
-    ; // do nothing
+    if (ev_is_active(&client->c_watcher) && (client->c_watcher.events & (EV_READ | EV_WRITE)) == events) {
+        return;
+    }
+
+    ev_io_stop(EV_A_ &client->c_watcher);
+    if (events != 0) {
+        ev_io_set(&client->c_watcher, client->cfd, events);
+        ev_io_start(EV_A_ &client->c_watcher);
+    }
+}
+
+/**
+ * drop forwarded requests from crbuf
+ */
+static void na_client_compact (na_client_t *client)
+{
+    if (client->cfwdsize == 0) {
+        return;
+    }
+    memmove(client->crbuf, client->crbuf + client->cfwdsize, client->crbufsize - client->cfwdsize);
+    client->crbufsize                -= client->cfwdsize;
+    client->crbuf[client->crbufsize]  = '\0';
+    na_memproto_parser_shift(&client->parser, client->cfwdsize);
+    if (client->cqstart >= 0) {
+        client->cqstart -= client->cfwdsize;
+    }
+    client->cfwdsize = 0;
 }
 
 static void na_client_callback(EV_P_ struct ev_io *w, int revents)
 {
-    int cfd, tsfd, size;
+    int cfd, size, start, server;
+    uint32_t hgen;
+    na_hotkey_slot_t *hslot;
     na_client_t *client;
     na_env_t *env;
+    na_memproto_parse_result_t result;
 
     cfd    = w->fd;
     client = (na_client_t *)w->data;
     env    = client->env;
-    tsfd   = client->tsfd;
-
-    pthread_rwlock_rdlock(&env->lock_refused);
-    if ((client->is_refused_active != env->is_refused_active) || env->is_refused_accept) {
-        pthread_rwlock_unlock(&env->lock_refused);
-        NA_EVENT_FAIL(NA_ERROR_INVALID_CONNPOOL, EV_A, w, client, env);
-        goto finally; // request fail
-    }
-    pthread_rwlock_unlock(&env->lock_refused);
 
     if (env->loop_max > 0 && client->loop_cnt++ > env->loop_max) {
         NA_EVENT_FAIL(NA_ERROR_OUTOF_LOOP, EV_A, w, client, env);
         goto finally; // request fail
     }
 
+    if (revents & EV_WRITE) {
+
+        if ((client->na_to_client_time_begin.tv_sec == 0) &&
+            (client->na_to_client_time_begin.tv_nsec == 0))
+        {
+            na_slow_query_gettime(env, &client->na_to_client_time_begin);
+        }
+
+        size = write(cfd,
+                     client->srbuf + client->cwbufsize,
+                     client->srbufsize - client->cwbufsize);
+
+        if (size == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                if (errno == EPIPE) {
+                    NA_EVENT_FAIL(NA_ERROR_BROKEN_PIPE, EV_A, w, client, env);
+                } else {
+                    NA_EVENT_FAIL(NA_ERROR_FAILED_WRITE, EV_A, w, client, env);
+                }
+                goto finally; // request fail
+            }
+        } else {
+            client->cwbufsize += size;
+        }
+
+        if (client->cwbufsize == client->srbufsize) {
+            client->cwbufsize        = 0;
+            client->srbufsize        = 0;
+            client->response_bufsize = env->response_bufsize;
+            if (client->request_cnt == 0) {
+                na_slow_query_gettime(env, &client->na_to_client_time_end);
+                na_slow_query_check(client);
+                na_client_compact(client);
+                client->event_state = NA_EVENT_STATE_CLIENT_READ;
+                if (client->is_quit) {
+                    na_event_stop(EV_A_ w, client, env);
+                    goto finally; // request success
+                }
+            }
+        }
+    }
+
     if (revents & EV_READ) {
 
+        if (client->crbufsize >= client->request_bufsize) {
+            na_client_compact(client);
+        }
+
         if (client->crbufsize >= client->request_bufsize) {
             size_t es;
             es = (client->request_bufsize - 1) * 2;
@@ -335,11 +1688,20 @@ static void na_client_callback(EV_P_ struct ev_io *w, int revents)
                     client->request_bufsize - client->crbufsize);
 
         if (size == 0) {
-            na_event_stop(EV_A_ w, client, env);
-            goto finally; // request success
+            if (client->request_cnt == 0 && client->srbufsize == 0) {
+                na_event_stop(EV_A_ w, client, env);
+                goto finally; // request success
+            }
+            // return responses on the way before closing
+            client->is_quit = true;
+            if (!na_client_flush_quiet(EV_A_ client, client->parser.start)) {
+                na_client_close(EV_A_ client, env);
+                goto finally; // request fail
+            }
+            goto update;
         } else if (size == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-                goto finally; // not ready yet
+                goto update; // not ready yet
             }
             NA_EVENT_FAIL(NA_ERROR_FAILED_READ, EV_A, w, client, env);
             goto finally; // request fail
@@ -348,215 +1710,198 @@ static void na_client_callback(EV_P_ struct ev_io *w, int revents)
         client->crbufsize                += size;
         client->crbuf[client->crbufsize]  = '\0';
 
-        client->cmd = na_memproto_detect_command(client->crbuf);
-
-        if (client->cmd == NA_MEMPROTO_CMD_QUIT) {
-            na_event_stop(EV_A_ w, client, env);
-            goto finally; // request success
-        } else if (client->cmd == NA_MEMPROTO_CMD_GET || client->cmd == NA_MEMPROTO_CMD_SET) {
-            client->req_cnt = na_memproto_count_request_get(client->crbuf, client->crbufsize);
-        }
-
-        if (client->crbufsize < 2) {
-            goto finally; // not ready yet
-        } else if (client->crbuf[client->crbufsize - 2] == '\r' &&
-                   client->crbuf[client->crbufsize - 1] == '\n')
-        {
-            if (client->cmd == NA_MEMPROTO_CMD_UNKNOWN) {
-                na_event_stop(EV_A_ w, client, env);
+        // only the bytes read now are parsed and every complete request is forwarded
+        while ((result = na_memproto_parse_request(&client->parser, client->crbuf, client->crbufsize)) == NA_MEMPROTO_PARSE_DONE) {
+            if (client->parser.cmd == NA_MEMPROTO_CMD_QUIT) {
+                client->is_quit   = true;
+                client->crbufsize = client->parser.start;
+                break;
+            }
+            server = na_client_route(client);
+            hslot  = NULL;
+            hgen   = 0;
+            if (client->worker->hotkey != NULL && client->parser.key_len > 0) {
+                hslot = na_hotkey_count(client->worker->hotkey, client->crbuf + client->parser.key, client->parser.key_len,
+                                        ev_now(EV_A), &hgen);
+            }
+            if (client->cqstart >= 0 && server != client->cqserver &&
+                !na_client_flush_quiet(EV_A_ client, client->parser.start))
+            {
+                na_client_close(EV_A_ client, env);
+                goto finally; // request fail
+            }
+            if (client->parser.is_quiet) {
+                if (client->cqstart < 0) {
+                    client->cqstart  = client->parser.start;
+                    client->cqserver = server;
+                }
+                na_client_write_begin(client, server);
+                continue;
+            }
+            if (client->parser.protocol == NA_MEMPROTO_PROTOCOL_TEXT && client->parser.cmd != NA_MEMPROTO_CMD_MN &&
+                !na_client_flush_quiet(EV_A_ client, client->parser.start))
+            {
+                na_client_close(EV_A_ client, env);
                 goto finally; // request fail
-            } else if (client->cmd == NA_MEMPROTO_CMD_SET && client->req_cnt < 2) {
-                goto finally; // not ready yet
             }
-            client->event_state = NA_EVENT_STATE_TARGET_WRITE;
-            na_event_switch(EV_A_ w, &client->ts_watcher, tsfd, EV_WRITE);
-            goto finally;
+            // after the quiet commands before it are forwarded, as the next request forwarded takes the write
+            na_client_write_begin(client, server);
+            start = client->cqstart >= 0 ? client->cqstart : client->parser.start;
+            if (start == 0) {
+                client->cmd = client->parser.cmd;
+            }
+            // requests forwarded from here on are the one framed last
+            client->hslot = hslot;
+            client->hgen  = hgen;
+            if (na_client_is_multiget_split(client)) {
+                if (!na_client_forward_multiget(EV_A_ client)) {
+                    na_client_close(EV_A_ client, env);
+                    goto finally; // request fail
+                }
+            } else if (na_client_is_single_get(client)) {
+                if (!na_client_forward_get(EV_A_ client, start, server)) {
+                    na_client_close(EV_A_ client, env);
+                    goto finally; // request fail
+                }
+            } else if (na_client_forward(EV_A_ client, client->crbuf + start, client->parser.off - start, server,
+                                         client->parser.cmd, client->parser.is_noreply ? 0 : 1, false) == NULL)
+            {
+                na_client_close(EV_A_ client, env);
+                goto finally; // request fail
+            }
+            client->cqstart  = -1;
+            client->cfwdsize = client->parser.off;
+            client->hslot    = NULL;
         }
 
-    } else if (revents & EV_WRITE) {
-
-        if ((client->na_to_client_time_begin.tv_sec == 0) &&
-            (client->na_to_client_time_begin.tv_nsec == 0))
-        {
-            na_slow_query_gettime(env, &client->na_to_client_time_begin);
+        if (client->is_quit || client->parser.start == client->crbufsize) {
+            if (!na_client_flush_quiet(EV_A_ client, client->parser.start)) {
+                na_client_close(EV_A_ client, env);
+                goto finally; // request fail
+            }
         }
 
-        size = write(cfd,
-                     client->srbuf + client->cwbufsize,
-                     client->srbufsize - client->cwbufsize);
-
-        if (size == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
-                goto finally; // not ready yet
-            }
-            if (errno == EPIPE) {
-                NA_EVENT_FAIL(NA_ERROR_BROKEN_PIPE, EV_A, w, client, env);
-            } else {
-                NA_EVENT_FAIL(NA_ERROR_FAILED_WRITE, EV_A, w, client, env);
-            }
+        if (result == NA_MEMPROTO_PARSE_ERROR) {
+            na_event_stop(EV_A_ w, client, env);
             goto finally; // request fail
         }
 
-        client->cwbufsize += size;
-        if (client->cwbufsize < client->srbufsize) {
-            na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_WRITE);
-            goto finally;
-        } else {
-            na_slow_query_gettime(env, &client->na_to_client_time_end);
-            na_slow_query_check(client);
-
-            client->crbufsize        = 0;
-            client->cwbufsize        = 0;
-            client->srbufsize        = 0;
-            client->swbufsize        = 0;
-            client->request_bufsize  = env->request_bufsize;
-            client->response_bufsize = env->response_bufsize;
-            client->event_state      = NA_EVENT_STATE_CLIENT_READ;
-            client->req_cnt          = 0;
-            client->res_cnt          = 0;
-            na_event_switch(EV_A_ w, &client->c_watcher, cfd, EV_READ);
-            goto finally;
+        if (client->is_quit && client->request_cnt == 0 && client->srbufsize == 0) {
+            na_event_stop(EV_A_ w, client, env);
+            goto finally; // request success
         }
     }
 
-finally:
+ update:
+    na_client_update(EV_A_ client);
+
+ finally:
     ; // do nothing
 }
 
-void na_front_server_callback (EV_P_ struct ev_io *w, int revents)
+static na_client_t *na_front_server_accept (na_env_t *env, int fsfd, na_client_pool_t *client_pool, int pool_idx)
 {
-    int fsfd, cfd, tsfd, cur_pool, cur_cli;
-    na_env_t *env;
+    int cfd, conn, conn_max;
     na_client_t *client;
-    na_connpool_t *connpool;
-    na_server_t *server;
-
-    fsfd     = w->fd;
-    env      = (na_env_t *)w->data;
-    cfd      = -1;
-    tsfd     = -1;
-    cur_pool = -1;
-    cur_cli  = -1;
-
-    pthread_rwlock_rdlock(&env->lock_refused);
-    if (env->is_refused_accept) {
-        pthread_rwlock_unlock(&env->lock_refused);
-        goto finally;
-    }
-    pthread_rwlock_unlock(&env->lock_refused);
-
-    pthread_mutex_lock(&env->lock_current_conn);
-    if (env->current_conn >= env->conn_max) {
-        pthread_mutex_unlock(&env->lock_current_conn);
-        goto finally;
-    }
-    pthread_mutex_unlock(&env->lock_current_conn);
-
-    pthread_rwlock_rdlock(&env->lock_refused);
-    connpool = na_connpool_select(env);
-    if (env->is_use_backup) {
-        server = env->is_refused_active ? &env->backup_server : &env->target_server;
-    } else {
-        server = &env->target_server;
-    }
-    pthread_rwlock_unlock(&env->lock_refused);
+    na_tier_t *tier;
 
-    if (!na_connpool_assign(env, connpool, &cur_pool, &tsfd, server)) {
-        tsfd = na_target_server_tcpsock_init();
-        if (tsfd < 0) {
-            NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_INVALID_FD);
-            goto finally;
-        }
-        na_target_server_tcpsock_setup(tsfd, true);
+    cfd = -1;
 
-        if (!na_server_connect(tsfd, &server->addr)) {
-            if (errno != EINPROGRESS && errno != EALREADY) {
-                close(tsfd);
-                NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_CONNECTION_FAILED);
-                goto finally;
-            }
-        }
+    // clients are counted by the workers they are handed to
+    conn = na_env_current_conn(env);
+    if (conn >= env->conn_max) {
+        return NULL;
     }
 
     if ((cfd = na_server_accept(fsfd)) < 0) {
-        if (cur_pool == -1) {
-            close(tsfd);
-        } else {
-            pthread_mutex_lock(&env->lock_connpool);
-            connpool->mark[cur_pool] = 0;
-            pthread_mutex_unlock(&env->lock_connpool);
-        }
         NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_INVALID_FD);
-        goto finally;
+        return NULL;
     }
 
     na_set_nonblock(cfd);
 
-    cur_cli = na_client_assign(env);
+    client = na_client_pool_assign(client_pool);
 
-    if (cur_cli >= 0) {
-        client = &ClientPool[cur_cli];
-        if (client->tsfd > 0) {
-            close(client->tsfd);
-        }
+    if (client != NULL) {
+        client->is_use_client_pool = true;
     } else {
         client = (na_client_t *)malloc(sizeof(na_client_t));
         if (client == NULL) {
             close(cfd);
-            if (cur_pool == -1) {
-                close(tsfd);
-            } else {
-                pthread_mutex_lock(&env->lock_connpool);
-                connpool->mark[cur_pool] = 0;
-                pthread_mutex_unlock(&env->lock_connpool);
-            }
             NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
-            goto finally;
+            return NULL;
         }
         memset(client, 0, sizeof(*client));
-        client->crbuf = (char *)malloc(env->request_bufsize + 1);
-        client->srbuf = (char *)malloc(env->response_bufsize + 1);
-        if (client->crbuf == NULL ||
-            client->srbuf == NULL) {
+        client->is_use_client_pool = false;
+        client->crbuf   = (char *)malloc(env->request_bufsize + 1);
+        client->srbuf   = (char *)malloc(env->response_bufsize + 1);
+        client->tsconns = calloc(sizeof(na_tsconn_t), env->server_cnt);
+        if (client->crbuf   == NULL ||
+            client->srbuf   == NULL ||
+            client->tsconns == NULL) {
             NA_FREE(client->crbuf);
             NA_FREE(client->srbuf);
+            NA_FREE(client->tsconns);
             NA_FREE(client);
             close(cfd);
-            if (cur_pool == -1) {
-                close(tsfd);
-            } else {
-                pthread_mutex_lock(&env->lock_connpool);
-                connpool->mark[cur_pool] = 0;
-                pthread_mutex_unlock(&env->lock_connpool);
-            }
             NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
-            goto finally;
+            return NULL;
+        }
+    }
+
+    for (int i=0;i<env->server_cnt;++i) {
+        client->tsconns[i].fd        = -1;
+        client->tsconns[i].loop      = NULL;
+        client->tsconns[i].is_shared = false;
+    }
+
+    // in multiplex mode requests go through the connections shared in each worker.
+    // with more than one server in the active tier, connections are opened on the first request to each
+    tier = na_env_active_tier(env);
+    if (env->multiplex_conn_max == 0 && tier->cnt == 1 &&
+        !na_tsconn_open(env, &client->tsconns[tier->first], tier->first, pool_idx, NA_MEMPROTO_PROTOCOL_NOT_DETECTED))
+    {
+        close(cfd);
+        if (client->is_use_client_pool) {
+            na_client_pool_release(client_pool, client);
+        } else {
+            NA_FREE(client->crbuf);
+            NA_FREE(client->srbuf);
+            NA_FREE(client->tsconns);
+            NA_FREE(client);
         }
+        return NULL;
     }
 
     client->cfd                = cfd;
-    client->tsfd               = tsfd;
     client->env                = env;
     client->c_watcher.data     = client;
-    client->ts_watcher.data    = client;
-    pthread_rwlock_rdlock(&env->lock_refused);
-    client->is_refused_active  = env->is_refused_active;
-    pthread_rwlock_unlock(&env->lock_refused);
-    client->is_use_connpool    = cur_pool != -1 ? true : false;
-    client->is_use_client_pool = cur_cli  != -1 ? true : false;
-    client->cur_pool           = cur_pool;
+    client->client_pool        = client_pool;
+    client->rhead              = NULL;
+    client->rtail              = NULL;
+    client->request_cnt        = 0;
+    client->cfwdsize           = 0;
+    client->cqstart            = -1;
+    client->cqserver           = 0;
+    client->failover_gen       = 0;
+    client->hslot              = NULL;
+    client->hgen               = 0;
+    client->cache_writes       = NULL;
+    client->cache_write_cnt    = 0;
+    client->cache_write_max    = 0;
+    client->is_quit            = false;
     client->crbufsize          = 0;
     client->cwbufsize          = 0;
     client->srbufsize          = 0;
-    client->swbufsize          = 0;
     client->request_bufsize    = env->request_bufsize;
     client->response_bufsize   = env->response_bufsize;
     client->event_state        = NA_EVENT_STATE_CLIENT_READ;
-    client->req_cnt            = 0;
-    client->res_cnt            = 0;
     client->loop_cnt           = 0;
     client->cmd                = NA_MEMPROTO_CMD_NOT_DETECTED;
-    client->connpool           = connpool;
+    na_memproto_parser_init(&client->parser);
+    client->worker             = NULL;
+    client->prev               = NULL;
+    client->next               = NULL;
     memset(&client->na_from_ts_time_begin,   0, sizeof(struct timespec));
     memset(&client->na_from_ts_time_end,     0, sizeof(struct timespec));
     memset(&client->na_to_ts_time_begin,     0, sizeof(struct timespec));
@@ -564,104 +1909,196 @@ void na_front_server_callback (EV_P_ struct ev_io *w, int revents)
     memset(&client->na_to_client_time_begin, 0, sizeof(struct timespec));
     memset(&client->na_to_client_time_end,   0, sizeof(struct timespec));
 
-    pthread_mutex_lock(&env->lock_current_conn);
-    ++env->current_conn;
+    while ((conn_max = env->current_conn_max) < conn + 1 &&
+           !__sync_bool_compare_and_swap(&env->current_conn_max, conn_max, conn + 1))
+    {
+        // raised by another worker
+    }
+
+    return client;
+}
+
+static void na_front_server_callback (EV_P_ struct ev_io *w, int revents)
+{
+    int fsfd;
+    na_env_t *env;
+    na_client_t *client;
+    na_worker_t *worker;
+
+    fsfd   = w->fd;
+    env    = (na_env_t *)w->data;
+    client = na_front_server_accept(env, fsfd, ClientPool, 0);
 
-    if (env->current_conn > env->current_conn_max) {
-        env->current_conn_max = env->current_conn;
+    if (client == NULL) {
+        goto finally;
     }
-    pthread_mutex_unlock(&env->lock_current_conn);
 
-    if (!na_is_worker_busy(env)) {
-        if (!na_event_queue_push(EventQueue, client)) {
-            NA_ERROR_OUTPUT(env, "Too Many Connections!");
-            ev_io_init(&client->c_watcher,  na_client_callback,        client->cfd,  EV_READ);
-            ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_NONE);
-            ev_io_start(EV_A_ &client->c_watcher);
-        }
-    } else {
-        ev_io_init(&client->c_watcher,  na_client_callback,        client->cfd,  EV_READ);
-        ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_NONE);
-        ev_io_start(EV_A_ &client->c_watcher);
+    // hand over the client to the least loaded worker
+    worker         = na_worker_select(env);
+    client->worker = worker;
+    __sync_add_and_fetch(&worker->client_cnt, 1);
+    if (!na_event_queue_push(worker->queue, client)) {
+        NA_ERROR_OUTPUT(env, "Too Many Connections!");
+        // the client was never started, so it is not linked to the worker
+        __sync_sub_and_fetch(&worker->client_cnt, 1);
+        client->worker = NULL;
+        na_client_close(EV_A_ client, env);
+        goto finally;
     }
+    ev_async_send(worker->loop, &worker->async_watcher);
 
 finally:
-    pthread_mutex_lock(&env->lock_current_conn);
-    if (GracefulPhase == NA_GRACEFUL_PHASE_ENABLED) {
+    if (GracefulPhase == NA_GRACEFUL_PHASE_ENABLED &&
+        __sync_bool_compare_and_swap(&GracefulPhase, NA_GRACEFUL_PHASE_ENABLED, NA_GRACEFUL_PHASE_STOP_ACCEPT))
+    {
         ev_io_set(&env->fs_watcher, fsfd, EV_NONE);
-        GracefulPhase = NA_GRACEFUL_PHASE_STOP_ACCEPT;
     }
-    pthread_mutex_unlock(&env->lock_current_conn);
 
 }
 
-static bool na_is_worker_busy(na_env_t *env)
+static void na_front_server_worker_callback (EV_P_ struct ev_io *w, int revents)
 {
-    int count_is_worker_busy = 0;
-    for (int i=0;i<env->worker_max;++i) {
-        pthread_rwlock_rdlock(&env->lock_worker_busy[i]);
-        if (env->is_worker_busy[i]) {
-            ++count_is_worker_busy;
-        }
-        pthread_rwlock_unlock(&env->lock_worker_busy[i]);
+    na_worker_t *worker;
+    na_env_t *env;
+    na_client_t *client;
+
+    worker = (na_worker_t *)w->data;
+    env    = worker->env;
+    client = na_front_server_accept(env, w->fd, worker->client_pool, worker->id);
+
+    if (client != NULL) {
+        client->worker = worker;
+        __sync_add_and_fetch(&worker->client_cnt, 1);
+        na_client_start(EV_A_ client);
     }
 
-    if (count_is_worker_busy == env->worker_max) {
-        return true;
+    // in reuseport mode, each worker stops accepting by itself
+    if (GracefulPhase != NA_GRACEFUL_PHASE_DISABLED) {
+        ev_io_stop(EV_A_ w);
+        __sync_bool_compare_and_swap(&GracefulPhase, NA_GRACEFUL_PHASE_ENABLED, NA_GRACEFUL_PHASE_STOP_ACCEPT);
     }
+}
+
+static na_worker_t *na_worker_select(na_env_t *env)
+{
+    static int cursor = 0;
+    na_worker_t *worker;
+
+    // start from a rotating position so that idle workers are chosen in turn
+    worker = &env->workers[cursor];
+    for (int i=1;i<env->worker_max;++i) {
+        na_worker_t *w = &env->workers[(cursor + i) % env->worker_max];
+        if (w->client_cnt < worker->client_cnt) {
+            worker = w;
+        }
+    }
+    cursor = (cursor + 1) % env->worker_max;
 
-    return false;
+    return worker;
 }
 
-static void *na_event_observer(void *args)
+static void na_worker_async_callback (EV_P_ ev_async *w, int revents)
 {
-    struct ev_loop *loop;
-    na_env_t *env;
+    na_worker_t *worker;
     na_client_t *client;
-    static int tid_s = 0;
-    int tid;
 
-    env  = (na_env_t *)args;
-    pthread_mutex_lock(&env->lock_loop);
-    loop = na_event_loop_create(env->event_model);
-    pthread_mutex_unlock(&env->lock_loop);
+    worker = (na_worker_t *)w->data;
 
-    pthread_mutex_lock(&env->lock_tid);
-    tid = tid_s++;
-    pthread_mutex_unlock(&env->lock_tid);
+    while ((client = na_event_queue_pop(worker->queue)) != NULL) {
+        na_client_start(EV_A_ client);
+    }
 
-    while (true) {
-        client = na_event_queue_pop(EventQueue);
+    na_worker_release_idle(worker);
+}
 
-        if (client == NULL) {
-            pthread_mutex_lock(&EventQueue->lock);
-            if (EventQueue->cnt == 0) {
-                pthread_cond_wait(&EventQueue->cond, &EventQueue->lock);
-            }
-            pthread_mutex_unlock(&EventQueue->lock);
+/**
+ * hand over idle clients to the worker which asked for them.
+ * a client can move only between requests, when it waits for a new request
+ * with nothing buffered, because its watchers belong to this worker's loop.
+ */
+static void na_worker_release_idle (na_worker_t *worker)
+{
+    na_worker_t *to;
+    na_client_t *client, *next;
+    int id, n, moved;
+
+    id = __sync_lock_test_and_set(&worker->migrate_to, -1);
+    if (id < 0) {
+        return;
+    }
+
+    to    = &worker->env->workers[id];
+    n     = (worker->client_cnt - to->client_cnt) / 2;
+    moved = 0;
+    for (client = worker->clients;client != NULL && moved < n;client = next) {
+        next = client->next;
+        if (client->event_state != NA_EVENT_STATE_CLIENT_READ ||
+            client->crbufsize > 0 || client->request_cnt > 0 || client->srbufsize > 0)
+        {
             continue;
         }
+        ev_io_stop(worker->loop, &client->c_watcher);
+        na_client_unlink(client);
+        na_client_migrate(client, to);
+        if (!na_event_queue_push(to->queue, client)) {
+            // the thief is full, so take the client back
+            na_client_migrate(client, worker);
+            na_client_start(worker->loop, client);
+            break;
+        }
+        __sync_add_and_fetch(&to->steal_cnt, 1);
+        ++moved;
+    }
 
-        ev_io_init(&client->c_watcher,  na_client_callback,        client->cfd,  EV_READ);
-        ev_io_init(&client->ts_watcher, na_target_server_callback, client->tsfd, EV_NONE);
-        ev_io_start(EV_A_ &client->c_watcher);
-        pthread_rwlock_wrlock(&env->lock_worker_busy[tid]);
-        env->is_worker_busy[tid] = true;
-        pthread_rwlock_unlock(&env->lock_worker_busy[tid]);
-        ev_loop(EV_A_ 0);
-        pthread_rwlock_wrlock(&env->lock_worker_busy[tid]);
-        env->is_worker_busy[tid] = false;
-        pthread_rwlock_unlock(&env->lock_worker_busy[tid]);
+    if (moved > 0) {
+        ev_async_send(to->loop, &to->async_watcher);
     }
+}
 
-    return NULL;
+/**
+ * work stealing: a worker with fewer clients than the busiest one takes over
+ * clients still waiting in the busiest one's queue and asks it for idle clients.
+ */
+static void na_worker_steal_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_worker_t *worker, *victim;
+    na_client_t *client;
+    na_env_t *env;
+
+    worker = (na_worker_t *)w->data;
+    env    = worker->env;
+    victim = NULL;
+    for (int i=0;i<env->worker_max;++i) {
+        na_worker_t *v = &env->workers[i];
+        if (v != worker && (victim == NULL || v->client_cnt > victim->client_cnt)) {
+            victim = v;
+        }
+    }
+
+    if (victim == NULL) {
+        return;
+    }
+
+    while (victim->client_cnt - worker->client_cnt >= 2 &&
+           (client = na_event_queue_pop(victim->queue)) != NULL)
+    {
+        // not started yet, so the client is not linked to the victim
+        na_client_migrate(client, worker);
+        na_client_start(EV_A_ client);
+        __sync_add_and_fetch(&worker->steal_cnt, 1);
+    }
+
+    if (victim->client_cnt - worker->client_cnt >= 2 &&
+        __sync_bool_compare_and_swap(&victim->migrate_to, -1, worker->id))
+    {
+        ev_async_send(victim->loop, &victim->async_watcher);
+    }
 }
 
 static void *na_support_loop (void *args)
 {
     struct ev_loop *loop;
     na_env_t *env;
-    ev_timer hc_watcher;
     ev_io    st_watcher;
 
     env  = (na_env_t *)args;
@@ -670,10 +2107,13 @@ static void *na_support_loop (void *args)
     pthread_mutex_unlock(&env->lock_loop);
 
     // health check event
-    if (env->is_use_backup) {
-        hc_watcher.data = env;
-        ev_timer_init(&hc_watcher, na_hc_callback, 3., 0.);
-        ev_timer_start(EV_A_ &hc_watcher);
+    if (env->hc != NULL) {
+        na_hc_start(EV_A_ env->hc);
+    }
+
+    // standby connections to backup server
+    if (env->standby != NULL) {
+        na_standby_start(EV_A_ env->standby);
     }
 
     // stat event
@@ -685,14 +2125,27 @@ static void *na_support_loop (void *args)
     return NULL;
 }
 
+static void *na_event_worker(void *args)
+{
+    na_worker_t *worker;
+
+    worker = (na_worker_t *)args;
+
+    // the loop never runs dry because the async watcher is always active
+    ev_loop(worker->loop, 0);
+
+    return NULL;
+}
+
 void *na_event_loop (void *args)
 {
     struct ev_loop *loop;
     na_env_t  *env;
     pthread_t  th_support;
     pthread_t *th_workers;
+    int        tsfd;
 
-    // for assign connection from connpool directional-ramdomly
+    // for retry interval of health check
     srand(time(NULL));
 
     env = (na_env_t *)args;
@@ -700,39 +2153,101 @@ void *na_event_loop (void *args)
     if (strlen(env->fssockpath) > 0) {
         env->fsfd = na_front_server_unixsock_init(env->fssockpath, env->access_mask, env->conn_max);
     } else {
-        env->fsfd = na_front_server_tcpsock_init(env->fsport, env->conn_max);
+        env->fsfd = na_front_server_tcpsock_init(env->fsport, env->conn_max, env->is_reuseport);
     }
 
     if (env->fsfd < 0) {
         NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
     }
 
-    env->tsfd = na_target_server_tcpsock_init();
-    if (env->tsfd < 0) {
+    // target server must be up at first
+    tsfd = na_target_server_tcpsock_init();
+    if (tsfd < 0) {
         NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
     }
-    if (!na_server_connect(env->tsfd, &env->target_server.addr)) {
+    if (!na_server_connect(tsfd, &env->target_server.addr)) {
         NA_DIE_WITH_ERROR(env, NA_ERROR_CONNECTION_FAILED);
     }
-    na_target_server_hcsock_setup(env->tsfd);
-
-    na_connpool_init(env);
+    close(tsfd);
 
-    ClientPool = calloc(sizeof(na_client_t), env->client_pool_max);
-    memset(ClientPool, 0, sizeof(na_client_t) * env->client_pool_max);
-    for (int i=0;i<env->client_pool_max;++i) {
-        ClientPool[i].crbuf   = (char *)malloc(env->request_bufsize + 1);
-        ClientPool[i].srbuf   = (char *)malloc(env->response_bufsize + 1);
-        ClientPool[i].is_used = false;
-        pthread_mutex_init(&ClientPool[i].lock_use, NULL);
+    if (!env->is_reuseport) {
+        ClientPool = na_client_pool_create(env);
     }
 
-    if (EventQueue == NULL) {
-        EventQueue = na_event_queue_create(env->conn_max);
+    env->workers = calloc(sizeof(na_worker_t), env->worker_max);
+    for (int i=0;i<env->worker_max;++i) {
+        na_worker_t *worker = &env->workers[i];
+        worker->id         = i;
+        worker->env        = env;
+        worker->client_cnt = 0;
+        worker->migrate_to = -1;
+        worker->loop       = na_event_loop_create(env->event_model);
+        worker->queue      = na_event_queue_create(env->conn_max);
+        worker->tsconns    = NULL;
+        worker->collapse   = NULL;
+        worker->collapse_cnt = 0;
+        worker->cache_buf    = NULL;
+        worker->cache_bufmax = 0;
+        worker->hotkey       = NULL;
+        if (env->hotkey_max > 0) {
+            worker->hotkey = na_hotkey_create(env->hotkey_max, env->hotkey_window_sec);
+            if (worker->hotkey == NULL) {
+                NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+            }
+        }
+        if (env->is_get_collapse) {
+            worker->collapse = na_collapse_create(NA_COLLAPSE_BUCKET_MAX);
+            if (worker->collapse == NULL) {
+                NA_DIE_WITH_ERROR(env, NA_ERROR_OUTOF_MEMORY);
+            }
+        }
+        if (env->multiplex_conn_max > 0) {
+            worker->tsconns = calloc(sizeof(na_tsconn_t), env->server_cnt * env->multiplex_conn_max * 2);
+            for (int j=0;j<env->server_cnt * env->multiplex_conn_max * 2;++j) {
+                worker->tsconns[j].fd        = -1;
+                worker->tsconns[j].env       = env;
+                worker->tsconns[j].loop      = worker->loop;
+                worker->tsconns[j].is_shared = true;
+                ev_timer_init(&worker->tsconns[j].batch_watcher, na_tsconn_batch_callback, 0., 0.);
+                worker->tsconns[j].batch_watcher.data = &worker->tsconns[j];
+            }
+        }
+
+        worker->async_watcher.data = worker;
+        ev_async_init(&worker->async_watcher, na_worker_async_callback);
+        ev_async_start(worker->loop, &worker->async_watcher);
+
+        if (env->is_reuseport) {
+            // shared-nothing mode: every worker owns a listener, a client pool and a connection pool
+            worker->client_pool = na_client_pool_create(env);
+            if (i == 0 || strlen(env->fssockpath) > 0) {
+                // SO_REUSEPORT does not balance unix domain sockets
+                worker->fsfd = env->fsfd;
+            } else {
+                worker->fsfd = na_front_server_tcpsock_init(env->fsport, env->conn_max, true);
+                if (worker->fsfd < 0) {
+                    NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+                }
+            }
+            worker->fs_watcher.data = worker;
+            ev_io_init(&worker->fs_watcher, na_front_server_worker_callback, worker->fsfd, EV_READ);
+            ev_io_start(worker->loop, &worker->fs_watcher);
+        } else {
+            worker->client_pool = ClientPool;
+            worker->fsfd        = -1;
+            // clients are moved between loops only when they share a client pool and connection pool
+            if (env->worker_steal_interval > 0 && env->worker_max > 1) {
+                worker->steal_watcher.data = worker;
+                ev_timer_init(&worker->steal_watcher, na_worker_steal_callback,
+                              env->worker_steal_interval, env->worker_steal_interval);
+                ev_timer_start(worker->loop, &worker->steal_watcher);
+            }
+        }
     }
+
     th_workers = calloc(sizeof(pthread_t), env->worker_max);
     for (int i=0;i<env->worker_max;++i) {
-        pthread_create(&th_workers[i], NULL, na_event_observer, env);
+        pthread_create(&th_workers[i], NULL, na_event_worker, &env->workers[i]);
     }
 
     if (strlen(env->stsockpath) > 0) {
@@ -742,21 +2257,41 @@ void *na_event_loop (void *args)
     }
     pthread_create(&th_support, NULL, na_support_loop, env);
 
-    pthread_mutex_lock(&env->lock_loop);
-    loop = na_event_loop_create(env->event_model);
-    pthread_mutex_unlock(&env->lock_loop);
-    env->fs_watcher.data = env;
-    ev_io_init(&env->fs_watcher, na_front_server_callback, env->fsfd, EV_READ);
-    ev_io_start(EV_A_ &env->fs_watcher);
-    ev_loop(EV_A_ 0);
+    if (env->is_reuseport) {
+        for (int i=0;i<env->worker_max;++i) {
+            pthread_join(th_workers[i], NULL);
+        }
+    } else {
+        pthread_mutex_lock(&env->lock_loop);
+        loop = na_event_loop_create(env->event_model);
+        pthread_mutex_unlock(&env->lock_loop);
+        env->fs_watcher.data = env;
+        ev_io_init(&env->fs_watcher, na_front_server_callback, env->fsfd, EV_READ);
+        ev_io_start(EV_A_ &env->fs_watcher);
+        ev_loop(EV_A_ 0);
+    }
 
-    for (int i=0;i<env->client_pool_max;++i) {
-        NA_FREE(ClientPool[i].crbuf);
-        NA_FREE(ClientPool[i].srbuf);
-        pthread_mutex_destroy(&ClientPool[i].lock_use);
+    for (int i=0;i<env->worker_max;++i) {
+        if (env->is_reuseport) {
+            na_client_pool_destroy(env->workers[i].client_pool);
+        }
+        na_event_queue_destroy(env->workers[i].queue);
+        for (int j=0;j<env->server_cnt * env->multiplex_conn_max * 2;++j) {
+            na_tsconn_close(&env->workers[i].tsconns[j]);
+            NA_FREE(env->workers[i].tsconns[j].wbuf);
+            NA_FREE(env->workers[i].tsconns[j].rbuf);
+            NA_FREE(env->workers[i].tsconns[j].bbuf);
+        }
+        NA_FREE(env->workers[i].tsconns);
+        na_collapse_destroy(env->workers[i].collapse);
+        NA_FREE(env->workers[i].cache_buf);
+        na_hotkey_destroy(env->workers[i].hotkey);
+    }
+    if (!env->is_reuseport) {
+        na_client_pool_destroy(ClientPool);
     }
-    NA_FREE(ClientPool);
-    na_event_queue_destroy(EventQueue);
+    NA_FREE(env->workers);
+    NA_FREE(th_workers);
 
     return NULL;
 }
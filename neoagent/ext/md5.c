@@ -0,0 +1,143 @@
+/**
+   In short, md5.c is distributed under so called "BSD license",
+
+   Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without modification,
+   are permitted provided that the following conditions are met:
+
+   * Redistributions of source code must retain the above copyright notice,
+   this list of conditions and the following disclaimer.
+
+   * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+   * Neither the name of the authors nor the names of its contributors
+   may be used to endorse or promote products derived from this software
+   without specific prior written permission.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+   TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+   PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+   LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+   NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+   SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/* written by C99 style */
+
+#include <string.h>
+
+#include "md5.h"
+
+/**
+ * private function
+ */
+static void md5_block(uint32_t state[4], const uint8_t *block);
+
+#define MD5_ROTL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(uint32_t state[4], const uint8_t *block)
+{
+    uint32_t w[16], a, b, c, d, f, t;
+    int g;
+
+    for (int i=0;i<16;++i) {
+        w[i] = (uint32_t)block[i * 4]             |
+               (uint32_t)block[i * 4 + 1] << 8    |
+               (uint32_t)block[i * 4 + 2] << 16   |
+               (uint32_t)block[i * 4 + 3] << 24;
+    }
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    for (int i=0;i<64;++i) {
+        if (i < 16) {
+            f = (b & c) | (~b & d);
+            g = i;
+        } else if (i < 32) {
+            f = (d & b) | (~d & c);
+            g = (5 * i + 1) % 16;
+        } else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) % 16;
+        } else {
+            f = c ^ (b | ~d);
+            g = (7 * i) % 16;
+        }
+        t = d;
+        d = c;
+        c = b;
+        b = b + MD5_ROTL(a + f + md5_k[i] + w[g], md5_r[i]);
+        a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+/**
+ * digest of data
+ */
+void md5_digest(const void *data, size_t len, uint8_t digest[MD5_DIGEST_SIZE])
+{
+    const uint8_t *p;
+    uint8_t tail[128];
+    uint32_t state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    uint64_t bits;
+    size_t rest, tailsize;
+
+    p = (const uint8_t *)data;
+    for (rest = len;rest >= 64;rest -= 64, p += 64) {
+        md5_block(state, p);
+    }
+
+    // padding and length in bits at the end of last block
+    memcpy(tail, p, rest);
+    tail[rest] = 0x80;
+    tailsize   = rest + 1 + 8 <= 64 ? 64 : 128;
+    memset(tail + rest + 1, 0, tailsize - rest - 1);
+    bits = (uint64_t)len * 8;
+    for (int i=0;i<8;++i) {
+        tail[tailsize - 8 + i] = (uint8_t)(bits >> (i * 8));
+    }
+    md5_block(state, tail);
+    if (tailsize == 128) {
+        md5_block(state, tail + 64);
+    }
+
+    for (int i=0;i<4;++i) {
+        digest[i * 4]     = (uint8_t)state[i];
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 3] = (uint8_t)(state[i] >> 24);
+    }
+}
@@ -6,141 +6,477 @@
  *
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
 
 #include "defines.h"
 
+#ifndef HOST_NAME_MAX
+#define HOST_NAME_MAX 255
+#endif
+
 // constants
 static const char *na_hc_test_key = "neoagent_test_key";
 static const char *na_hc_test_val = "neoagent_test_val";
+static const double NA_HC_INTERVAL       = 5.;
+static const double NA_HC_INTERVAL_FIRST = 3.;
+static const double NA_HC_EJECT_INTERVAL = 1.;
 
-static void na_hc_event_set(EV_P_ ev_timer * w, int revents);
-static bool na_hc_test_request(int tsfd, int try_max);
+// private functions
+static void na_hc_callback (EV_P_ ev_timer *w, int revents);
+static void na_hc_probe_callback (EV_P_ ev_io *w, int revents);
+static void na_hc_probe_timer_callback (EV_P_ ev_timer *w, int revents);
+static void na_hc_round_begin (EV_P_ na_hc_probe_t *probe);
+static void na_hc_send (EV_P_ na_hc_probe_t *probe, na_hc_state_t state, const char *cmd, const char *expected);
+static void na_hc_round_fail (EV_P_ na_hc_probe_t *probe);
+static void na_hc_probe_done (EV_P_ na_hc_probe_t *probe, bool is_healthy);
+static void na_hc_switch (na_env_t *env, int tier);
+static bool na_hc_is_up (na_hc_t *hc, int i, bool is_full);
+static bool na_hc_tier_is_up (na_hc_t *hc, int tier, bool is_full);
+static void na_hc_failover (na_hc_t *hc);
+static void na_hc_judge (na_hc_t *hc);
+static bool na_hc_is_outlier (na_env_t *env, na_health_t *health);
+static void na_hc_eject_callback (EV_P_ ev_timer *w, int revents);
 
-static void na_hc_event_set(EV_P_ ev_timer * w, int revents)
+na_hc_t *na_hc_create (na_env_t *env)
 {
-    ev_timer_stop(EV_A_ w);
-    ev_timer_set(w, 5., 0.);
-    ev_timer_start(EV_A_ w);
-}
+    na_hc_t *hc;
+    char hostname[HOST_NAME_MAX + 1];
+    size_t vlen;
 
-static bool is_success_command(int tsfd, char *command, const char *expected)
-{
-    int len;
-    char rbuf[BUFSIZ];
-    if (write(tsfd, command, strlen(command)) < 0) {
-        return false;
+    hc = (na_hc_t *)calloc(sizeof(na_hc_t), 1);
+    if (hc == NULL) {
+        return NULL;
     }
+    hc->probe_cnt = env->server_cnt;
+    hc->probes    = calloc(sizeof(na_hc_probe_t), hc->probe_cnt);
+    if (hc->probes == NULL) {
+        NA_FREE(hc);
+        return NULL;
+    }
+    hc->env     = env;
+    hc->timeout = env->hc_timeout_msec / 1000.;
 
-    if ((len = read(tsfd, rbuf, BUFSIZ)) < 0) {
-        return false;
+    for (int i=0;i<hc->probe_cnt;++i) {
+        na_hc_probe_t *probe = &hc->probes[i];
+        probe->hc         = hc;
+        probe->server     = na_env_server(env, i);
+        probe->fd         = -1;
+        probe->state      = NA_HC_STATE_IDLE;
+        probe->latency    = -1;
+        probe->is_healthy = true;
+        probe->watcher.data = probe;
+        probe->timer.data   = probe;
+        ev_init(&probe->watcher, na_hc_probe_callback);
+        ev_init(&probe->timer, na_hc_probe_timer_callback);
     }
-    rbuf[len] = '\0';
 
-    if (strcmp(rbuf, expected) != 0) {
-        return false;
+    // the longest hostname fits every command in NA_HC_BUF_MAX
+    gethostname(hostname, sizeof(hostname));
+    hostname[sizeof(hostname) - 1] = '\0';
+    vlen = strlen(na_hc_test_val) + 1 + strlen(hostname);
+    snprintf(hc->scmd, NA_HC_BUF_MAX, "set %s_%s 0 0 %ld\r\n%s_%s\r\n", na_hc_test_key, hostname, vlen, na_hc_test_val, hostname);
+    snprintf(hc->gcmd, NA_HC_BUF_MAX, "get %s_%s\r\n", na_hc_test_key, hostname);
+    snprintf(hc->dcmd, NA_HC_BUF_MAX, "delete %s_%s\r\n", na_hc_test_key, hostname);
+    snprintf(hc->gres, NA_HC_BUF_MAX, "VALUE %s_%s 0 %ld\r\n%s_%s\r\nEND\r\n", na_hc_test_key, hostname, vlen, na_hc_test_val, hostname);
+
+    return hc;
+}
+
+void na_hc_start (EV_P_ na_hc_t *hc)
+{
+    hc->loop         = loop;
+    hc->watcher.data = hc;
+    ev_timer_init(&hc->watcher, na_hc_callback, NA_HC_INTERVAL_FIRST, 0.);
+    ev_timer_start(EV_A_ &hc->watcher);
+
+    if (hc->env->healths != NULL) {
+        hc->eject_watcher.data = hc;
+        ev_timer_init(&hc->eject_watcher, na_hc_eject_callback, NA_HC_EJECT_INTERVAL, NA_HC_EJECT_INTERVAL);
+        ev_timer_start(EV_A_ &hc->eject_watcher);
     }
+}
 
+/**
+ * start a check of all the servers
+ */
+static void na_hc_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_hc_t *hc;
 
-    return true;
+    hc = (na_hc_t *)w->data;
+
+    hc->pending = hc->probe_cnt;
+    for (int i=0;i<hc->probe_cnt;++i) {
+        hc->probes[i].try_cnt = 0;
+        na_hc_round_begin(EV_A_ &hc->probes[i]);
+    }
 }
 
-static bool na_hc_test_request(int tsfd, int try_max)
+static void na_hc_round_begin (EV_P_ na_hc_probe_t *probe)
 {
-    int  cnt_fail;
-    char hostname[BUFSIZ];
+    probe->start = ev_time();
+
+    if (probe->fd >= 0) {
+        na_hc_send(EV_A_ probe, NA_HC_STATE_SET, probe->hc->scmd, "STORED\r\n");
+        return;
+    }
 
-    char scmd[BUFSIZ]; // set
-    char gcmd[BUFSIZ]; // get
-    char dcmd[BUFSIZ]; // delete
-    char gres[BUFSIZ]; // get response
+    probe->fd = na_target_server_tcpsock_init();
+    if (probe->fd < 0) {
+        na_hc_round_fail(EV_A_ probe);
+        return;
+    }
+    na_target_server_tcpsock_setup(probe->fd, true);
 
-    useconds_t rt;
+    if (na_server_connect(probe->fd, &probe->server->addr)) {
+        na_hc_send(EV_A_ probe, NA_HC_STATE_SET, probe->hc->scmd, "STORED\r\n");
+        return;
+    }
+    if (errno != EINPROGRESS) {
+        na_hc_round_fail(EV_A_ probe);
+        return;
+    }
 
-    cnt_fail = 0;
-    gethostname(hostname, BUFSIZ);
-    snprintf(scmd, BUFSIZ, "set %s_%s 0 0 %ld\r\n%s_%s\r\n", na_hc_test_key, hostname, strlen(na_hc_test_val) + 1 + strlen(hostname), na_hc_test_val, hostname);
-    snprintf(gcmd, BUFSIZ, "get %s_%s\r\n", na_hc_test_key, hostname);
-    snprintf(dcmd, BUFSIZ, "delete %s_%s\r\n", na_hc_test_key, hostname);
-    snprintf(gres, BUFSIZ, "VALUE %s_%s 0 %ld\r\n%s_%s\r\nEND\r\n", na_hc_test_key, hostname, strlen(na_hc_test_val) + 1 + strlen(hostname), na_hc_test_val, hostname);
+    probe->state = NA_HC_STATE_CONNECTING;
+    ev_io_set(&probe->watcher, probe->fd, EV_WRITE);
+    ev_io_start(EV_A_ &probe->watcher);
+    ev_timer_set(&probe->timer, probe->hc->timeout, 0.);
+    ev_timer_start(EV_A_ &probe->timer);
+}
 
-    rt = 0;
+/**
+ * write cmd and wait for expected in timeout
+ */
+static void na_hc_send (EV_P_ na_hc_probe_t *probe, na_hc_state_t state, const char *cmd, const char *expected)
+{
+    probe->state    = state;
+    probe->wbuf     = cmd;
+    probe->wbufsize = strlen(cmd);
+    probe->wbufoff  = 0;
+    probe->expected = expected;
+    probe->rbufsize = 0;
+
+    ev_io_stop(EV_A_ &probe->watcher);
+    ev_io_set(&probe->watcher, probe->fd, EV_WRITE);
+    ev_io_start(EV_A_ &probe->watcher);
+    ev_timer_stop(EV_A_ &probe->timer);
+    ev_timer_set(&probe->timer, probe->hc->timeout, 0.);
+    ev_timer_start(EV_A_ &probe->timer);
+}
+
+static void na_hc_probe_callback (EV_P_ ev_io *w, int revents)
+{
+    na_hc_probe_t *probe;
+    na_hc_t *hc;
+    socklen_t len;
+    ssize_t size;
+    size_t elen;
+    int err;
 
-    for (int i=0;i<try_max;++i) {
+    probe = (na_hc_probe_t *)w->data;
+    hc    = probe->hc;
 
-        if (!is_success_command(tsfd, scmd, "STORED\r\n")) {
-            ++cnt_fail;
+    if (probe->state == NA_HC_STATE_CONNECTING) {
+        len = sizeof(err);
+        if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            na_hc_round_fail(EV_A_ probe);
+            return;
         }
+        na_hc_send(EV_A_ probe, NA_HC_STATE_SET, hc->scmd, "STORED\r\n");
+        return;
+    }
 
-        if (!is_success_command(tsfd, gcmd, gres)){
-            ++cnt_fail;
+    if (revents & EV_WRITE) {
+        size = write(probe->fd, probe->wbuf + probe->wbufoff, probe->wbufsize - probe->wbufoff);
+        if (size < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return;
+            }
+            na_hc_round_fail(EV_A_ probe);
+            return;
+        }
+        probe->wbufoff += size;
+        if (probe->wbufoff == probe->wbufsize) {
+            ev_io_stop(EV_A_ w);
+            ev_io_set(w, probe->fd, EV_READ);
+            ev_io_start(EV_A_ w);
         }
+        return;
+    }
 
-        if (!is_success_command(tsfd, dcmd, "DELETED\r\n")) {
-            ++cnt_fail;
+    size = read(probe->fd, probe->rbuf + probe->rbufsize, NA_HC_BUF_MAX - probe->rbufsize);
+    if (size < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
         }
+        na_hc_round_fail(EV_A_ probe);
+        return;
+    } else if (size == 0) {
+        na_hc_round_fail(EV_A_ probe);
+        return;
+    }
+    probe->rbufsize += size;
+
+    elen = strlen(probe->expected);
+    if (probe->rbufsize > elen || memcmp(probe->rbuf, probe->expected, probe->rbufsize) != 0) {
+        na_hc_round_fail(EV_A_ probe);
+        return;
+    }
+    if (probe->rbufsize < elen) {
+        return;
+    }
+
+    switch (probe->state) {
+    case NA_HC_STATE_SET:
+        na_hc_send(EV_A_ probe, NA_HC_STATE_GET, hc->gcmd, hc->gres);
+        break;
+    case NA_HC_STATE_GET:
+        na_hc_send(EV_A_ probe, NA_HC_STATE_DELETE, hc->dcmd, "DELETED\r\n");
+        break;
+    case NA_HC_STATE_DELETE:
+        probe->latency = ev_time() - probe->start;
+        na_hc_probe_done(EV_A_ probe, true);
+        break;
+    default:
+        // no through
+        break;
+    }
+}
+
+static void na_hc_probe_timer_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_hc_probe_t *probe;
+
+    probe = (na_hc_probe_t *)w->data;
+
+    if (probe->state == NA_HC_STATE_RETRY) {
+        na_hc_round_begin(EV_A_ probe);
+    } else {
+        // timeout
+        na_hc_round_fail(EV_A_ probe);
+    }
+}
+
+/**
+ * the connection is dropped because responses to the round may still come.
+ * another round is tried after a while, 200-290 msec
+ */
+static void na_hc_round_fail (EV_P_ na_hc_probe_t *probe)
+{
+    ev_io_stop(EV_A_ &probe->watcher);
+    ev_timer_stop(EV_A_ &probe->timer);
+    if (probe->fd >= 0) {
+        close(probe->fd);
+        probe->fd = -1;
+    }
+
+    if (++probe->try_cnt >= probe->hc->env->try_max) {
+        na_hc_probe_done(EV_A_ probe, false);
+        return;
+    }
+
+    probe->state = NA_HC_STATE_RETRY;
+    ev_timer_set(&probe->timer, 0.2 + 0.01 * (rand() % 10), 0.);
+    ev_timer_start(EV_A_ &probe->timer);
+}
+
+static void na_hc_probe_done (EV_P_ na_hc_probe_t *probe, bool is_healthy)
+{
+    na_hc_t *hc;
 
-        rt = 200000 + (10000 * (rand() % 10));
-        usleep(rt);
+    hc = probe->hc;
+
+    ev_io_stop(EV_A_ &probe->watcher);
+    ev_timer_stop(EV_A_ &probe->timer);
+    probe->state      = NA_HC_STATE_IDLE;
+    probe->is_healthy = is_healthy;
+    probe->fail_cnt   = is_healthy ? 0 : probe->fail_cnt + 1;
+    ++probe->check_cnt;
+
+    if (--hc->pending > 0) {
+        return;
     }
 
-    if (cnt_fail == (try_max * 3)) {
+    na_hc_judge(hc);
+
+    ev_timer_set(&hc->watcher, NA_HC_INTERVAL, 0.);
+    ev_timer_start(EV_A_ &hc->watcher);
+}
+
+static void na_hc_switch (na_env_t *env, int tier)
+{
+    int from;
+
+    // workers see the new generation only after the tier and the pools are switched
+    from = env->active_tier;
+    __atomic_store_n(&env->active_tier, tier, __ATOMIC_RELEASE);
+    na_connpool_switch(env, from);
+    __atomic_add_fetch(&env->failover_gen, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * whether the i-th server passed the last check and gets keys, or all of its keys with is_full
+ */
+static bool na_hc_is_up (na_hc_t *hc, int i, bool is_full)
+{
+    int admit;
+
+    if (!hc->probes[i].is_healthy) {
         return false;
     }
+    if (hc->env->healths == NULL) {
+        return true;
+    }
+    admit = na_health_admit(&hc->env->healths[i]);
 
-    return true;
+    return is_full ? admit == NA_HEALTH_ADMIT_FULL : admit > 0;
 }
 
-void na_hc_callback (EV_P_ ev_timer *w, int revents)
+/**
+ * whether the tier gets keys. with ejection, keys of the servers down go to the others
+ * of the tier, so one server up is enough. with is_full, every server is readmitted fully
+ */
+static bool na_hc_tier_is_up (na_hc_t *hc, int tier, bool is_full)
+{
+    na_tier_t *t;
+    int up_cnt;
+
+    t      = &hc->env->tiers[tier];
+    up_cnt = 0;
+    for (int i=t->first;i<t->first + t->cnt;++i) {
+        if (na_hc_is_up(hc, i, is_full)) {
+            ++up_cnt;
+        }
+    }
+    if (is_full || hc->env->healths == NULL) {
+        return up_cnt == t->cnt;
+    }
+
+    return up_cnt > 0;
+}
+
+/**
+ * switch to the first tier which is up. a tier before the active one is switched back to
+ * only when it is up fully, but a tier of one server is switched back to as soon as it is
+ * readmitted, since keys it is not readmitted for yet go on to the next tier.
+ * if none is up, the active one is kept
+ */
+static void na_hc_failover (na_hc_t *hc)
 {
     na_env_t *env;
+    na_server_t *server;
+    char buf[NA_HOSTNAME_MAX + 64];
+    int tier;
 
-    env = (na_env_t *)w->data;
+    env = hc->env;
+    if (env->tier_cnt < 2) {
+        return;
+    }
 
-    if (env->is_refused_active) {
-        env->tsfd = na_target_server_tcpsock_init();
-        if (env->tsfd < 0) {
-            NA_DIE_WITH_ERROR(env, NA_ERROR_INVALID_FD);
+    for (tier=0;tier<env->tier_cnt;++tier) {
+        if (na_hc_tier_is_up(hc, tier, tier < env->active_tier && env->tiers[tier].cnt > 1)) {
+            break;
         }
-        na_target_server_hcsock_setup(env->tsfd);
-        if (!na_server_connect(env->tsfd, &env->target_server.addr)) {
-            close(env->tsfd);
-            na_hc_event_set(EV_A_ w, revents);
-            return;
-        } 
-    }
-
-    // health check
-    if (env->is_refused_active && na_hc_test_request(env->tsfd, env->try_max)) {
-        pthread_rwlock_wrlock(&env->lock_refused);
-        env->is_refused_accept = true;
-        env->is_refused_active = false;
-        pthread_mutex_lock(&env->lock_connpool);
-        na_connpool_switch(env);
-        pthread_mutex_unlock(&env->lock_connpool);
-        pthread_mutex_lock(&env->lock_current_conn);
-        env->current_conn = 0;
-        pthread_mutex_unlock(&env->lock_current_conn);
-        env->is_refused_accept = false;
-        pthread_rwlock_unlock(&env->lock_refused);
+    }
+    if (tier == env->tier_cnt || tier == env->active_tier) {
+        return;
+    }
+
+    na_hc_switch(env, tier);
+    if (tier == 0) {
         NA_ERROR_OUTPUT(env, "switch target server");
-    } else if (!env->is_refused_active && !na_hc_test_request(env->tsfd, env->try_max)) {
-        pthread_rwlock_wrlock(&env->lock_refused);
-        env->is_refused_accept = true;
-        env->is_refused_active = true;
-        pthread_mutex_lock(&env->lock_connpool);
-        na_connpool_switch(env);
-        pthread_mutex_unlock(&env->lock_connpool);
-        pthread_mutex_lock(&env->lock_current_conn);
-        env->current_conn = 0;
-        pthread_mutex_unlock(&env->lock_current_conn);
-        env->is_refused_accept = false;
-        pthread_rwlock_unlock(&env->lock_refused);
-        NA_ERROR_OUTPUT(env, "switch backup server");
-        close(env->tsfd);
-    }
-
-    na_hc_event_set(EV_A_ w, revents);
+    } else {
+        server = na_env_server(env, env->tiers[tier].first);
+        snprintf(buf, sizeof(buf), "switch backup server %s:%d (priority %d)",
+                 server->host.ipaddr, server->host.port, server->priority);
+        NA_ERROR_OUTPUT(env, buf);
+    }
+}
+
+/**
+ * a server ejected gets more of its keys each time it passes a check fast enough,
+ * and is ejected again when it fails one on the way
+ */
+static void na_hc_judge (na_hc_t *hc)
+{
+    na_env_t *env;
+    na_hc_probe_t *probe;
+    na_health_t *health;
+
+    env = hc->env;
+    for (int i=0;env->healths != NULL && i<hc->probe_cnt;++i) {
+        probe  = &hc->probes[i];
+        health = &env->healths[i];
+        if (na_health_admit(health) == NA_HEALTH_ADMIT_FULL) {
+            continue;
+        }
+        if (probe->is_healthy && (env->eject_latency_msec == 0 || probe->latency * 1000 < env->eject_latency_msec)) {
+            na_health_readmit(health, env->readmit_steps);
+        } else if (na_health_admit(health) > 0) {
+            na_health_eject(health);
+        }
+    }
+
+    na_hc_failover(hc);
+}
+
+static bool na_hc_is_outlier (na_env_t *env, na_health_t *health)
+{
+    if (env->eject_error_rate > 0 && health->error_rate > env->eject_error_rate) {
+        return true;
+    }
+    if (env->eject_latency_msec > 0 && health->latency * 1000 > env->eject_latency_msec) {
+        return true;
+    }
+    return false;
+}
+
+/**
+ * eject servers whose error rate or latency from live traffic is over the threshold.
+ * the last server getting keys in the last tier is never ejected, as there is nowhere to fail over to
+ */
+static void na_hc_eject_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_hc_t *hc;
+    na_env_t *env;
+    na_tier_t *tier;
+    na_health_t *health;
+    char buf[NA_HOSTNAME_MAX + 32];
+    int admitted;
+
+    hc  = (na_hc_t *)w->data;
+    env = hc->env;
+
+    for (int t=0;t<env->tier_cnt;++t) {
+        tier     = &env->tiers[t];
+        admitted = 0;
+        for (int i=tier->first;i<tier->first + tier->cnt;++i) {
+            if (na_health_admit(&env->healths[i]) > 0) {
+                ++admitted;
+            }
+        }
+
+        for (int i=tier->first;i<tier->first + tier->cnt;++i) {
+            health = &env->healths[i];
+            if (!na_health_evaluate(health, env->eject_min_requests) || na_health_admit(health) == 0) {
+                continue;
+            }
+            if (!na_hc_is_outlier(env, health)) {
+                continue;
+            }
+            if (t == env->tier_cnt - 1 && admitted < 2) {
+                continue;
+            }
+            na_health_eject(health);
+            --admitted;
+            snprintf(buf, sizeof(buf), "eject server %s:%d", hc->probes[i].server->host.ipaddr, hc->probes[i].server->host.port);
+            NA_ERROR_OUTPUT(env, buf);
+        }
+    }
+
+    na_hc_failover(hc);
 }
@@ -0,0 +1,120 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+
+#include "defines.h"
+
+/**
+ * health of servers from live traffic. workers count requests, errors and
+ * latency of each server, and the support loop folds what they counted since
+ * the last time into EWMAs of error rate and latency.
+ */
+
+static const double NA_HEALTH_EWMA_ALPHA = 0.3;
+
+na_health_t *na_health_create (int cnt)
+{
+    na_health_t *healths;
+
+    healths = (na_health_t *)calloc(sizeof(na_health_t), cnt);
+    if (healths == NULL) {
+        return NULL;
+    }
+    for (int i=0;i<cnt;++i) {
+        healths[i].admit = NA_HEALTH_ADMIT_FULL;
+    }
+
+    return healths;
+}
+
+/**
+ * count a request answered, or failed with is_error, in latency seconds
+ */
+void na_health_count (na_health_t *health, bool is_error, double latency)
+{
+    __sync_add_and_fetch(&health->req_cnt, 1);
+    if (is_error) {
+        __sync_add_and_fetch(&health->err_cnt, 1);
+    }
+    if (latency > 0) {
+        __sync_add_and_fetch(&health->latency_usec, (uint64_t)(latency * 1000000));
+    }
+}
+
+/**
+ * fold the counts since the last call into the EWMAs. they are left as they are
+ * unless min_requests(at least 1) or more requests are counted, and false is returned
+ */
+bool na_health_evaluate (na_health_t *health, int min_requests)
+{
+    uint64_t req_cnt, err_cnt, latency_usec;
+    double n;
+
+    req_cnt      = __sync_add_and_fetch(&health->req_cnt, 0);
+    err_cnt      = __sync_add_and_fetch(&health->err_cnt, 0);
+    latency_usec = __sync_add_and_fetch(&health->latency_usec, 0);
+
+    if (req_cnt - health->last_req_cnt < (uint64_t)min_requests) {
+        return false;
+    }
+
+    n = req_cnt - health->last_req_cnt;
+    health->error_rate += NA_HEALTH_EWMA_ALPHA * ((err_cnt - health->last_err_cnt) / n - health->error_rate);
+    health->latency    += NA_HEALTH_EWMA_ALPHA * ((latency_usec - health->last_latency_usec) / n / 1000000 - health->latency);
+
+    health->last_req_cnt      = req_cnt;
+    health->last_err_cnt      = err_cnt;
+    health->last_latency_usec = latency_usec;
+
+    return true;
+}
+
+/**
+ * stop sending keys to the server. its EWMAs start again when it is readmitted
+ */
+void na_health_eject (na_health_t *health)
+{
+    __sync_lock_test_and_set(&health->admit, 0);
+    health->error_rate = 0;
+    health->latency    = 0;
+    ++health->eject_cnt;
+}
+
+/**
+ * share of its keys the server gets, from 0(ejected) to NA_HEALTH_ADMIT_FULL
+ */
+int na_health_admit (na_health_t *health)
+{
+    return *(volatile int *)&health->admit;
+}
+
+/**
+ * give the server a larger share of its keys after a probe passed, step by step
+ */
+void na_health_readmit (na_health_t *health, int steps)
+{
+    int admit;
+
+    admit = na_health_admit(health) + (NA_HEALTH_ADMIT_FULL + steps - 1) / steps;
+    __sync_lock_test_and_set(&health->admit, admit < NA_HEALTH_ADMIT_FULL ? admit : NA_HEALTH_ADMIT_FULL);
+}
+
+/**
+ * the first server which gets keys at all, for commands without key
+ */
+int na_health_first (na_health_t *healths, int cnt)
+{
+    for (int i=0;i<cnt;++i) {
+        if (na_health_admit(&healths[i]) > 0) {
+            return i;
+        }
+    }
+
+    return 0;
+}
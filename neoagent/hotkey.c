@@ -0,0 +1,343 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "defines.h"
+
+/**
+ * the most requested keys of a worker by the Space-Saving algorithm.
+ * a key which is not counted takes over the slot with the fewest requests,
+ * and its count starts from that one(error), so counts are never under.
+ * only the worker writes its slots, and the stat thread reads each slot
+ * between two reads of seq, which is odd while the slot is written.
+ * slots are found by the hash table, and the one with the fewest requests
+ * is the head of the first bucket(Stream-Summary), so a request is counted in O(1).
+ */
+
+// private functions
+static uint32_t na_hotkey_hash (const char *key, int len);
+static void na_hotkey_reset (na_hotkey_t *hotkey, double now);
+static int na_hotkey_find (na_hotkey_t *hotkey, const char *key, int len, uint32_t hash);
+static void na_hotkey_unindex (na_hotkey_t *hotkey, int i);
+static int na_hotkey_bucket_take (na_hotkey_t *hotkey, int i);
+static void na_hotkey_bucket_put (na_hotkey_t *hotkey, int i, uint64_t count, int prev);
+static inline void na_hotkey_write_begin (na_hotkey_slot_t *slot);
+static inline void na_hotkey_write_end (na_hotkey_slot_t *slot);
+
+static uint32_t na_hotkey_hash (const char *key, int len)
+{
+    uint32_t hash;
+
+    hash = FNV_OFFSET_BASIS;
+    for (int i=0;i<len;++i) {
+        hash ^= (uint8_t)key[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static inline void na_hotkey_write_begin (na_hotkey_slot_t *slot)
+{
+    ++slot->seq;
+    __sync_synchronize();
+}
+
+static inline void na_hotkey_write_end (na_hotkey_slot_t *slot)
+{
+    __sync_synchronize();
+    ++slot->seq;
+}
+
+static int na_hotkey_find (na_hotkey_t *hotkey, const char *key, int len, uint32_t hash)
+{
+    na_hotkey_slot_t *slot;
+
+    for (int i=hotkey->table[hash & hotkey->table_mask];i!=-1;i=hotkey->nodes[i].hnext) {
+        slot = &hotkey->slots[i];
+        if (slot->hash == hash && slot->key_len == len && memcmp(slot->key, key, len) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void na_hotkey_unindex (na_hotkey_t *hotkey, int i)
+{
+    int *link;
+
+    link = &hotkey->table[hotkey->slots[i].hash & hotkey->table_mask];
+    while (*link != i) {
+        link = &hotkey->nodes[*link].hnext;
+    }
+    *link = hotkey->nodes[i].hnext;
+}
+
+/**
+ * take slot i out of its bucket, which is freed if it gets empty.
+ * the bucket which slot i goes after by its new count is returned
+ */
+static int na_hotkey_bucket_take (na_hotkey_t *hotkey, int i)
+{
+    na_hotkey_node_t *node;
+    na_hotkey_bucket_t *bucket;
+    int b;
+
+    node   = &hotkey->nodes[i];
+    b      = node->bucket;
+    bucket = &hotkey->buckets[b];
+
+    if (node->prev != -1) {
+        hotkey->nodes[node->prev].next = node->next;
+    } else {
+        bucket->head = node->next;
+    }
+    if (node->next != -1) {
+        hotkey->nodes[node->next].prev = node->prev;
+    }
+    if (bucket->head != -1) {
+        return b;
+    }
+
+    if (bucket->prev != -1) {
+        hotkey->buckets[bucket->prev].next = bucket->next;
+    } else {
+        hotkey->bucket_min = bucket->next;
+    }
+    if (bucket->next != -1) {
+        hotkey->buckets[bucket->next].prev = bucket->prev;
+    }
+    b                   = bucket->prev;
+    bucket->next        = hotkey->bucket_free;
+    hotkey->bucket_free = bucket - hotkey->buckets;
+
+    return b;
+}
+
+/**
+ * put slot i into the bucket of count, which comes right after bucket prev(-1 for the first)
+ */
+static void na_hotkey_bucket_put (na_hotkey_t *hotkey, int i, uint64_t count, int prev)
+{
+    na_hotkey_node_t *node;
+    na_hotkey_bucket_t *bucket;
+    int b, next;
+
+    next = prev == -1 ? hotkey->bucket_min : hotkey->buckets[prev].next;
+    if (next != -1 && hotkey->buckets[next].count == count) {
+        b = next;
+    } else {
+        b                   = hotkey->bucket_free;
+        bucket              = &hotkey->buckets[b];
+        hotkey->bucket_free = bucket->next;
+        bucket->count       = count;
+        bucket->head        = -1;
+        bucket->prev        = prev;
+        bucket->next        = next;
+        if (prev != -1) {
+            hotkey->buckets[prev].next = b;
+        } else {
+            hotkey->bucket_min = b;
+        }
+        if (next != -1) {
+            hotkey->buckets[next].prev = b;
+        }
+    }
+
+    bucket       = &hotkey->buckets[b];
+    node         = &hotkey->nodes[i];
+    node->bucket = b;
+    node->prev   = -1;
+    node->next   = bucket->head;
+    if (bucket->head != -1) {
+        hotkey->nodes[bucket->head].prev = i;
+    }
+    bucket->head = i;
+}
+
+/**
+ * start a new window
+ */
+static void na_hotkey_reset (na_hotkey_t *hotkey, double now)
+{
+    for (int i=0;i<hotkey->slot_cnt;++i) {
+        na_hotkey_write_begin(&hotkey->slots[i]);
+        hotkey->slots[i].count   = 0;
+        hotkey->slots[i].key_len = 0;
+        ++hotkey->slots[i].gen;
+        na_hotkey_write_end(&hotkey->slots[i]);
+    }
+    for (int i=0;i<=hotkey->table_mask;++i) {
+        hotkey->table[i] = -1;
+    }
+    for (int i=0;i<hotkey->slot_max;++i) {
+        hotkey->buckets[i].next = i + 1 < hotkey->slot_max ? i + 1 : -1;
+    }
+    hotkey->bucket_min   = -1;
+    hotkey->bucket_free  = 0;
+    hotkey->slot_cnt     = 0;
+    hotkey->window_start = now;
+}
+
+na_hotkey_t *na_hotkey_create (int slot_max, double window)
+{
+    na_hotkey_t *hotkey;
+    int table_size;
+
+    hotkey = (na_hotkey_t *)malloc(sizeof(na_hotkey_t));
+    if (hotkey == NULL) {
+        return NULL;
+    }
+    // twice as many chains as slots at least
+    table_size = 1;
+    while (table_size < slot_max * 2) {
+        table_size <<= 1;
+    }
+    hotkey->slots      = calloc(sizeof(na_hotkey_slot_t), slot_max);
+    hotkey->nodes      = (na_hotkey_node_t *)malloc(sizeof(na_hotkey_node_t) * slot_max);
+    hotkey->buckets    = (na_hotkey_bucket_t *)malloc(sizeof(na_hotkey_bucket_t) * slot_max);
+    hotkey->table      = (int *)malloc(sizeof(int) * table_size);
+    hotkey->table_mask = table_size - 1;
+    hotkey->slot_max   = slot_max;
+    hotkey->slot_cnt   = 0;
+    hotkey->window     = window;
+    if (hotkey->slots == NULL || hotkey->nodes == NULL || hotkey->buckets == NULL || hotkey->table == NULL) {
+        na_hotkey_destroy(hotkey);
+        return NULL;
+    }
+    na_hotkey_reset(hotkey, 0);
+
+    return hotkey;
+}
+
+void na_hotkey_destroy (na_hotkey_t *hotkey)
+{
+    if (hotkey == NULL) {
+        return;
+    }
+    NA_FREE(hotkey->slots);
+    NA_FREE(hotkey->nodes);
+    NA_FREE(hotkey->buckets);
+    NA_FREE(hotkey->table);
+    NA_FREE(hotkey);
+}
+
+/**
+ * count a request of key. the slot of key and its generation are returned
+ * to add the size of response to it later.
+ */
+na_hotkey_slot_t *na_hotkey_count (na_hotkey_t *hotkey, const char *key, int len, double now, uint32_t *gen)
+{
+    na_hotkey_slot_t *slot;
+    uint64_t error;
+    uint32_t hash;
+    int i;
+
+    if (hotkey->window_start == 0) {
+        hotkey->window_start = now;
+    } else if (hotkey->window > 0 && now - hotkey->window_start >= hotkey->window) {
+        na_hotkey_reset(hotkey, now);
+    }
+
+    if (len > NA_HOTKEY_KEY_MAX) {
+        len = NA_HOTKEY_KEY_MAX;
+    }
+    hash = na_hotkey_hash(key, len);
+
+    if ((i = na_hotkey_find(hotkey, key, len, hash)) != -1) {
+        slot = &hotkey->slots[i];
+        na_hotkey_bucket_put(hotkey, i, slot->count + 1, na_hotkey_bucket_take(hotkey, i));
+        na_hotkey_write_begin(slot);
+        ++slot->count;
+        na_hotkey_write_end(slot);
+        *gen = slot->gen;
+        return slot;
+    }
+
+    if (hotkey->slot_cnt < hotkey->slot_max) {
+        i     = hotkey->slot_cnt++;
+        error = 0;
+        na_hotkey_bucket_put(hotkey, i, 1, -1);
+    } else {
+        i     = hotkey->buckets[hotkey->bucket_min].head;
+        error = hotkey->slots[i].count;
+        na_hotkey_unindex(hotkey, i);
+        na_hotkey_bucket_put(hotkey, i, error + 1, na_hotkey_bucket_take(hotkey, i));
+    }
+    hotkey->nodes[i].hnext                   = hotkey->table[hash & hotkey->table_mask];
+    hotkey->table[hash & hotkey->table_mask] = i;
+
+    slot = &hotkey->slots[i];
+    na_hotkey_write_begin(slot);
+    memcpy(slot->key, key, len);
+    slot->key[len] = '\0';
+    slot->key_len  = len;
+    slot->hash     = hash;
+    slot->count    = error + 1;
+    slot->error    = error;
+    slot->bytes    = 0;
+    ++slot->gen;
+    na_hotkey_write_end(slot);
+    *gen = slot->gen;
+
+    return slot;
+}
+
+/**
+ * add the size of response to the key which still has the slot
+ */
+void na_hotkey_add_bytes (na_hotkey_slot_t *slot, uint32_t gen, int size)
+{
+    if (slot->gen != gen) {
+        return;
+    }
+    na_hotkey_write_begin(slot);
+    slot->bytes += size;
+    na_hotkey_write_end(slot);
+}
+
+/**
+ * copy slots in use into snapshot, which has slot_max ones. slots being written
+ * are read again, and skipped if they keep changing. the number copied is returned
+ */
+int na_hotkey_snapshot (na_hotkey_t *hotkey, na_hotkey_slot_t *snapshot, double now)
+{
+    na_hotkey_slot_t *slot;
+    uint32_t seq;
+    int n;
+
+    // the window is over though the worker has had no request to reset it
+    if (hotkey->window > 0 && now - hotkey->window_start >= hotkey->window) {
+        return 0;
+    }
+
+    n = 0;
+    for (int i=0;i<hotkey->slot_max;++i) {
+        slot = &hotkey->slots[i];
+        for (int try=0;try<3;++try) {
+            seq = *(volatile uint32_t *)&slot->seq;
+            if (seq % 2 == 1) {
+                continue;
+            }
+            __sync_synchronize();
+            memcpy(&snapshot[n], slot, sizeof(na_hotkey_slot_t));
+            __sync_synchronize();
+            if (*(volatile uint32_t *)&slot->seq == seq) {
+                if (snapshot[n].key_len > 0 && snapshot[n].count > 0) {
+                    ++n;
+                }
+                break;
+            }
+        }
+    }
+
+    return n;
+}
@@ -0,0 +1,162 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "defines.h"
+#include "ext/md5.h"
+
+/**
+ * consistent hashing compatible with libketama.
+ * each server gets points on the continuum in proportion to its weight,
+ * 4 points from each MD5 digest of "<host>:<port>-<n>", and a key goes to
+ * the first point at or after the hash of it.
+ */
+
+static const int NA_KETAMA_HASHES_PER_SERVER = 40;
+
+// private functions
+static int na_ketama_point_cmp (const void *a, const void *b);
+static uint32_t na_ketama_hash (uint8_t *digest, int n);
+
+static int na_ketama_point_cmp (const void *a, const void *b)
+{
+    const na_ketama_point_t *x = a;
+    const na_ketama_point_t *y = b;
+
+    if (x->hash != y->hash) {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->server - y->server;
+}
+
+static uint32_t na_ketama_hash (uint8_t *digest, int n)
+{
+    return (uint32_t)digest[3 + n * 4] << 24 |
+           (uint32_t)digest[2 + n * 4] << 16 |
+           (uint32_t)digest[1 + n * 4] << 8  |
+           (uint32_t)digest[n * 4];
+}
+
+/**
+ * servers of weight 0 have no points, so a rebuild after membership
+ * changes moves only the keys of servers which joined or left.
+ */
+na_ketama_t *na_ketama_create (na_server_t *servers, int server_cnt)
+{
+    na_ketama_t *ketama;
+    uint8_t digest[MD5_DIGEST_SIZE];
+    char buf[NA_HOSTNAME_MAX + 32];
+    int total_weight, member_cnt, hash_cnt, len, n;
+
+    total_weight = 0;
+    member_cnt   = 0;
+    for (int i=0;i<server_cnt;++i) {
+        if (servers[i].weight > 0) {
+            total_weight += servers[i].weight;
+            ++member_cnt;
+        }
+    }
+
+    ketama = (na_ketama_t *)malloc(sizeof(na_ketama_t));
+    if (ketama == NULL) {
+        return NULL;
+    }
+    ketama->points    = (na_ketama_point_t *)malloc(sizeof(na_ketama_point_t) * (NA_KETAMA_HASHES_PER_SERVER * 4 * server_cnt + 1));
+    ketama->point_cnt = 0;
+    if (ketama->points == NULL) {
+        NA_FREE(ketama);
+        return NULL;
+    }
+
+    n = 0;
+    for (int i=0;i<server_cnt;++i) {
+        if (servers[i].weight <= 0) {
+            continue;
+        }
+        hash_cnt = (int)((long long)servers[i].weight * NA_KETAMA_HASHES_PER_SERVER * member_cnt / total_weight);
+        for (int j=0;j<hash_cnt;++j) {
+            len = snprintf(buf, sizeof(buf), "%s:%d-%d", servers[i].host.ipaddr, servers[i].host.port, j);
+            md5_digest(buf, len, digest);
+            for (int k=0;k<4;++k) {
+                ketama->points[n].hash   = na_ketama_hash(digest, k);
+                ketama->points[n].server = i;
+                ++n;
+            }
+        }
+    }
+    ketama->point_cnt = n;
+    qsort(ketama->points, n, sizeof(na_ketama_point_t), na_ketama_point_cmp);
+
+    return ketama;
+}
+
+void na_ketama_destroy (na_ketama_t *ketama)
+{
+    if (ketama == NULL) {
+        return;
+    }
+    NA_FREE(ketama->points);
+    NA_FREE(ketama);
+}
+
+/**
+ * hash of key on the continuum, which also decides whether a server being readmitted gets it
+ */
+uint32_t na_ketama_key_hash (const char *key, int len)
+{
+    uint8_t digest[MD5_DIGEST_SIZE];
+
+    md5_digest(key, len, digest);
+    return na_ketama_hash(digest, 0);
+}
+
+/**
+ * index of server for key, or -1 if there is no server.
+ * with healths, a key whose server doesn't admit it goes on along the continuum,
+ * so keys of a server being readmitted come back in order of their hash
+ */
+int na_ketama_lookup (na_ketama_t *ketama, const char *key, int len, na_health_t *healths)
+{
+    uint32_t hash;
+    int lo, hi, mid, server;
+
+    if (ketama->point_cnt == 0) {
+        return -1;
+    }
+
+    hash = na_ketama_key_hash(key, len);
+
+    lo = 0;
+    hi = ketama->point_cnt;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ketama->points[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // the continuum is a ring
+    if (lo == ketama->point_cnt) {
+        lo = 0;
+    }
+    if (healths == NULL) {
+        return ketama->points[lo].server;
+    }
+    for (int i=0;i<ketama->point_cnt;++i) {
+        server = ketama->points[(lo + i) % ketama->point_cnt].server;
+        if (hash % NA_HEALTH_ADMIT_FULL < (uint32_t)na_health_admit(&healths[server])) {
+            return server;
+        }
+    }
+
+    return ketama->points[lo].server;
+}
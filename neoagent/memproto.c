@@ -6,53 +6,686 @@
  *
  */
 
+#include <limits.h>
 #include <string.h>
 
 #include "defines.h"
 
-typedef enum na_memproto_bm_skip_t {
-    NA_MEMPROTO_BM_SKIP_CRLF,
-    NA_MEMPROTO_BM_SKIP_ENDCRLF,
-    NA_MEMPROTO_BM_SKIP_MAX // Always add new codes to the end before this one
-} na_memproto_bm_skip_t;
+static const uint8_t NA_MEMPROTO_BINARY_MAGIC_REQUEST  = 0x80;
+static const uint8_t NA_MEMPROTO_BINARY_MAGIC_RESPONSE = 0x81;
+static const uint8_t NA_MEMPROTO_BINARY_OPCODE_QUIT    = 0x07;
+static const uint8_t NA_MEMPROTO_BINARY_OPCODE_NOOP    = 0x0a;
+static const uint8_t NA_MEMPROTO_BINARY_OPCODE_STAT    = 0x10;
+static const uint8_t NA_MEMPROTO_BINARY_OPCODE_QUITQ   = 0x17;
 
-static int na_bm_skip[NA_MEMPROTO_BM_SKIP_MAX][NA_BM_SKIP_SIZE] = {
-    [NA_MEMPROTO_BM_SKIP_CRLF]    = {},
-    [NA_MEMPROTO_BM_SKIP_ENDCRLF] = {},
+typedef struct na_memproto_cmd_entry_t {
+    const char *name;
+    na_memproto_cmd_t cmd;
+} na_memproto_cmd_entry_t;
+
+static const na_memproto_cmd_entry_t na_memproto_cmds[] = {
+    { "get",     NA_MEMPROTO_CMD_GET     },
+    { "gets",    NA_MEMPROTO_CMD_GETS    },
+    { "set",     NA_MEMPROTO_CMD_SET     },
+    { "add",     NA_MEMPROTO_CMD_ADD     },
+    { "replace", NA_MEMPROTO_CMD_REPLACE },
+    { "append",  NA_MEMPROTO_CMD_APPEND  },
+    { "prepend", NA_MEMPROTO_CMD_PREPEND },
+    { "cas",     NA_MEMPROTO_CMD_CAS     },
+    { "incr",    NA_MEMPROTO_CMD_INCR    },
+    { "decr",    NA_MEMPROTO_CMD_DECR    },
+    { "delete",  NA_MEMPROTO_CMD_DELETE  },
+    { "touch",   NA_MEMPROTO_CMD_TOUCH   },
+    { "quit",    NA_MEMPROTO_CMD_QUIT    },
+    { "mg",      NA_MEMPROTO_CMD_MG      },
+    { "ms",      NA_MEMPROTO_CMD_MS      },
+    { "md",      NA_MEMPROTO_CMD_MD      },
+    { "ma",      NA_MEMPROTO_CMD_MA      },
+    { "mn",      NA_MEMPROTO_CMD_MN      },
 };
 
-void na_memproto_bm_skip_init (void)
+// private functions
+static inline bool na_memproto_is_storage (na_memproto_cmd_t cmd);
+static inline bool na_memproto_is_retrieval (na_memproto_cmd_t cmd);
+static inline bool na_memproto_is_meta (na_memproto_cmd_t cmd);
+static char *na_memproto_token (char *p, char *end, int *len);
+static na_memproto_cmd_t na_memproto_lookup_command (char *name, int len);
+static char *na_memproto_nth_token (char *p, char *end, int n, int *len);
+static int na_memproto_bytes (char *tok, int len);
+static bool na_memproto_is_noreply (char *p, char *end);
+static na_memproto_parse_result_t na_memproto_parse_meta_request_line (na_memproto_parser_t *parser, char *p, char *end);
+static na_memproto_parse_result_t na_memproto_parse_meta_response_line (na_memproto_parser_t *parser, char *line, char *end);
+static na_memproto_parse_result_t na_memproto_parse_request_line (na_memproto_parser_t *parser, char *line, char *end);
+static na_memproto_parse_result_t na_memproto_parse_response_line (na_memproto_parser_t *parser, char *line, char *end);
+static na_memproto_parse_result_t na_memproto_parse (na_memproto_parser_t *parser, char *buf, int bufsize, bool is_response);
+static na_memproto_parse_result_t na_memproto_parse_binary (na_memproto_parser_t *parser, char *buf, int bufsize, bool is_response);
+static bool na_memproto_binary_is_quiet (uint8_t opcode);
+static bool na_memproto_binary_is_write (uint8_t opcode);
+
+static inline bool na_memproto_is_storage (na_memproto_cmd_t cmd)
+{
+    return cmd == NA_MEMPROTO_CMD_SET     ||
+           cmd == NA_MEMPROTO_CMD_ADD     ||
+           cmd == NA_MEMPROTO_CMD_REPLACE ||
+           cmd == NA_MEMPROTO_CMD_APPEND  ||
+           cmd == NA_MEMPROTO_CMD_PREPEND ||
+           cmd == NA_MEMPROTO_CMD_CAS;
+}
+
+static inline bool na_memproto_is_retrieval (na_memproto_cmd_t cmd)
+{
+    return cmd == NA_MEMPROTO_CMD_GET || cmd == NA_MEMPROTO_CMD_GETS;
+}
+
+static inline bool na_memproto_is_meta (na_memproto_cmd_t cmd)
+{
+    return cmd == NA_MEMPROTO_CMD_MG ||
+           cmd == NA_MEMPROTO_CMD_MS ||
+           cmd == NA_MEMPROTO_CMD_MD ||
+           cmd == NA_MEMPROTO_CMD_MA ||
+           cmd == NA_MEMPROTO_CMD_MN;
+}
+
+/**
+ * skip spaces and return the next token in [p, end), or NULL if there is no more
+ */
+static char *na_memproto_token (char *p, char *end, int *len)
 {
-    na_bm_create_table("\r\n",    na_bm_skip[NA_MEMPROTO_BM_SKIP_CRLF],    NA_BM_SKIP_SIZE);
-    na_bm_create_table("END\r\n", na_bm_skip[NA_MEMPROTO_BM_SKIP_ENDCRLF], NA_BM_SKIP_SIZE);
+    char *t;
+
+    while (p < end && *p == ' ') {
+        ++p;
+    }
+    if (p == end) {
+        return NULL;
+    }
+    for (t = p;t < end && *t != ' ';++t) {}
+    *len = t - p;
+
+    return p;
 }
 
-na_memproto_cmd_t na_memproto_detect_command (char *buf)
+static na_memproto_cmd_t na_memproto_lookup_command (char *name, int len)
 {
-    if (strncmp(buf, "get", 3) == 0) {
-        return NA_MEMPROTO_CMD_GET;
-    } else if (strncmp(buf, "set", 3) == 0) {
-        return NA_MEMPROTO_CMD_SET;
-    } else if (strncmp(buf, "incr", 4) == 0) {
-        return NA_MEMPROTO_CMD_INCR;
-    } else if (strncmp(buf, "decr", 4) == 0) {
-        return NA_MEMPROTO_CMD_DECR;
-    } else if (strncmp(buf, "add", 3) == 0) {
-        return NA_MEMPROTO_CMD_ADD;
-    } else if (strncmp(buf, "delete", 6) == 0) {
-        return NA_MEMPROTO_CMD_DELETE;
-    } else if (strncmp(buf, "quit", 4) == 0) {
-        return NA_MEMPROTO_CMD_QUIT;
+    for (size_t i=0;i<sizeof(na_memproto_cmds) / sizeof(na_memproto_cmds[0]);++i) {
+        if (strlen(na_memproto_cmds[i].name) == (size_t)len &&
+            memcmp(na_memproto_cmds[i].name, name, len) == 0)
+        {
+            return na_memproto_cmds[i].cmd;
+        }
     }
     return NA_MEMPROTO_CMD_UNKNOWN;
 }
 
-int na_memproto_count_request_get (char *buf, int bufsize)
+/**
+ * the n-th token(0 origin) after p, or NULL if there is not
+ */
+static char *na_memproto_nth_token (char *p, char *end, int n, int *len)
+{
+    char *tok;
+
+    for (int i=0;i<=n;++i) {
+        if ((tok = na_memproto_token(p, end, len)) == NULL) {
+            return NULL;
+        }
+        p = tok + *len;
+    }
+
+    return tok;
+}
+
+/**
+ * size of data block in a token, or -1 if it is not a valid one
+ */
+static int na_memproto_bytes (char *tok, int len)
+{
+    int bytes;
+
+    bytes = 0;
+    for (int i=0;i<len;++i) {
+        if (tok[i] < '0' || tok[i] > '9' || bytes > (INT_MAX - 2 - 9) / 10) {
+            return -1;
+        }
+        bytes = bytes * 10 + (tok[i] - '0');
+    }
+
+    return bytes;
+}
+
+/**
+ * whether the last token in [p, end) is noreply
+ */
+static bool na_memproto_is_noreply (char *p, char *end)
+{
+    char *tok, *last;
+    int len, last_len;
+
+    last     = NULL;
+    last_len = 0;
+    while ((tok = na_memproto_token(p, end, &len)) != NULL) {
+        last     = tok;
+        last_len = len;
+        p        = tok + len;
+    }
+
+    return last != NULL && last_len == 7 && memcmp(last, "noreply", 7) == 0;
+}
+
+/**
+ * p is just after the command name of a meta command.
+ * flags are single tokens, and the q flag makes the command quiet.
+ */
+static na_memproto_parse_result_t na_memproto_parse_meta_request_line (na_memproto_parser_t *parser, char *p, char *end)
+{
+    char *tok;
+    int len, bytes;
+
+    if (parser->cmd == NA_MEMPROTO_CMD_MN) {
+        return NA_MEMPROTO_PARSE_DONE;
+    }
+
+    // <command name> <key> [<datalen>] <flags>*
+    if ((tok = na_memproto_token(p, end, &len)) == NULL) {
+        return NA_MEMPROTO_PARSE_ERROR;
+    }
+    parser->key_cnt = 1;
+    p               = tok + len;
+
+    bytes = -1;
+    if (parser->cmd == NA_MEMPROTO_CMD_MS) {
+        if ((tok = na_memproto_token(p, end, &len)) == NULL ||
+            (bytes = na_memproto_bytes(tok, len)) < 0)
+        {
+            return NA_MEMPROTO_PARSE_ERROR;
+        }
+        p = tok + len;
+    }
+
+    while ((tok = na_memproto_token(p, end, &len)) != NULL) {
+        if (len == 1 && *tok == 'q') {
+            parser->is_quiet = true;
+        }
+        p = tok + len;
+    }
+
+    if (bytes < 0) {
+        return NA_MEMPROTO_PARSE_DONE;
+    }
+    parser->bytes = bytes + 2;
+    parser->state = NA_MEMPROTO_PARSE_STATE_DATA;
+
+    return NA_MEMPROTO_PARSE_AGAIN;
+}
+
+/**
+ * line is the command line without CRLF
+ */
+static na_memproto_parse_result_t na_memproto_parse_request_line (na_memproto_parser_t *parser, char *line, char *end)
 {
-    return na_bm_search(buf, "\r\n", na_bm_skip[NA_MEMPROTO_BM_SKIP_CRLF], bufsize, 2);
+    char *p, *tok;
+    int len, bytes;
+
+    if ((tok = na_memproto_token(line, end, &len)) == NULL) {
+        return NA_MEMPROTO_PARSE_ERROR;
+    }
+    parser->cmd        = na_memproto_lookup_command(tok, len);
+    parser->key_cnt    = 0;
+    parser->key_len    = 0;
+    parser->is_quiet   = false;
+    parser->is_noreply = false;
+    p                  = tok + len;
+
+    if (parser->cmd == NA_MEMPROTO_CMD_UNKNOWN) {
+        return NA_MEMPROTO_PARSE_ERROR;
+    }
+
+    // every command but quit and mn begins with a key
+    if ((tok = na_memproto_token(p, end, &len)) != NULL) {
+        parser->key     = parser->line + (tok - line);
+        parser->key_len = len;
+    }
+
+    if (na_memproto_is_meta(parser->cmd)) {
+        return na_memproto_parse_meta_request_line(parser, p, end);
+    }
+
+    if (na_memproto_is_retrieval(parser->cmd)) {
+        while ((tok = na_memproto_token(p, end, &len)) != NULL) {
+            ++parser->key_cnt;
+            p = tok + len;
+        }
+        return parser->key_cnt > 0 ? NA_MEMPROTO_PARSE_DONE : NA_MEMPROTO_PARSE_ERROR;
+    }
+
+    if (parser->cmd != NA_MEMPROTO_CMD_QUIT) {
+        parser->is_noreply = na_memproto_is_noreply(p, end);
+    }
+
+    if (!na_memproto_is_storage(parser->cmd)) {
+        return NA_MEMPROTO_PARSE_DONE;
+    }
+
+    // <command name> <key> <flags> <exptime> <bytes>
+    if ((tok = na_memproto_nth_token(p, end, 3, &len)) == NULL ||
+        (bytes = na_memproto_bytes(tok, len)) < 0)
+    {
+        return NA_MEMPROTO_PARSE_ERROR;
+    }
+    parser->key_cnt = 1;
+    parser->bytes   = bytes + 2;
+    parser->state   = NA_MEMPROTO_PARSE_STATE_DATA;
+
+    return NA_MEMPROTO_PARSE_AGAIN;
 }
 
-int na_memproto_count_response_get(char *buf, int bufsize)
+/**
+ * a meta command is answered with a line, and VA is followed by a data block.
+ * for mn, responses to quiet commands before it are framed together up to MN.
+ */
+static na_memproto_parse_result_t na_memproto_parse_meta_response_line (na_memproto_parser_t *parser, char *line, char *end)
 {
-    return na_bm_search(buf, "END\r\n", na_bm_skip[NA_MEMPROTO_BM_SKIP_ENDCRLF], bufsize, 5);
+    char *tok;
+    int len, bytes;
+
+    if (end - line >= 3 && memcmp(line, "VA ", 3) == 0) {
+        // VA <size> <flags>*
+        if ((tok = na_memproto_token(line + 3, end, &len)) == NULL ||
+            (bytes = na_memproto_bytes(tok, len)) < 0)
+        {
+            return NA_MEMPROTO_PARSE_ERROR;
+        }
+        ++parser->key_cnt;
+        parser->bytes = bytes + 2;
+        parser->state = NA_MEMPROTO_PARSE_STATE_DATA;
+        return NA_MEMPROTO_PARSE_AGAIN;
+    }
+
+    if (parser->cmd != NA_MEMPROTO_CMD_MN || (end - line == 2 && memcmp(line, "MN", 2) == 0)) {
+        return NA_MEMPROTO_PARSE_DONE;
+    }
+
+    return NA_MEMPROTO_PARSE_AGAIN;
+}
+
+/**
+ * line is the response line without CRLF
+ */
+static na_memproto_parse_result_t na_memproto_parse_response_line (na_memproto_parser_t *parser, char *line, char *end)
+{
+    char *tok;
+    int len, bytes;
+
+    if (na_memproto_is_meta(parser->cmd)) {
+        return na_memproto_parse_meta_response_line(parser, line, end);
+    }
+
+    // other commands and errors are answered with a line
+    if (!na_memproto_is_retrieval(parser->cmd) || end - line < 6 || memcmp(line, "VALUE ", 6) != 0) {
+        return NA_MEMPROTO_PARSE_DONE;
+    }
+
+    // VALUE <key> <flags> <bytes> [<cas unique>]
+    if ((tok = na_memproto_nth_token(line + 6, end, 2, &len)) == NULL ||
+        (bytes = na_memproto_bytes(tok, len)) < 0)
+    {
+        return NA_MEMPROTO_PARSE_ERROR;
+    }
+    ++parser->key_cnt;
+    parser->bytes = bytes + 2;
+    parser->state = NA_MEMPROTO_PARSE_STATE_DATA;
+
+    return NA_MEMPROTO_PARSE_AGAIN;
+}
+
+static na_memproto_parse_result_t na_memproto_parse (na_memproto_parser_t *parser, char *buf, int bufsize, bool is_response)
+{
+    na_memproto_parse_result_t result;
+    char *nl, *end;
+    int n;
+
+    if (parser->state == NA_MEMPROTO_PARSE_STATE_FRAMED) {
+        parser->state   = NA_MEMPROTO_PARSE_STATE_LINE;
+        parser->start   = parser->off;
+        parser->line    = parser->off;
+        parser->key_cnt = 0;
+    }
+
+    while (parser->off < bufsize) {
+        switch (parser->state) {
+        case NA_MEMPROTO_PARSE_STATE_LINE:
+            if ((nl = na_scan_lf(buf + parser->off, bufsize - parser->off)) == NULL) {
+                parser->off = bufsize;
+                return NA_MEMPROTO_PARSE_AGAIN;
+            }
+            end         = nl > buf + parser->line && *(nl - 1) == '\r' ? nl - 1 : nl;
+            parser->off = nl - buf + 1;
+            if (is_response) {
+                result = na_memproto_parse_response_line(parser, buf + parser->line, end);
+            } else {
+                result = na_memproto_parse_request_line(parser, buf + parser->line, end);
+            }
+            if (result == NA_MEMPROTO_PARSE_DONE) {
+                parser->state = NA_MEMPROTO_PARSE_STATE_FRAMED;
+            }
+            if (result != NA_MEMPROTO_PARSE_AGAIN) {
+                return result;
+            }
+            parser->line = parser->off;
+            break;
+        case NA_MEMPROTO_PARSE_STATE_DATA:
+            n = bufsize - parser->off < parser->bytes ? bufsize - parser->off : parser->bytes;
+            parser->off   += n;
+            parser->bytes -= n;
+            if (parser->bytes > 0) {
+                return NA_MEMPROTO_PARSE_AGAIN;
+            }
+            if (buf[parser->off - 2] != '\r' || buf[parser->off - 1] != '\n') {
+                return NA_MEMPROTO_PARSE_ERROR;
+            }
+            if (is_response && parser->cmd != NA_MEMPROTO_CMD_MG && parser->cmd != NA_MEMPROTO_CMD_MA) {
+                // the next VALUE or END, or the next response before MN follows
+                parser->line  = parser->off;
+                parser->state = NA_MEMPROTO_PARSE_STATE_LINE;
+                break;
+            }
+            parser->state = NA_MEMPROTO_PARSE_STATE_FRAMED;
+            return NA_MEMPROTO_PARSE_DONE;
+        default:
+            return NA_MEMPROTO_PARSE_ERROR;
+        }
+    }
+
+    return NA_MEMPROTO_PARSE_AGAIN;
+}
+
+/**
+ * binary protocol frames have a fixed size header with the length of body.
+ * for a response, responses to quiet commands are framed together with
+ * the response to the next command which is not quiet, and a stat
+ * response is framed up to the packet with an empty key ending it.
+ */
+static na_memproto_parse_result_t na_memproto_parse_binary (na_memproto_parser_t *parser, char *buf, int bufsize, bool is_response)
+{
+    unsigned char *hdr;
+    uint32_t bodylen;
+    int n;
+
+    if (parser->state == NA_MEMPROTO_PARSE_STATE_FRAMED) {
+        parser->state   = NA_MEMPROTO_PARSE_STATE_LINE;
+        parser->start   = parser->off;
+        parser->line    = parser->off;
+        parser->key_cnt = 0;
+    }
+
+    while (true) {
+        switch (parser->state) {
+        case NA_MEMPROTO_PARSE_STATE_LINE:
+            if (bufsize - parser->line < NA_MEMPROTO_BINARY_HEADER_SIZE) {
+                return NA_MEMPROTO_PARSE_AGAIN;
+            }
+            hdr     = (unsigned char *)buf + parser->line;
+            bodylen = (uint32_t)hdr[8] << 24 | (uint32_t)hdr[9] << 16 | (uint32_t)hdr[10] << 8 | hdr[11];
+            if (hdr[0] != (is_response ? NA_MEMPROTO_BINARY_MAGIC_RESPONSE : NA_MEMPROTO_BINARY_MAGIC_REQUEST) ||
+                bodylen > INT_MAX - NA_MEMPROTO_BINARY_HEADER_SIZE                                            ||
+                ((uint32_t)hdr[2] << 8 | hdr[3]) + hdr[4] > bodylen)
+            {
+                return NA_MEMPROTO_PARSE_ERROR;
+            }
+            parser->opcode   = hdr[1];
+            parser->is_quiet = na_memproto_binary_is_quiet(hdr[1]);
+            parser->key      = parser->line + NA_MEMPROTO_BINARY_HEADER_SIZE + hdr[4];
+            parser->key_len  = (int)hdr[2] << 8 | hdr[3];
+            parser->off      = parser->line + NA_MEMPROTO_BINARY_HEADER_SIZE;
+            parser->bytes    = bodylen;
+            parser->state    = NA_MEMPROTO_PARSE_STATE_DATA;
+            break;
+        case NA_MEMPROTO_PARSE_STATE_DATA:
+            n = bufsize - parser->off < parser->bytes ? bufsize - parser->off : parser->bytes;
+            parser->off   += n;
+            parser->bytes -= n;
+            if (parser->bytes > 0) {
+                return NA_MEMPROTO_PARSE_AGAIN;
+            }
+            if (is_response && parser->is_quiet) {
+                ++parser->key_cnt;
+                parser->line  = parser->off;
+                parser->state = NA_MEMPROTO_PARSE_STATE_LINE;
+                break;
+            }
+            if (is_response && parser->opcode == NA_MEMPROTO_BINARY_OPCODE_STAT && parser->key_len > 0) {
+                parser->line  = parser->off;
+                parser->state = NA_MEMPROTO_PARSE_STATE_LINE;
+                break;
+            }
+            if (!is_response) {
+                parser->cmd = parser->opcode == NA_MEMPROTO_BINARY_OPCODE_QUIT ||
+                              parser->opcode == NA_MEMPROTO_BINARY_OPCODE_QUITQ ? NA_MEMPROTO_CMD_QUIT : NA_MEMPROTO_CMD_BINARY;
+            }
+            parser->state = NA_MEMPROTO_PARSE_STATE_FRAMED;
+            return NA_MEMPROTO_PARSE_DONE;
+        default:
+            return NA_MEMPROTO_PARSE_ERROR;
+        }
+    }
+}
+
+void na_memproto_parser_init (na_memproto_parser_t *parser)
+{
+    parser->protocol   = NA_MEMPROTO_PROTOCOL_NOT_DETECTED;
+    parser->state      = NA_MEMPROTO_PARSE_STATE_LINE;
+    parser->cmd        = NA_MEMPROTO_CMD_NOT_DETECTED;
+    parser->opcode     = 0;
+    parser->is_quiet   = false;
+    parser->is_noreply = false;
+    parser->start      = 0;
+    parser->line       = 0;
+    parser->off        = 0;
+    parser->bytes      = 0;
+    parser->key_cnt    = 0;
+    parser->key        = 0;
+    parser->key_len    = 0;
+}
+
+/**
+ * the first size bytes of buffer were thrown away
+ */
+void na_memproto_parser_shift (na_memproto_parser_t *parser, int size)
+{
+    parser->start -= size;
+    parser->line  -= size;
+    parser->off   -= size;
+    parser->key   -= size;
+}
+
+/**
+ * frame the next request in buf. bytes before parser->off are never scanned again,
+ * so buf may grow between calls. on NA_MEMPROTO_PARSE_DONE the request is
+ * [parser->start, parser->off) and the next call begins a new request.
+ */
+na_memproto_parse_result_t na_memproto_parse_request (na_memproto_parser_t *parser, char *buf, int bufsize)
+{
+    if (parser->protocol == NA_MEMPROTO_PROTOCOL_NOT_DETECTED) {
+        if (bufsize == 0) {
+            return NA_MEMPROTO_PARSE_AGAIN;
+        }
+        parser->protocol = (unsigned char)buf[0] == NA_MEMPROTO_BINARY_MAGIC_REQUEST ? NA_MEMPROTO_PROTOCOL_BINARY : NA_MEMPROTO_PROTOCOL_TEXT;
+    }
+
+    if (parser->state == NA_MEMPROTO_PARSE_STATE_FRAMED) {
+        parser->cmd = NA_MEMPROTO_CMD_NOT_DETECTED;
+    }
+    if (parser->protocol == NA_MEMPROTO_PROTOCOL_BINARY) {
+        return na_memproto_parse_binary(parser, buf, bufsize, false);
+    }
+    return na_memproto_parse(parser, buf, bufsize, false);
+}
+
+/**
+ * frame the next response to cmd in buf the same way as na_memproto_parse_request.
+ * VALUE payloads are skipped by their length, so END inside a value does not matter.
+ * key_cnt is the count of VALUEs on NA_MEMPROTO_PARSE_DONE.
+ */
+na_memproto_parse_result_t na_memproto_parse_response (na_memproto_parser_t *parser, na_memproto_cmd_t cmd, char *buf, int bufsize)
+{
+    parser->cmd = cmd;
+    if (cmd == NA_MEMPROTO_CMD_BINARY) {
+        return na_memproto_parse_binary(parser, buf, bufsize, true);
+    }
+    return na_memproto_parse(parser, buf, bufsize, true);
+}
+
+static bool na_memproto_binary_is_quiet (uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x09: // getq
+    case 0x0d: // getkq
+    case 0x11: // setq
+    case 0x12: // addq
+    case 0x13: // replaceq
+    case 0x14: // deleteq
+    case 0x15: // incrementq
+    case 0x16: // decrementq
+    case 0x17: // quitq
+    case 0x18: // flushq
+    case 0x19: // appendq
+    case 0x1a: // prependq
+    case 0x1e: // gatq
+    case 0x24: // gatkq
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool na_memproto_binary_is_write (uint8_t opcode)
+{
+    switch (opcode) {
+    case 0x01: // set
+    case 0x02: // add
+    case 0x03: // replace
+    case 0x04: // delete
+    case 0x05: // increment
+    case 0x06: // decrement
+    case 0x0e: // append
+    case 0x0f: // prepend
+    case 0x11: // setq
+    case 0x12: // addq
+    case 0x13: // replaceq
+    case 0x14: // deleteq
+    case 0x15: // incrementq
+    case 0x16: // decrementq
+    case 0x19: // appendq
+    case 0x1a: // prependq
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * whether the request framed last by parser changes the value of its key.
+ * touch and gat change only the expiration time of it
+ */
+bool na_memproto_is_write (na_memproto_parser_t *parser)
+{
+    if (parser->cmd == NA_MEMPROTO_CMD_BINARY) {
+        return na_memproto_binary_is_write(parser->opcode);
+    }
+    return na_memproto_is_storage(parser->cmd)   ||
+           parser->cmd == NA_MEMPROTO_CMD_INCR   ||
+           parser->cmd == NA_MEMPROTO_CMD_DECR   ||
+           parser->cmd == NA_MEMPROTO_CMD_DELETE ||
+           parser->cmd == NA_MEMPROTO_CMD_MS     ||
+           parser->cmd == NA_MEMPROTO_CMD_MD     ||
+           parser->cmd == NA_MEMPROTO_CMD_MA;
+}
+
+/**
+ * the next key after p in the request of a retrieval command ending at end, or NULL if there is no more
+ */
+char *na_memproto_next_key (char *p, char *end, int *len)
+{
+    while (end > p && (*(end - 1) == '\n' || *(end - 1) == '\r')) {
+        --end;
+    }
+    return na_memproto_token(p, end, len);
+}
+
+/**
+ * whether [line, end) is the END line closing a response to retrieval command
+ */
+bool na_memproto_is_end (char *line, char *end)
+{
+    return end - line >= 3 && memcmp(line, "END", 3) == 0 &&
+           (end - line == 3 || line[3] == '\r' || line[3] == '\n');
+}
+
+/**
+ * whether the response in [line, end) is an error of target server
+ */
+bool na_memproto_is_server_error (char *line, char *end)
+{
+    return end - line >= 12 && memcmp(line, "SERVER_ERROR", 12) == 0;
+}
+
+/**
+ * find the VALUE block of key in the response to a get in [buf, end) and store it into block and size.
+ * false if there is not
+ */
+bool na_memproto_find_value (char *buf, char *end, const char *key, int len, char **block, int *size)
+{
+    char *p, *nl, *le, *tok;
+    int tlen, bytes;
+
+    p = buf;
+    while (end - p > 6 && memcmp(p, "VALUE ", 6) == 0) {
+        if ((nl = memchr(p, '\n', end - p)) == NULL) {
+            return false;
+        }
+        le = nl[-1] == '\r' ? nl - 1 : nl;
+        // VALUE <key> <flags> <bytes> [<cas unique>]
+        if ((tok = na_memproto_nth_token(p + 6, le, 2, &tlen)) == NULL ||
+            (bytes = na_memproto_bytes(tok, tlen)) < 0)
+        {
+            return false;
+        }
+        tok = na_memproto_token(p + 6, le, &tlen);
+        if (tlen == len && memcmp(tok, key, len) == 0) {
+            *block = p;
+            *size  = nl + 1 + bytes + 2 - p;
+            return *block + *size <= end;
+        }
+        p = nl + 1 + bytes + 2;
+    }
+
+    return false;
+}
+
+/**
+ * key of the first VALUE block in the response to a get in [buf, end), or NULL if there is not
+ */
+char *na_memproto_value_key (char *buf, char *end, int *len)
+{
+    char *nl;
+
+    if (end - buf <= 6 || memcmp(buf, "VALUE ", 6) != 0 || (nl = memchr(buf, '\n', end - buf)) == NULL) {
+        return NULL;
+    }
+
+    return na_memproto_token(buf + 6, nl, len);
+}
+
+/**
+ * put a noop request of protocol into buf of NA_MEMPROTO_NOOP_SIZE_MAX bytes and return its size
+ */
+int na_memproto_noop (na_memproto_protocol_t protocol, char *buf)
+{
+    if (protocol == NA_MEMPROTO_PROTOCOL_TEXT) {
+        memcpy(buf, "mn\r\n", 4);
+        return 4;
+    }
+    memset(buf, 0, NA_MEMPROTO_BINARY_HEADER_SIZE);
+    buf[0] = (char)NA_MEMPROTO_BINARY_MAGIC_REQUEST;
+    buf[1] = NA_MEMPROTO_BINARY_OPCODE_NOOP;
+    return NA_MEMPROTO_BINARY_HEADER_SIZE;
 }
@@ -163,7 +163,7 @@ int main (int argc, char *argv[])
         goto MASTER_CYCLE;
     }
 
-    na_memproto_bm_skip_init();
+    na_scan_init();
 
     memset(&env, 0, sizeof(env));
     if (env_cnt == 0) {
@@ -206,12 +206,9 @@ int main (int argc, char *argv[])
                 }
                 // wait until available connection becomes zero
                 while (true) {
-                    pthread_mutex_lock(&env.lock_current_conn);
-                    if (env.current_conn == 0) {
-                        pthread_mutex_unlock(&env.lock_current_conn);
+                    if (na_env_current_conn(&env) == 0) {
                         goto exit;
                     }
-                    pthread_mutex_unlock(&env.lock_current_conn);
                     sleep(1);
                 }
                 break;
@@ -249,7 +246,7 @@ int main (int argc, char *argv[])
 
                     na_setup_signals_for_worker(&ss);
                     
-                    na_memproto_bm_skip_init();
+                    na_scan_init();
                     
                     memset(&env, 0, sizeof(env));
                     na_env_setup_default(&env, ridx);
@@ -288,7 +285,7 @@ int main (int argc, char *argv[])
                     NA_CTL_DIE_WITH_ERROR(&env_ctl, NA_ERROR_FAILED_CREATE_PROCESS);
                 } else if (pid == 0) { // child
                     na_setup_signals_for_worker(&ss);
-                    na_memproto_bm_skip_init();
+                    na_scan_init();
                     memset(&env, 0, sizeof(env));
                     na_env_setup_default(&env, env_cnt - 1);
                     na_conf_env_init(environments_obj, &env, env_cnt - 1);
@@ -331,7 +328,7 @@ int main (int argc, char *argv[])
                     NA_CTL_DIE_WITH_ERROR(&env_ctl, NA_ERROR_FAILED_CREATE_PROCESS);
                 } else if (pid == 0) {
                     na_setup_signals_for_worker(&ss);
-                    na_memproto_bm_skip_init();
+                    na_scan_init();
                     memset(&env, 0, sizeof(env));
                     na_env_setup_default(&env, idx);
                     na_conf_env_init(environments_obj, &env, idx);
@@ -7,76 +7,100 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 
 #include "defines.h"
 
+/**
+ * The algorithm implemented here is based on Dmitry Vyukov's bounded MPMC queue.
+ * Every cell carries a sequence number which tells producers and consumers
+ * whether the cell is ready for them, so push and pop need a single CAS.
+ */
+
 na_event_queue_t *na_event_queue_create(int c)
 {
     na_event_queue_t *q;
-    q        = malloc(sizeof(na_event_queue_t));
-    q->top   = 0;
-    q->bot   = 0;
-    q->cnt   = 0;
-    q->max   = c;
-    q->queue = calloc(sizeof(na_client_t *), c);
-    for (int i=0;i<c;++i) {
-        q->queue[i] = (na_client_t *)NULL;
+    size_t max;
+
+    max = 2;
+    while (max < (size_t)c) {
+        max <<= 1;
+    }
+
+    q        = calloc(sizeof(na_event_queue_t), 1);
+    q->cells = calloc(sizeof(na_event_queue_cell_t), max);
+    q->mask  = max - 1;
+    q->enq   = 0;
+    q->deq   = 0;
+    for (size_t i=0;i<max;++i) {
+        q->cells[i].seq    = i;
+        q->cells[i].client = NULL;
     }
-    pthread_mutex_init(&q->lock, NULL);
-    pthread_cond_init (&q->cond, NULL);
     return q;
 }
 
 void na_event_queue_destroy(na_event_queue_t *q)
 {
-    pthread_mutex_destroy(&q->lock);
-    pthread_cond_destroy(&q->cond);
-    NA_FREE(q->queue);
+    NA_FREE(q->cells);
     NA_FREE(q);
 }
 
 bool na_event_queue_push(na_event_queue_t *q, na_client_t *e)
 {
-    pthread_mutex_lock(&q->lock);
-    if (q->cnt >= q->max) {
-        pthread_mutex_unlock(&q->lock);
-        return false;
-    }
-
-    q->queue[q->bot++] = e;
+    na_event_queue_cell_t *cell;
+    size_t pos, seq;
+    intptr_t dif;
 
-    if (q->bot >= q->max) {
-        q->bot = 0;
+    pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif  = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->enq, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return false; // full
+        } else {
+            pos = __atomic_load_n(&q->enq, __ATOMIC_RELAXED);
+        }
     }
 
-    ++q->cnt;
-
-    if (q->cnt == 1) {
-        pthread_cond_broadcast(&q->cond);
-    }
+    cell->client = e;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-    pthread_mutex_unlock(&q->lock);
     return true;
 }
 
 na_client_t *na_event_queue_pop(na_event_queue_t *q)
 {
+    na_event_queue_cell_t *cell;
     na_client_t *c;
-    pthread_mutex_lock(&q->lock);
-    if (q->cnt <= 0) {
-        pthread_mutex_unlock(&q->lock);
-        return NULL;
-    }
-
-    c = q->queue[q->top];
-    q->queue[q->top++] = 0;
+    size_t pos, seq;
+    intptr_t dif;
 
-    if (q->top >= q->max) {
-        q->top = 0;
+    pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+    while (true) {
+        cell = &q->cells[pos & q->mask];
+        seq  = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        dif  = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&q->deq, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            return NULL; // empty
+        } else {
+            pos = __atomic_load_n(&q->deq, __ATOMIC_RELAXED);
+        }
     }
 
-    --q->cnt;
+    c = cell->client;
+    cell->client = NULL;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
 
-    pthread_mutex_unlock(&q->lock);
     return c;
 }
@@ -0,0 +1,109 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <string.h>
+
+#include "defines.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NA_SCAN_USE_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+ * line terminator scanning for memproto.
+ * the kernel is selected by na_scan_init() from what the CPU supports.
+ */
+
+// private functions
+static char *na_scan_lf_scalar (char *buf, size_t len);
+#ifdef NA_SCAN_USE_SIMD
+static char *na_scan_lf_sse2 (char *buf, size_t len);
+static char *na_scan_lf_avx2 (char *buf, size_t len);
+#endif
+
+static char *(*na_scan_lf_kernel)(char *buf, size_t len) = na_scan_lf_scalar;
+
+static char *na_scan_lf_scalar (char *buf, size_t len)
+{
+    for (size_t i=0;i<len;++i) {
+        if (buf[i] == '\n') {
+            return buf + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef NA_SCAN_USE_SIMD
+
+__attribute__((target("sse2")))
+static char *na_scan_lf_sse2 (char *buf, size_t len)
+{
+    __m128i lf;
+    size_t i;
+
+    lf = _mm_set1_epi8('\n');
+    for (i=0;i+16<=len;i+=16) {
+        int m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(buf + i)), lf));
+        if (m != 0) {
+            return buf + i + __builtin_ctz(m);
+        }
+    }
+    return na_scan_lf_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static char *na_scan_lf_avx2 (char *buf, size_t len)
+{
+    __m256i lf;
+    size_t i;
+
+    lf = _mm256_set1_epi8('\n');
+    for (i=0;i+32<=len;i+=32) {
+        unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(buf + i)), lf));
+        if (m != 0) {
+            return buf + i + __builtin_ctz(m);
+        }
+    }
+    return na_scan_lf_sse2(buf + i, len - i);
+}
+
+#endif
+
+void na_scan_init (void)
+{
+#ifdef NA_SCAN_USE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        na_scan_lf_kernel = na_scan_lf_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        na_scan_lf_kernel = na_scan_lf_sse2;
+    }
+#endif
+}
+
+const char *na_scan_kernel_name (void)
+{
+#ifdef NA_SCAN_USE_SIMD
+    if (na_scan_lf_kernel == na_scan_lf_avx2) {
+        return "avx2";
+    } else if (na_scan_lf_kernel == na_scan_lf_sse2) {
+        return "sse2";
+    }
+#endif
+    return "scalar";
+}
+
+/**
+ * first LF in buf, or NULL if there is not
+ */
+char *na_scan_lf (char *buf, size_t len)
+{
+    return na_scan_lf_kernel(buf, len);
+}
+
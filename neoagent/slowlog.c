@@ -37,16 +37,27 @@ static int clock_gettime(int dummy, struct timespec *ts)
 static void na_copy_querytxt(char *dst, char *src, size_t size, size_t reqsize, na_memproto_cmd_t cmd);
 static void na_copy_querytxt(char *dst, char *src, size_t size, size_t reqsize, na_memproto_cmd_t cmd)
 {
-    if (cmd == NA_MEMPROTO_CMD_SET) {
+    if (cmd == NA_MEMPROTO_CMD_SET     ||
+        cmd == NA_MEMPROTO_CMD_ADD     ||
+        cmd == NA_MEMPROTO_CMD_REPLACE ||
+        cmd == NA_MEMPROTO_CMD_APPEND  ||
+        cmd == NA_MEMPROTO_CMD_PREPEND ||
+        cmd == NA_MEMPROTO_CMD_CAS     ||
+        cmd == NA_MEMPROTO_CMD_MS)
+    {
         char *p;
-        p = src + sizeof("set ") - 1;
-        p = strstr(p, " ");
+        // command name and key only
+        p = strstr(src, " ");
+        p = p != NULL ? strstr(p + 1, " ") : NULL;
         if (p == NULL) {
             snprintf(dst, reqsize, "%s", src);
         } else {
             size_t l = p - src + 1;
             snprintf(dst, l, "%s", src);
         }
+    } else if (cmd == NA_MEMPROTO_CMD_BINARY) {
+        // frames are not text
+        snprintf(dst, size, "binary opcode 0x%02x", (unsigned char)src[1]);
     }  else {
         snprintf(dst, size, "%s", src);
     }
@@ -39,6 +39,9 @@ static void na_set_sockopt(int fd, int optname)
     switch (optname) {
     case SO_KEEPALIVE:
     case SO_REUSEADDR:
+#ifdef SO_REUSEPORT
+    case SO_REUSEPORT:
+#endif
         {
             int flags = 1;
             setsockopt(fd, SOL_SOCKET, optname, (void *)&flags, sizeof(flags));
@@ -106,21 +109,6 @@ void na_target_server_tcpsock_setup (int tsfd, bool is_keepalive)
     na_set_sockopt(tsfd, SO_LINGER);
 }
 
-void na_target_server_hcsock_setup (int tsfd)
-{
-    struct timeval tv_recv, tv_send;
-    na_set_sockopt(tsfd, SO_KEEPALIVE);
-    na_set_sockopt(tsfd, SO_REUSEADDR);
-    na_set_sockopt(tsfd, SO_LINGER);
-
-    tv_recv.tv_sec  = 4;
-    tv_recv.tv_usec = 0;
-    tv_send.tv_sec  = 4;
-    tv_send.tv_usec = 0;
-    setsockopt(tsfd, SOL_SOCKET, SO_RCVTIMEO, &tv_recv, sizeof(struct timeval));
-    setsockopt(tsfd, SOL_SOCKET, SO_SNDTIMEO, &tv_send, sizeof(struct timeval));
-}
-
 na_host_t na_create_host(char *host)
 {
     // hostname example
@@ -213,7 +201,7 @@ void na_set_sockaddr (na_host_t *host, struct sockaddr_in *addr)
     }
 }
 
-int na_front_server_tcpsock_init (uint16_t port, int conn_max)
+int na_front_server_tcpsock_init (uint16_t port, int conn_max, bool is_reuseport)
 {
     int fsfd;
     struct sockaddr_in iaddr;
@@ -227,6 +215,11 @@ int na_front_server_tcpsock_init (uint16_t port, int conn_max)
     na_set_sockopt(fsfd, SO_KEEPALIVE);
     na_set_sockopt(fsfd, SO_REUSEADDR);
     na_set_sockopt(fsfd, SO_LINGER);
+#ifdef SO_REUSEPORT
+    if (is_reuseport) {
+        na_set_sockopt(fsfd, SO_REUSEPORT);
+    }
+#endif
 
     if (port > 0) {
         memset(&iaddr, 0, sizeof(iaddr));
@@ -0,0 +1,200 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "defines.h"
+
+/**
+ * connections to backup servers are made before failover, so the first
+ * requests after it don't wait for them. the pools of the servers in the tier
+ * next to the active one are checked periodically and filled up to
+ * backup_standby_max idle connections. ones closed by the server are made again.
+ * a connection is put in the pool after the server answers version on it,
+ * so it speaks text protocol from then on.
+ */
+
+static const double NA_STANDBY_INTERVAL = 1.;
+static const char *na_standby_cmd = "version\r\n";
+static const char *na_standby_res = "VERSION ";
+
+// private functions
+static void na_standby_callback (EV_P_ ev_timer *w, int revents);
+static void na_standby_conn_callback (EV_P_ ev_io *w, int revents);
+static void na_standby_timer_callback (EV_P_ ev_timer *w, int revents);
+static void na_standby_conn_done (EV_P_ na_standby_conn_t *conn, bool is_verified);
+
+na_standby_t *na_standby_create (na_env_t *env)
+{
+    na_standby_t *standby;
+
+    standby = (na_standby_t *)calloc(sizeof(na_standby_t), 1);
+    if (standby == NULL) {
+        return NULL;
+    }
+    standby->conn_cnt = env->connpool_cnt * env->backup_server_cnt * env->backup_standby_max;
+    standby->conns    = calloc(sizeof(na_standby_conn_t), standby->conn_cnt);
+    if (standby->conns == NULL) {
+        NA_FREE(standby);
+        return NULL;
+    }
+    standby->env     = env;
+    standby->timeout = env->hc_timeout_msec / 1000.;
+
+    for (int i=0;i<standby->conn_cnt;++i) {
+        na_standby_conn_t *conn = &standby->conns[i];
+        conn->standby      = standby;
+        conn->connpool     = &env->connpool_backup[i / env->backup_standby_max];
+        conn->cur          = -1;
+        conn->watcher.data = conn;
+        conn->timer.data   = conn;
+        ev_init(&conn->watcher, na_standby_conn_callback);
+        ev_init(&conn->timer, na_standby_timer_callback);
+    }
+
+    return standby;
+}
+
+void na_standby_start (EV_P_ na_standby_t *standby)
+{
+    standby->watcher.data = standby;
+    ev_timer_init(&standby->watcher, na_standby_callback, 0., NA_STANDBY_INTERVAL);
+    ev_timer_start(EV_A_ &standby->watcher);
+}
+
+/**
+ * fill the pools of the tier failed over to next. failover runs on the same loop,
+ * so active_tier doesn't change here
+ */
+static void na_standby_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_standby_t *standby;
+    na_standby_conn_t *conns;
+    na_env_t *env;
+    na_tier_t *tier;
+    int cnt, fd, idx;
+
+    standby = (na_standby_t *)w->data;
+    env     = standby->env;
+
+    // pools of the last tier are never standby
+    if (env->active_tier + 1 >= env->tier_cnt) {
+        return;
+    }
+    tier = &env->tiers[env->active_tier + 1];
+
+    for (int i=(tier->first - env->target_server_cnt) * env->connpool_cnt;
+         i<(tier->first + tier->cnt - env->target_server_cnt) * env->connpool_cnt;++i)
+    {
+        // backup pools are laid out in the same order as the connections
+        idx   = env->target_server_cnt + i / env->connpool_cnt;
+        conns = &standby->conns[i * env->backup_standby_max];
+        cnt   = na_connpool_check_idle(&env->connpool_backup[i]);
+        for (int j=0;j<env->backup_standby_max;++j) {
+            if (conns[j].cur != -1) {
+                ++cnt;
+            }
+        }
+        for (int j=0;j<env->backup_standby_max && cnt < env->backup_standby_max;++j) {
+            if (conns[j].cur != -1) {
+                continue;
+            }
+            if (!na_connpool_standby(conns[j].connpool, na_env_server(env, idx), &conns[j].cur, &fd)) {
+                break;
+            }
+            conns[j].is_connected = false;
+            conns[j].rbufsize     = 0;
+            ev_io_set(&conns[j].watcher, fd, EV_WRITE);
+            ev_io_start(EV_A_ &conns[j].watcher);
+            ev_timer_set(&conns[j].timer, standby->timeout, 0.);
+            ev_timer_start(EV_A_ &conns[j].timer);
+            ++cnt;
+        }
+    }
+}
+
+/**
+ * version is sent once the connection is made. the response must come in timeout
+ */
+static void na_standby_conn_callback (EV_P_ ev_io *w, int revents)
+{
+    na_standby_conn_t *conn;
+    socklen_t len;
+    ssize_t size;
+    size_t rlen;
+    int err;
+
+    conn = (na_standby_conn_t *)w->data;
+
+    if (!conn->is_connected) {
+        len = sizeof(err);
+        if (getsockopt(w->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            na_standby_conn_done(EV_A_ conn, false);
+            return;
+        }
+        // the command is short enough to go at once on a new connection
+        if (write(w->fd, na_standby_cmd, strlen(na_standby_cmd)) != (ssize_t)strlen(na_standby_cmd)) {
+            na_standby_conn_done(EV_A_ conn, false);
+            return;
+        }
+        conn->is_connected = true;
+        ev_io_stop(EV_A_ w);
+        ev_io_set(w, w->fd, EV_READ);
+        ev_io_start(EV_A_ w);
+        return;
+    }
+
+    size = read(w->fd, conn->rbuf + conn->rbufsize, NA_STANDBY_BUF_MAX - conn->rbufsize);
+    if (size < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return;
+        }
+        na_standby_conn_done(EV_A_ conn, false);
+        return;
+    } else if (size == 0) {
+        na_standby_conn_done(EV_A_ conn, false);
+        return;
+    }
+    conn->rbufsize += size;
+
+    rlen = strlen(na_standby_res);
+    if (memcmp(conn->rbuf, na_standby_res, conn->rbufsize < rlen ? conn->rbufsize : rlen) != 0) {
+        na_standby_conn_done(EV_A_ conn, false);
+        return;
+    }
+    if (conn->rbufsize < rlen + 2 || memcmp(conn->rbuf + conn->rbufsize - 2, "\r\n", 2) != 0) {
+        if (conn->rbufsize == NA_STANDBY_BUF_MAX) {
+            na_standby_conn_done(EV_A_ conn, false);
+        }
+        return;
+    }
+
+    na_connpool_set_protocol(conn->connpool, conn->cur, NA_MEMPROTO_PROTOCOL_TEXT);
+    na_standby_conn_done(EV_A_ conn, true);
+}
+
+static void na_standby_timer_callback (EV_P_ ev_timer *w, int revents)
+{
+    na_standby_conn_t *conn;
+
+    conn = (na_standby_conn_t *)w->data;
+
+    // timeout. health check tells whether the backup server is down
+    na_standby_conn_done(EV_A_ conn, false);
+}
+
+static void na_standby_conn_done (EV_P_ na_standby_conn_t *conn, bool is_verified)
+{
+    ev_io_stop(EV_A_ &conn->watcher);
+    ev_timer_stop(EV_A_ &conn->timer);
+    na_connpool_standby_done(conn->connpool, conn->cur, is_verified);
+    conn->cur = -1;
+}
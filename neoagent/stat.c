@@ -6,6 +6,7 @@
  *
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -13,7 +14,6 @@
 #include "version.h"
 
 // constants
-static const int   NA_STAT_BUF_MAX   = 8192;
 static const char *NA_BOOL_STR_TRUE  = "true";
 static const char *NA_BOOL_STR_FALSE = "false";
 
@@ -26,10 +26,22 @@ static inline const char *na_bool2str(bool b);
 static inline char *na_active_host_select(na_env_t *env);
 static inline uint16_t na_active_port_select(na_env_t *env);
 
-static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env);
-static int na_available_conn (na_connpool_t *connpool);
-static struct json_object *na_connpoolmap_array_json(na_connpool_t *connpool);
+static char *na_env_create_jbuf(na_env_t *env);
+static int na_available_conn (na_connpool_t *connpools, int cnt);
+static int na_client_pool_used (na_env_t *env);
+static struct json_object *na_connpoolmap_array_json(na_connpool_t *connpools, int cnt);
+static struct json_object *na_connpool_state_json(na_connpool_t *connpools, int cnt);
 static struct json_object *na_workermap_array_json(na_env_t *env);
+static struct json_object *na_worker_requestmap_array_json(na_env_t *env);
+static struct json_object *na_worker_stealmap_array_json(na_env_t *env);
+static struct json_object *na_worker_collapsemap_array_json(na_env_t *env);
+static struct json_object *na_l1_cache_prefixes_array_json(na_env_t *env);
+static struct json_object *na_multiplex_pendingmap_array_json(na_env_t *env);
+static struct json_object *na_target_servers_array_json(na_env_t *env);
+static struct json_object *na_backup_servers_array_json(na_env_t *env);
+static struct json_object *na_hc_array_json(na_env_t *env);
+static int na_hotkey_cmp(const void *a, const void *b);
+static struct json_object *na_hotkeys_array_json(na_env_t *env);
 
 static inline const char *na_bool2str(bool b)
 {
@@ -38,29 +50,54 @@ static inline const char *na_bool2str(bool b)
 
 static inline char *na_active_host_select(na_env_t *env)
 {
-    return env->is_refused_active ? env->backup_server.host.ipaddr : env->target_server.host.ipaddr;
+    return na_env_server(env, na_env_active_tier(env)->first)->host.ipaddr;
 }
 
 static inline uint16_t na_active_port_select(na_env_t *env)
 {
-    return env->is_refused_active ? env->backup_server.host.port : env->target_server.host.port;
+    return na_env_server(env, na_env_active_tier(env)->first)->host.port;
 }
 
-static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env)
+/**
+ * statistics of environment in JSON, which the caller frees
+ */
+static char *na_env_create_jbuf(na_env_t *env)
 {
-    na_connpool_t *connpool;
+    na_connpool_t *connpools;
+    na_tier_t *tier;
+    na_cache_t *cache;
+    int connpool_cnt, standby_cnt;
     struct json_object *stat_obj;
     struct json_object *connpoolmap_obj;
     struct json_object *workermap_obj;
+    struct json_object *worker_requestmap_obj;
+    struct json_object *worker_stealmap_obj;
+    struct json_object *multiplex_pendingmap_obj;
     time_t up_diff;
+    char *buf;
     char start_dt[NA_DATETIME_BUF_MAX];
     char up_time[NA_DATETIME_BUF_MAX];
 
-    connpool        = env->is_refused_active ? &env->connpool_backup : &env->connpool_active;
-    stat_obj        = json_object_new_object();
-    connpoolmap_obj = na_connpoolmap_array_json(connpool);
-    workermap_obj   = na_workermap_array_json(env);
-    up_diff         = time(NULL) - StartTimestamp;
+    tier                     = na_env_active_tier(env);
+    connpools                = na_connpool_select(env, tier->first, 0);
+    connpool_cnt             = env->connpool_cnt * tier->cnt;
+    cache                    = env->l1_cache;
+    stat_obj                 = json_object_new_object();
+    connpoolmap_obj          = na_connpoolmap_array_json(connpools, connpool_cnt);
+    workermap_obj            = na_workermap_array_json(env);
+    worker_requestmap_obj    = na_worker_requestmap_array_json(env);
+    worker_stealmap_obj      = na_worker_stealmap_array_json(env);
+    multiplex_pendingmap_obj = na_multiplex_pendingmap_array_json(env);
+    up_diff                  = time(NULL) - StartTimestamp;
+
+    // idle connections to the backup servers failed over to next
+    standby_cnt = 0;
+    if (env->active_tier + 1 < env->tier_cnt) {
+        tier = &env->tiers[env->active_tier + 1];
+        for (int i=0;i<env->connpool_cnt * tier->cnt;++i) {
+            standby_cnt += na_connpool_count(&na_connpool_select(env, tier->first, 0)[i], NA_CONNPOOL_STATE_IDLE);
+        }
+    }
 
     na_ts2dt(StartTimestamp, "%Y-%m-%d %H:%M:%S", start_dt, NA_DATETIME_BUF_MAX);
     na_elapsed_time(up_diff, up_time, NA_DATETIME_BUF_MAX);
@@ -75,72 +112,335 @@ static void na_env_set_jbuf(char *buf, int bufsize, na_env_t *env)
     json_object_object_add(stat_obj, "fssockpath",                   json_object_new_string(env->fssockpath));
     json_object_object_add(stat_obj, "target_host",                  json_object_new_string(env->target_server.host.ipaddr));
     json_object_object_add(stat_obj, "target_port",                  json_object_new_int(env->target_server.host.port));
+    json_object_object_add(stat_obj, "target_servers",               na_target_servers_array_json(env));
     json_object_object_add(stat_obj, "backup_host",                  json_object_new_string(env->backup_server.host.ipaddr));
     json_object_object_add(stat_obj, "backup_port",                  json_object_new_int(env->backup_server.host.port));
+    json_object_object_add(stat_obj, "backup_servers",               na_backup_servers_array_json(env));
     json_object_object_add(stat_obj, "current_target_host",          json_object_new_string(na_active_host_select(env)));
     json_object_object_add(stat_obj, "current_target_port",          json_object_new_int(na_active_port_select(env)));
     json_object_object_add(stat_obj, "worker_max",                   json_object_new_int(env->worker_max));
     json_object_object_add(stat_obj, "conn_max",                     json_object_new_int(env->conn_max));
     json_object_object_add(stat_obj, "connpool_max",                 json_object_new_int(env->connpool_max));
-    json_object_object_add(stat_obj, "is_refused_active",            json_object_new_string(na_bool2str(env->is_refused_active)));
+    json_object_object_add(stat_obj, "client_pool_max",              json_object_new_int(env->client_pool_max));
+    json_object_object_add(stat_obj, "client_pool_used",             json_object_new_int(na_client_pool_used(env)));
+    json_object_object_add(stat_obj, "multiplex_conn_max",           json_object_new_int(env->multiplex_conn_max));
+    json_object_object_add(stat_obj, "pipeline_max",                 json_object_new_int(env->pipeline_max));
+    json_object_object_add(stat_obj, "multiget_keys_max",            json_object_new_int(env->multiget_keys_max));
+    json_object_object_add(stat_obj, "get_collapse",                 json_object_new_string(na_bool2str(env->is_get_collapse)));
+    json_object_object_add(stat_obj, "get_batch_usec",               json_object_new_int(env->get_batch_usec));
+    json_object_object_add(stat_obj, "l1_cache_prefixes",            na_l1_cache_prefixes_array_json(env));
+    json_object_object_add(stat_obj, "l1_cache_memory_max",          json_object_new_int(env->l1_cache_memory_max));
+    json_object_object_add(stat_obj, "l1_cache_ttl_msec",            json_object_new_int(env->l1_cache_ttl_msec));
+    json_object_object_add(stat_obj, "l1_cache_memory",              json_object_new_int64(cache != NULL ? na_cache_memory(cache) : 0));
+    json_object_object_add(stat_obj, "l1_cache_entries",             json_object_new_int(cache != NULL ? na_cache_entry_cnt(cache) : 0));
+    json_object_object_add(stat_obj, "l1_cache_hit",                 json_object_new_int64(cache != NULL ? na_cache_hit_cnt(cache) : 0));
+    json_object_object_add(stat_obj, "l1_cache_miss",                json_object_new_int64(cache != NULL ? na_cache_miss_cnt(cache) : 0));
+    json_object_object_add(stat_obj, "l1_cache_eviction",            json_object_new_int64(cache != NULL ? na_cache_eviction_cnt(cache) : 0));
+    json_object_object_add(stat_obj, "hotkey_max",                   json_object_new_int(env->hotkey_max));
+    json_object_object_add(stat_obj, "hotkey_window_sec",            json_object_new_int(env->hotkey_window_sec));
+    json_object_object_add(stat_obj, "hc_timeout_msec",              json_object_new_int(env->hc_timeout_msec));
+    json_object_object_add(stat_obj, "eject_error_rate",             json_object_new_double(env->eject_error_rate));
+    json_object_object_add(stat_obj, "eject_latency_msec",           json_object_new_int(env->eject_latency_msec));
+    json_object_object_add(stat_obj, "eject_min_requests",           json_object_new_int(env->eject_min_requests));
+    json_object_object_add(stat_obj, "readmit_steps",                json_object_new_int(env->readmit_steps));
+    json_object_object_add(stat_obj, "backup_standby_max",           json_object_new_int(env->backup_standby_max));
+    json_object_object_add(stat_obj, "backup_standby",               json_object_new_int(standby_cnt));
+    json_object_object_add(stat_obj, "hc",                           na_hc_array_json(env));
+    json_object_object_add(stat_obj, "is_refused_active",            json_object_new_string(na_bool2str(env->active_tier > 0)));
+    json_object_object_add(stat_obj, "active_tier",                  json_object_new_int(env->active_tier));
+    json_object_object_add(stat_obj, "reuseport",                    json_object_new_string(na_bool2str(env->is_reuseport)));
+    json_object_object_add(stat_obj, "worker_steal_interval",        json_object_new_double(env->worker_steal_interval));
+    json_object_object_add(stat_obj, "scan_kernel",                  json_object_new_string(na_scan_kernel_name()));
     json_object_object_add(stat_obj, "request_bufsize",              json_object_new_int(env->request_bufsize));
     json_object_object_add(stat_obj, "response_bufsize",             json_object_new_int(env->response_bufsize));
-    json_object_object_add(stat_obj, "current_conn",                 json_object_new_int(env->current_conn));
-    json_object_object_add(stat_obj, "available_conn",               json_object_new_int(na_available_conn(connpool)));
+    json_object_object_add(stat_obj, "current_conn",                 json_object_new_int(na_env_current_conn(env)));
+    json_object_object_add(stat_obj, "available_conn",               json_object_new_int(na_available_conn(connpools, connpool_cnt)));
     json_object_object_add(stat_obj, "current_conn_max",             json_object_new_int(env->current_conn_max));
     json_object_object_add(stat_obj, "slow_query_sec",               json_object_new_double((double)((double)env->slow_query_sec.tv_sec +
                                                                                                      (double)env->slow_query_sec.tv_nsec /
                                                                                                      1000000000L)));
     json_object_object_add(stat_obj, "slow_query_log_format",        json_object_new_string(na_log_format_name(env->slow_query_log_format)));
     json_object_object_add(stat_obj, "worker_map",                   workermap_obj);
+    json_object_object_add(stat_obj, "worker_request_map",           worker_requestmap_obj);
+    json_object_object_add(stat_obj, "worker_steal_map",             worker_stealmap_obj);
+    json_object_object_add(stat_obj, "worker_collapse_map",          na_worker_collapsemap_array_json(env));
     json_object_object_add(stat_obj, "connpool_map",                 connpoolmap_obj);
+    json_object_object_add(stat_obj, "connpool_state",               na_connpool_state_json(connpools, connpool_cnt));
+    json_object_object_add(stat_obj, "multiplex_pending_map",        multiplex_pendingmap_obj);
+    json_object_object_add(stat_obj, "hotkeys",                      na_hotkeys_array_json(env));
 
-    snprintf(buf, bufsize, "%s", json_object_to_json_string(stat_obj));
+    buf = strdup(json_object_to_json_string(stat_obj));
 
     json_object_put(stat_obj);
+
+    return buf;
 }
 
-static int na_available_conn (na_connpool_t *connpool)
+static int na_available_conn (na_connpool_t *connpools, int cnt)
 {
     int available_conn;
 
     available_conn = 0;
 
-    for (int i=0;i<connpool->max;++i) {
-        if (connpool->mark[i] == 0) {
-            ++available_conn;
-        }
+    for (int i=0;i<cnt;++i) {
+        available_conn += connpools[i].max;
+        available_conn -= na_connpool_count(&connpools[i], NA_CONNPOOL_STATE_CONNECTING);
+        available_conn -= na_connpool_count(&connpools[i], NA_CONNPOOL_STATE_INUSE);
     }
 
     return available_conn;
 }
 
-static struct json_object *na_connpoolmap_array_json(na_connpool_t *connpool)
+static int na_client_pool_used (na_env_t *env)
+{
+    int used;
+
+    used = 0;
+
+    // workers share one client pool unless reuseport is enabled
+    for (int i=0;i<env->worker_max;++i) {
+        used += env->workers[i].client_pool->used;
+        if (!env->is_reuseport) {
+            break;
+        }
+    }
+
+    return used;
+}
+
+static struct json_object *na_connpoolmap_array_json(na_connpool_t *connpools, int cnt)
 {
     struct json_object *connpoolmap_obj;
     connpoolmap_obj = json_object_new_array();
-    for (int i=0;i<connpool->max;++i) {
-        json_object_array_add(connpoolmap_obj, json_object_new_int(connpool->mark[i]));
+    for (int i=0;i<cnt;++i) {
+        for (int j=0;j<connpools[i].max;++j) {
+            na_connpool_state_t state = connpools[i].state[j];
+            bool is_used = state == NA_CONNPOOL_STATE_CONNECTING || state == NA_CONNPOOL_STATE_INUSE;
+            json_object_array_add(connpoolmap_obj, json_object_new_int(is_used ? 1 : 0));
+        }
     }
     return connpoolmap_obj;
 }
 
+static struct json_object *na_connpool_state_json(na_connpool_t *connpools, int cnt)
+{
+    struct json_object *state_obj;
+    state_obj = json_object_new_object();
+    for (int s=0;s<NA_CONNPOOL_STATE_MAX;++s) {
+        int n = 0;
+        for (int i=0;i<cnt;++i) {
+            n += na_connpool_count(&connpools[i], s);
+        }
+        json_object_object_add(state_obj, na_connpool_state_name(s), json_object_new_int(n));
+    }
+    return state_obj;
+}
+
 static struct json_object *na_workermap_array_json(na_env_t *env)
 {
     struct json_object *workermap_obj;
     workermap_obj = json_object_new_array();
     for (int i=0;i<env->worker_max;++i) {
-        json_object_array_add(workermap_obj, json_object_new_boolean(env->is_worker_busy[i]));
+        json_object_array_add(workermap_obj, json_object_new_int(env->workers[i].client_cnt));
     }
     return workermap_obj;
 }
 
+static struct json_object *na_worker_requestmap_array_json(na_env_t *env)
+{
+    struct json_object *worker_requestmap_obj;
+    worker_requestmap_obj = json_object_new_array();
+    for (int i=0;i<env->worker_max;++i) {
+        json_object_array_add(worker_requestmap_obj, json_object_new_int(env->workers[i].request_cnt));
+    }
+    return worker_requestmap_obj;
+}
+
+static struct json_object *na_worker_stealmap_array_json(na_env_t *env)
+{
+    struct json_object *worker_stealmap_obj;
+    worker_stealmap_obj = json_object_new_array();
+    for (int i=0;i<env->worker_max;++i) {
+        json_object_array_add(worker_stealmap_obj, json_object_new_int(env->workers[i].steal_cnt));
+    }
+    return worker_stealmap_obj;
+}
+
+static struct json_object *na_worker_collapsemap_array_json(na_env_t *env)
+{
+    struct json_object *worker_collapsemap_obj;
+    worker_collapsemap_obj = json_object_new_array();
+    for (int i=0;i<env->worker_max;++i) {
+        json_object_array_add(worker_collapsemap_obj, json_object_new_int(env->workers[i].collapse_cnt));
+    }
+    return worker_collapsemap_obj;
+}
+
+static struct json_object *na_l1_cache_prefixes_array_json(na_env_t *env)
+{
+    struct json_object *prefixes_obj;
+    prefixes_obj = json_object_new_array();
+    for (int i=0;i<env->l1_cache_prefix_cnt;++i) {
+        json_object_array_add(prefixes_obj, json_object_new_string(env->l1_cache_prefixes[i]));
+    }
+    return prefixes_obj;
+}
+
+static struct json_object *na_multiplex_pendingmap_array_json(na_env_t *env)
+{
+    struct json_object *multiplex_pendingmap_obj;
+    multiplex_pendingmap_obj = json_object_new_array();
+    for (int i=0;i<env->worker_max;++i) {
+        for (int j=0;j<env->server_cnt * env->multiplex_conn_max * 2;++j) {
+            json_object_array_add(multiplex_pendingmap_obj, json_object_new_int(env->workers[i].tsconns[j].request_cnt));
+        }
+    }
+    return multiplex_pendingmap_obj;
+}
+
+static struct json_object *na_target_servers_array_json(na_env_t *env)
+{
+    struct json_object *target_servers_obj;
+    target_servers_obj = json_object_new_array();
+    for (int i=0;i<env->target_server_cnt;++i) {
+        struct json_object *server_obj;
+        server_obj = json_object_new_object();
+        json_object_object_add(server_obj, "host",   json_object_new_string(env->target_servers[i].host.ipaddr));
+        json_object_object_add(server_obj, "port",   json_object_new_int(env->target_servers[i].host.port));
+        json_object_object_add(server_obj, "weight", json_object_new_int(env->target_servers[i].weight));
+        json_object_array_add(target_servers_obj, server_obj);
+    }
+    return target_servers_obj;
+}
+
+static struct json_object *na_backup_servers_array_json(na_env_t *env)
+{
+    struct json_object *backup_servers_obj;
+    backup_servers_obj = json_object_new_array();
+    for (int i=0;i<env->backup_server_cnt;++i) {
+        struct json_object *server_obj;
+        server_obj = json_object_new_object();
+        json_object_object_add(server_obj, "host",     json_object_new_string(env->backup_servers[i].host.ipaddr));
+        json_object_object_add(server_obj, "port",     json_object_new_int(env->backup_servers[i].host.port));
+        json_object_object_add(server_obj, "weight",   json_object_new_int(env->backup_servers[i].weight));
+        json_object_object_add(server_obj, "priority", json_object_new_int(env->backup_servers[i].priority));
+        json_object_array_add(backup_servers_obj, server_obj);
+    }
+    return backup_servers_obj;
+}
+
+/**
+ * result of the last health check of each server, and its health from live traffic if ejection is enabled.
+ * it is read on the support loop where checks run
+ */
+static struct json_object *na_hc_array_json(na_env_t *env)
+{
+    struct json_object *hc_obj;
+    hc_obj = json_object_new_array();
+    if (env->hc == NULL) {
+        return hc_obj;
+    }
+    for (int i=0;i<env->hc->probe_cnt;++i) {
+        na_hc_probe_t *probe = &env->hc->probes[i];
+        struct json_object *probe_obj;
+        probe_obj = json_object_new_object();
+        json_object_object_add(probe_obj, "host",         json_object_new_string(probe->server->host.ipaddr));
+        json_object_object_add(probe_obj, "port",         json_object_new_int(probe->server->host.port));
+        json_object_object_add(probe_obj, "healthy",      json_object_new_string(na_bool2str(probe->is_healthy)));
+        json_object_object_add(probe_obj, "latency_msec", json_object_new_double(probe->latency < 0 ? -1 : probe->latency * 1000));
+        json_object_object_add(probe_obj, "fail_cnt",     json_object_new_int(probe->fail_cnt));
+        json_object_object_add(probe_obj, "check_cnt",    json_object_new_int64(probe->check_cnt));
+        if (env->healths != NULL) {
+            na_health_t *health = &env->healths[i];
+            json_object_object_add(probe_obj, "admit",             json_object_new_int(na_health_admit(health)));
+            json_object_object_add(probe_obj, "error_rate",        json_object_new_double(health->error_rate));
+            json_object_object_add(probe_obj, "latency_ewma_msec", json_object_new_double(health->latency * 1000));
+            json_object_object_add(probe_obj, "eject_cnt",         json_object_new_int64(health->eject_cnt));
+        }
+        json_object_array_add(hc_obj, probe_obj);
+    }
+    return hc_obj;
+}
+
+static int na_hotkey_cmp(const void *a, const void *b)
+{
+    const na_hotkey_slot_t *x = a;
+    const na_hotkey_slot_t *y = b;
+
+    if (x->count != y->count) {
+        return x->count > y->count ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * the most requested keys of all workers in the current windows
+ */
+static struct json_object *na_hotkeys_array_json(na_env_t *env)
+{
+    struct json_object *hotkeys_obj;
+    na_hotkey_slot_t *slots;
+    double now;
+    int cnt, n;
+
+    hotkeys_obj = json_object_new_array();
+    if (env->hotkey_max == 0) {
+        return hotkeys_obj;
+    }
+    slots = (na_hotkey_slot_t *)malloc(sizeof(na_hotkey_slot_t) * env->hotkey_max * env->worker_max);
+    if (slots == NULL) {
+        return hotkeys_obj;
+    }
+
+    // a key counted by more than one worker is put together
+    now = ev_time();
+    cnt = 0;
+    for (int i=0;i<env->worker_max;++i) {
+        n = na_hotkey_snapshot(env->workers[i].hotkey, &slots[cnt], now);
+        for (int j=cnt;j<cnt+n;++j) {
+            int k;
+            for (k=0;k<cnt;++k) {
+                if (slots[k].key_len == slots[j].key_len && memcmp(slots[k].key, slots[j].key, slots[j].key_len) == 0) {
+                    break;
+                }
+            }
+            if (k < cnt) {
+                slots[k].count += slots[j].count;
+                slots[k].error += slots[j].error;
+                slots[k].bytes += slots[j].bytes;
+                slots[j].count  = 0;
+            }
+        }
+        n += cnt;
+        cnt = 0;
+        for (int j=0;j<n;++j) {
+            if (slots[j].count > 0) {
+                slots[cnt++] = slots[j];
+            }
+        }
+    }
+    qsort(slots, cnt, sizeof(na_hotkey_slot_t), na_hotkey_cmp);
+
+    for (int i=0;i<cnt && i<env->hotkey_max;++i) {
+        struct json_object *hotkey_obj;
+        hotkey_obj = json_object_new_object();
+        json_object_object_add(hotkey_obj, "key",   json_object_new_string(slots[i].key));
+        json_object_object_add(hotkey_obj, "count", json_object_new_int64(slots[i].count));
+        json_object_object_add(hotkey_obj, "error", json_object_new_int64(slots[i].error));
+        json_object_object_add(hotkey_obj, "bytes", json_object_new_int64(slots[i].bytes));
+        json_object_array_add(hotkeys_obj, hotkey_obj);
+    }
+    NA_FREE(slots);
+
+    return hotkeys_obj;
+}
+
 void na_stat_callback (EV_P_ struct ev_io *w, int revents)
 {
     int cfd, stfd, th_ret;
     int size;
     na_env_t *env;
-    char buf[NA_STAT_BUF_MAX + 1];
+    char *buf;
 
     th_ret = 0;
     stfd   = w->fd;
@@ -156,14 +456,20 @@ void na_stat_callback (EV_P_ struct ev_io *w, int revents)
         return;
     }
 
-    na_env_set_jbuf(buf, NA_STAT_BUF_MAX, env);
+    if ((buf = na_env_create_jbuf(env)) == NULL) {
+        NA_ERROR_OUTPUT_MESSAGE(env, NA_ERROR_OUTOF_MEMORY);
+        close(cfd);
+        return;
+    }
 
     // send statictics of environment to client
     if ((size = write(cfd, buf, strlen(buf))) < 0) {
         NA_ERROR_OUTPUT(env, "failed to return stat response");
+        NA_FREE(buf);
         close(cfd);
         return;
     }
 
+    NA_FREE(buf);
     close(cfd);
 }
@@ -0,0 +1,179 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * cost of taking a connection from na_connpool_t and putting it back against the
+ * fd_pool with marks under a mutex it replaced. threads share one pool of
+ * connected slots, and each op is an assign and a release of one of them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../connpool.c"
+#include "../socket.c"
+#include "../error.c"
+#include "../time.c"
+
+static const int NA_BENCH_OPS      = 2000000;
+static const int NA_BENCH_POOL_MAX = 20;
+
+/**
+ * the old pool. every slot is connected already, so taking one only marks it
+ */
+typedef struct na_mark_connpool_t {
+    int *fd_pool;
+    int *mark;
+    int max;
+    pthread_mutex_t lock;
+} na_mark_connpool_t;
+
+typedef struct na_bench_t {
+    void *pool;
+    bool is_mark;
+    int cnt; // ops of each thread
+    int miss_cnt;
+} na_bench_t;
+
+static bool na_mark_connpool_assign (na_mark_connpool_t *connpool, int *cur, int *fd)
+{
+    int ri;
+
+    pthread_mutex_lock(&connpool->lock);
+
+    ri = rand() % connpool->max;
+    if (connpool->mark[ri] == 0) {
+        connpool->mark[ri] = 1;
+        *fd  = connpool->fd_pool[ri];
+        *cur = ri;
+        pthread_mutex_unlock(&connpool->lock);
+        return true;
+    }
+
+    switch (rand() % 2) {
+    case 0:
+        for (int i=connpool->max-1;i>=0;--i) {
+            if (connpool->mark[i] == 0) {
+                connpool->mark[i] = 1;
+                *fd  = connpool->fd_pool[i];
+                *cur = i;
+                pthread_mutex_unlock(&connpool->lock);
+                return true;
+            }
+        }
+        break;
+    default:
+        for (int i=0;i<connpool->max;++i) {
+            if (connpool->mark[i] == 0) {
+                connpool->mark[i] = 1;
+                *fd  = connpool->fd_pool[i];
+                *cur = i;
+                pthread_mutex_unlock(&connpool->lock);
+                return true;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&connpool->lock);
+    return false;
+}
+
+static void na_mark_connpool_release (na_mark_connpool_t *connpool, int cur)
+{
+    pthread_mutex_lock(&connpool->lock);
+    connpool->mark[cur] = 0;
+    pthread_mutex_unlock(&connpool->lock);
+}
+
+static void *na_bench_worker (void *arg)
+{
+    na_bench_t *bench = arg;
+    na_server_t server;
+    int cur, fd, miss_cnt;
+
+    memset(&server, 0, sizeof(server));
+    miss_cnt = 0;
+    for (int i=0;i<bench->cnt;++i) {
+        if (bench->is_mark) {
+            while (!na_mark_connpool_assign(bench->pool, &cur, &fd)) {
+                ++miss_cnt;
+                sched_yield();
+            }
+            na_mark_connpool_release(bench->pool, cur);
+        } else {
+            while (!na_connpool_assign(NULL, bench->pool, &cur, &fd, &server, NA_MEMPROTO_PROTOCOL_NOT_DETECTED)) {
+                ++miss_cnt;
+                sched_yield();
+            }
+            na_connpool_release(bench->pool, cur);
+        }
+    }
+    __sync_add_and_fetch(&bench->miss_cnt, miss_cnt);
+
+    return NULL;
+}
+
+static double na_bench_run (void *pool, bool is_mark, int threads, int *miss_cnt)
+{
+    pthread_t th[threads];
+    na_bench_t bench;
+    struct timespec start, end;
+
+    bench.pool     = pool;
+    bench.is_mark  = is_mark;
+    bench.cnt      = NA_BENCH_OPS / threads;
+    bench.miss_cnt = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0;i<threads;++i) {
+        pthread_create(&th[i], NULL, na_bench_worker, &bench);
+    }
+    for (int i=0;i<threads;++i) {
+        pthread_join(th[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    *miss_cnt = bench.miss_cnt;
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (bench.cnt * threads);
+}
+
+int main (int argc, char *argv[])
+{
+    na_connpool_t connpool;
+    na_mark_connpool_t mcp;
+    int m_miss, s_miss;
+
+    mcp.fd_pool = calloc(sizeof(int), NA_BENCH_POOL_MAX);
+    mcp.mark    = calloc(sizeof(int), NA_BENCH_POOL_MAX);
+    mcp.max     = NA_BENCH_POOL_MAX;
+    pthread_mutex_init(&mcp.lock, NULL);
+
+    // every slot idle with a connection, which is never used
+    na_connpool_create(&connpool, NA_BENCH_POOL_MAX);
+    for (int i=0;i<NA_BENCH_POOL_MAX;++i) {
+        connpool.state[i] = NA_CONNPOOL_STATE_INUSE;
+        na_connpool_release(&connpool, i);
+    }
+    connpool.empty = na_connpool_pack(0, NA_CONNPOOL_NIL);
+
+    printf("%-8s %16s %16s %12s %12s\n", "threads", "mark(ns/op)", "stack(ns/op)", "mark miss", "stack miss");
+    for (int threads=1;threads<=8;threads*=2) {
+        double m = na_bench_run(&mcp, true, threads, &m_miss);
+        double s = na_bench_run(&connpool, false, threads, &s_miss);
+        printf("%-8d %16.1f %16.1f %12d %12d\n", threads, m, s, m_miss, s_miss);
+    }
+
+    na_connpool_destroy(&connpool);
+    pthread_mutex_destroy(&mcp.lock);
+    NA_FREE(mcp.fd_pool);
+    NA_FREE(mcp.mark);
+
+    return 0;
+}
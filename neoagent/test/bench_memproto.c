@@ -0,0 +1,112 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * parse throughput of memproto over pipelined requests and multi-get responses
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../memproto.c"
+#include "../scan.c"
+
+static const int NA_BENCH_ROUNDS = 200;
+static const int NA_BENCH_MSGS   = 10000;
+static const int NA_BENCH_VALUE  = 100;
+
+static double na_bench_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * frame every message in buf again and again, and print the throughput
+ */
+static void na_bench_run (const char *name, char *buf, int size, bool is_response, na_memproto_cmd_t cmd)
+{
+    na_memproto_parser_t parser;
+    na_memproto_parse_result_t result;
+    double start, sec;
+    long cnt;
+
+    cnt   = 0;
+    start = na_bench_now();
+    for (int r=0;r<NA_BENCH_ROUNDS;++r) {
+        na_memproto_parser_init(&parser);
+        parser.protocol = NA_MEMPROTO_PROTOCOL_TEXT;
+        while (true) {
+            result = is_response ? na_memproto_parse_response(&parser, cmd, buf, size) : na_memproto_parse_request(&parser, buf, size);
+            if (result != NA_MEMPROTO_PARSE_DONE) {
+                break;
+            }
+            ++cnt;
+        }
+        if (result == NA_MEMPROTO_PARSE_ERROR) {
+            fprintf(stderr, "%s: parse error\n", name);
+            exit(1);
+        }
+    }
+    sec = na_bench_now() - start;
+
+    printf("%-24s %10.1f ns/msg %10.1f MB/s\n", name, sec * 1e9 / cnt, (double)size * NA_BENCH_ROUNDS / sec / 1e6);
+}
+
+int main (int argc, char *argv[])
+{
+    char *buf, value[NA_BENCH_VALUE + 1];
+    int size, max;
+
+    na_scan_init();
+    printf("scan kernel: %s\n", na_scan_kernel_name());
+
+    memset(value, 'v', NA_BENCH_VALUE);
+    value[NA_BENCH_VALUE] = '\0';
+    max = NA_BENCH_MSGS * (NA_BENCH_VALUE + 64) * 11;
+    buf = malloc(max);
+
+    // gets and sets half and half
+    size = 0;
+    for (int i=0;i<NA_BENCH_MSGS;++i) {
+        if (i % 2 == 0) {
+            size += snprintf(buf + size, max - size, "get neoagent:key:%d\r\n", i);
+        } else {
+            size += snprintf(buf + size, max - size, "set neoagent:key:%d 0 0 %d\r\n%s\r\n", i, NA_BENCH_VALUE, value);
+        }
+    }
+    na_bench_run("get/set requests", buf, size, false, 0);
+
+    // multi-gets of 10 keys
+    size = 0;
+    for (int i=0;i<NA_BENCH_MSGS;++i) {
+        size += snprintf(buf + size, max - size, "get");
+        for (int j=0;j<10;++j) {
+            size += snprintf(buf + size, max - size, " neoagent:key:%d", i * 10 + j);
+        }
+        size += snprintf(buf + size, max - size, "\r\n");
+    }
+    na_bench_run("multi-get requests", buf, size, false, 0);
+
+    // responses to them with every key found
+    size = 0;
+    for (int i=0;i<NA_BENCH_MSGS;++i) {
+        for (int j=0;j<10;++j) {
+            size += snprintf(buf + size, max - size, "VALUE neoagent:key:%d 0 %d\r\n%s\r\n", i * 10 + j, NA_BENCH_VALUE, value);
+        }
+        size += snprintf(buf + size, max - size, "END\r\n");
+    }
+    na_bench_run("multi-get responses", buf, size, true, NA_MEMPROTO_CMD_GET);
+
+    free(buf);
+
+    return 0;
+}
@@ -0,0 +1,154 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * handoff cost of na_event_queue_t against the mutex queue it replaced.
+ * the same number of producers and consumers share one queue, and
+ * each handoff is a push and a pop of one client.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../queue.c"
+
+static const int NA_BENCH_HANDOFFS = 2000000;
+static const int NA_BENCH_QUEUE_MAX = 1024;
+
+typedef struct na_mutex_queue_t {
+    na_client_t **queue;
+    size_t top;
+    size_t bot;
+    size_t cnt;
+    size_t max;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} na_mutex_queue_t;
+
+typedef struct na_bench_t {
+    void *q;
+    bool is_mutex;
+    int cnt; // handoffs of each thread
+} na_bench_t;
+
+static bool na_mutex_queue_push(na_mutex_queue_t *q, na_client_t *e)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->cnt >= q->max) {
+        pthread_mutex_unlock(&q->lock);
+        return false;
+    }
+    q->queue[q->bot++] = e;
+    if (q->bot >= q->max) {
+        q->bot = 0;
+    }
+    ++q->cnt;
+    if (q->cnt == 1) {
+        pthread_cond_broadcast(&q->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return true;
+}
+
+static na_client_t *na_mutex_queue_pop(na_mutex_queue_t *q)
+{
+    na_client_t *c;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->cnt <= 0) {
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+    c = q->queue[q->top];
+    q->queue[q->top++] = NULL;
+    if (q->top >= q->max) {
+        q->top = 0;
+    }
+    --q->cnt;
+    pthread_mutex_unlock(&q->lock);
+    return c;
+}
+
+static void *na_bench_producer(void *arg)
+{
+    na_bench_t *bench = arg;
+    na_client_t *e    = (na_client_t *)bench;
+
+    for (int i=0;i<bench->cnt;++i) {
+        while (!(bench->is_mutex ? na_mutex_queue_push(bench->q, e) : na_event_queue_push(bench->q, e))) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static void *na_bench_consumer(void *arg)
+{
+    na_bench_t *bench = arg;
+
+    for (int i=0;i<bench->cnt;++i) {
+        while ((bench->is_mutex ? na_mutex_queue_pop(bench->q) : na_event_queue_pop(bench->q)) == NULL) {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static double na_bench_run(void *q, bool is_mutex, int threads)
+{
+    pthread_t th[threads * 2];
+    na_bench_t bench;
+    struct timespec start, end;
+
+    bench.q        = q;
+    bench.is_mutex = is_mutex;
+    bench.cnt      = NA_BENCH_HANDOFFS / threads;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0;i<threads;++i) {
+        pthread_create(&th[i],           NULL, na_bench_producer, &bench);
+        pthread_create(&th[threads + i], NULL, na_bench_consumer, &bench);
+    }
+    for (int i=0;i<threads * 2;++i) {
+        pthread_join(th[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (bench.cnt * threads);
+}
+
+int main(int argc, char *argv[])
+{
+    na_event_queue_t *q;
+    na_mutex_queue_t mq;
+
+    mq.queue = calloc(sizeof(na_client_t *), NA_BENCH_QUEUE_MAX);
+    mq.top   = 0;
+    mq.bot   = 0;
+    mq.cnt   = 0;
+    mq.max   = NA_BENCH_QUEUE_MAX;
+    pthread_mutex_init(&mq.lock, NULL);
+    pthread_cond_init(&mq.cond, NULL);
+    q = na_event_queue_create(NA_BENCH_QUEUE_MAX);
+
+    printf("%-8s %16s %16s\n", "threads", "mutex(ns/op)", "ring(ns/op)");
+    for (int threads=1;threads<=8;threads*=2) {
+        double m = na_bench_run(&mq, true, threads);
+        double r = na_bench_run(q, false, threads);
+        printf("%-8d %16.1f %16.1f\n", threads, m, r);
+    }
+
+    na_event_queue_destroy(q);
+    pthread_mutex_destroy(&mq.lock);
+    pthread_cond_destroy(&mq.cond);
+    NA_FREE(mq.queue);
+
+    return 0;
+}
@@ -0,0 +1,186 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * line terminator scanning of each scan kernel against the Boyer-Moore
+ * search (na_bm_search) it replaced. both find every line of the buffer.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../scan.c"
+
+static const int NA_BENCH_ROUNDS = 200;
+static const int NA_BENCH_MSGS   = 10000;
+
+static double na_bench_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void na_bm_create_table (char *pattern, int *skip, size_t skip_size)
+{
+    int len;
+
+    for (int i=0;i<skip_size;++i) {
+        skip[i] = 0;
+    }
+
+    len = strlen(pattern);
+    for (int i=0;i<len-1;++i) {
+        skip[(int)((unsigned char)*(pattern + i))] = len - i - 1;
+    }
+}
+
+static int na_bm_search (char *haystack, char *pattern, int *skip, int hlen, int plen)
+{
+    int i, c;
+
+    i = 0;
+    c = 0;
+
+ loop:
+    while (i + plen <= hlen) {
+
+        for (int j=plen-1;j>=0;--j) {
+            if (pattern[j] != haystack[i + j]) {
+                if (skip[(int)((unsigned char)haystack[i + j])] == 0) {
+                    if (j == plen - 1) {
+                        i += plen;
+                    } else {
+                        i += plen - j - 1;
+                    }
+                } else {
+                    int s = skip[(int)((unsigned char)haystack[i + j])] - (plen - 1 - j);
+                    if (s <= 0) {
+                        ++i;
+                    } else {
+                        i += s;
+                    }
+                }
+                goto loop;
+            }
+        }
+
+        if (skip[(int)((unsigned char)haystack[i + plen - 1])] != 0) {
+            i += skip[(int)((unsigned char)haystack[i + plen - 1])];
+        } else {
+            i += plen;
+        }
+
+        ++c;
+    }
+
+    return c;
+}
+
+static int na_bench_count_lf (char *(*kernel)(char *buf, size_t len), char *buf, int size)
+{
+    char *p, *end, *lf;
+    int c;
+
+    c   = 0;
+    p   = buf;
+    end = buf + size;
+    while ((lf = kernel(p, end - p)) != NULL) {
+        ++c;
+        p = lf + 1;
+    }
+    return c;
+}
+
+/**
+ * count the lines of buf again and again with each method, and print the throughput
+ */
+static void na_bench_run (const char *name, char *buf, int size)
+{
+    int skip[256];
+    double start, sec;
+    int lines, c;
+    struct {
+        const char *name;
+        char *(*kernel)(char *buf, size_t len);
+    } kernels[] = {
+        { "scalar", na_scan_lf_scalar },
+#ifdef NA_SCAN_USE_SIMD
+        { "sse2",   na_scan_lf_sse2   },
+        { "avx2",   na_scan_lf_avx2   },
+#endif
+    };
+
+    na_bm_create_table("\r\n", skip, 256);
+
+    lines = 0;
+    start = na_bench_now();
+    for (int r=0;r<NA_BENCH_ROUNDS;++r) {
+        lines = na_bm_search(buf, "\r\n", skip, size, 2);
+    }
+    sec = na_bench_now() - start;
+    printf("%-16s %-8s %10.1f MB/s (%d lines)\n", name, "bm", (double)size * NA_BENCH_ROUNDS / sec / 1e6, lines);
+
+    for (int i=0;i<sizeof(kernels)/sizeof(kernels[0]);++i) {
+#ifdef NA_SCAN_USE_SIMD
+        if (kernels[i].kernel == na_scan_lf_avx2 && !__builtin_cpu_supports("avx2")) {
+            continue;
+        }
+#endif
+        c     = 0;
+        start = na_bench_now();
+        for (int r=0;r<NA_BENCH_ROUNDS;++r) {
+            c = na_bench_count_lf(kernels[i].kernel, buf, size);
+        }
+        sec = na_bench_now() - start;
+        if (c != lines) {
+            fprintf(stderr, "%s: %s found %d lines, bm found %d\n", name, kernels[i].name, c, lines);
+            exit(1);
+        }
+        printf("%-16s %-8s %10.1f MB/s\n", name, kernels[i].name, (double)size * NA_BENCH_ROUNDS / sec / 1e6);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    char *buf;
+    int size, max;
+    int values[] = { 16, 100, 1000 };
+
+    na_scan_init();
+    max = NA_BENCH_MSGS * (1000 + 64);
+    buf = malloc(max);
+
+    // pipelined gets
+    size = 0;
+    for (int i=0;i<NA_BENCH_MSGS;++i) {
+        size += sprintf(buf + size, "get key:%08d\r\n", i);
+    }
+    na_bench_run("get requests", buf, size);
+
+    // multi-get responses with values of some sizes
+    for (int v=0;v<sizeof(values)/sizeof(values[0]);++v) {
+        char name[32];
+        size = 0;
+        for (int i=0;i<NA_BENCH_MSGS - 1;++i) {
+            size += sprintf(buf + size, "VALUE key:%08d 0 %d\r\n", i, values[v]);
+            memset(buf + size, 'v', values[v]);
+            size += values[v];
+            size += sprintf(buf + size, "\r\n");
+        }
+        size += sprintf(buf + size, "END\r\n");
+        snprintf(name, sizeof(name), "values %dB", values[v]);
+        na_bench_run(name, buf, size);
+    }
+
+    free(buf);
+
+    return 0;
+}
@@ -0,0 +1,296 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * L1 cache of responses to gets. keys of one shard are picked to see its
+ * CLOCK evict, with memory for NA_TEST_SHARD_ENTRIES entries in each shard.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cache.c"
+
+#define NA_TEST_ASSERT(cond) do {                                   \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++na_test_failed;                                       \
+        }                                                           \
+    } while (false)
+
+static int na_test_failed = 0;
+
+static const int NA_TEST_SHARD_ENTRIES = 3;
+static const int NA_TEST_KEY_LEN       = 6;
+static const int NA_TEST_VALUE_SIZE    = 100;
+
+static char na_test_value[100];
+static char *na_test_prefixes[] = { "l1:", "tmp:" };
+
+// private functions
+static na_cache_t *na_test_create (double ttl);
+static void na_test_keys (na_cache_t *cache, char keys[][8], int cnt);
+static bool na_test_set (na_cache_t *cache, const char *key, double now);
+static bool na_test_has (na_cache_t *cache, const char *key, double now);
+static void na_test_target (void);
+static void na_test_hit (void);
+static void na_test_ttl (void);
+static void na_test_clock (void);
+static void na_test_generation (void);
+static void na_test_write (void);
+
+static na_cache_t *na_test_create (double ttl)
+{
+    size_t esize;
+
+    esize = sizeof(na_cache_entry_t) + NA_TEST_KEY_LEN + NA_TEST_VALUE_SIZE;
+    return na_cache_create(esize * NA_TEST_SHARD_ENTRIES * NA_CACHE_SHARD_MAX, ttl, na_test_prefixes, 2);
+}
+
+/**
+ * keys of the same shard, "l1:000", "l1:001", ...
+ */
+static void na_test_keys (na_cache_t *cache, char keys[][8], int cnt)
+{
+    char key[8];
+    int n;
+
+    n = 0;
+    for (int i=0;n<cnt;++i) {
+        snprintf(key, sizeof(key), "l1:%03d", i % 1000);
+        if (na_cache_shard(cache, na_cache_hash(key, NA_TEST_KEY_LEN)) == &cache->shards[0]) {
+            strcpy(keys[n++], key);
+        }
+    }
+}
+
+/**
+ * store a response of key with the current generation, and whether it is stored.
+ * it is looked up without counting a hit
+ */
+static bool na_test_set (na_cache_t *cache, const char *key, double now)
+{
+    uint32_t gen, hash;
+
+    gen  = na_cache_generation(cache, key, strlen(key));
+    hash = na_cache_hash(key, strlen(key));
+    na_cache_set(cache, key, strlen(key), na_test_value, NA_TEST_VALUE_SIZE, gen, now);
+
+    return *na_cache_lookup(cache, na_cache_shard(cache, hash), key, strlen(key), hash) != NULL;
+}
+
+static bool na_test_has (na_cache_t *cache, const char *key, double now)
+{
+    char *buf;
+    size_t bufmax;
+    int size;
+
+    buf    = NULL;
+    bufmax = 0;
+    size   = na_cache_get(cache, key, strlen(key), now, &buf, &bufmax);
+    NA_TEST_ASSERT(size == -1 || (size == NA_TEST_VALUE_SIZE && memcmp(buf, na_test_value, size) == 0));
+    NA_FREE(buf);
+
+    return size >= 0;
+}
+
+static void na_test_target (void)
+{
+    na_cache_t *cache;
+
+    cache = na_test_create(1.);
+    NA_TEST_ASSERT(na_cache_is_target(cache, "l1:foo", 6));
+    NA_TEST_ASSERT(na_cache_is_target(cache, "tmp:", 4));
+    NA_TEST_ASSERT(!na_cache_is_target(cache, "l1", 2));
+    NA_TEST_ASSERT(!na_cache_is_target(cache, "l2:foo", 6));
+    NA_TEST_ASSERT(!na_cache_is_target(cache, "", 0));
+    na_cache_destroy(cache);
+}
+
+static void na_test_hit (void)
+{
+    na_cache_t *cache;
+    char *buf;
+    size_t bufmax, esize;
+
+    cache = na_test_create(1.);
+    esize = sizeof(na_cache_entry_t) + NA_TEST_KEY_LEN + NA_TEST_VALUE_SIZE;
+
+    NA_TEST_ASSERT(!na_test_has(cache, "l1:foo", 0.));
+    NA_TEST_ASSERT(na_test_set(cache, "l1:foo", 0.));
+    NA_TEST_ASSERT(na_cache_memory(cache) == esize);
+
+    // buf is grown for the response
+    buf    = malloc(1);
+    bufmax = 1;
+    NA_TEST_ASSERT(na_cache_get(cache, "l1:foo", 6, 0., &buf, &bufmax) == NA_TEST_VALUE_SIZE);
+    NA_TEST_ASSERT(bufmax >= NA_TEST_VALUE_SIZE);
+    NA_FREE(buf);
+
+    // a response again replaces the entry
+    NA_TEST_ASSERT(na_test_set(cache, "l1:foo", 0.));
+    NA_TEST_ASSERT(na_cache_entry_cnt(cache) == 1);
+    NA_TEST_ASSERT(na_cache_memory(cache) == esize);
+
+    NA_TEST_ASSERT(na_cache_hit_cnt(cache) == 1);
+    NA_TEST_ASSERT(na_cache_miss_cnt(cache) == 1);
+
+    // larger than the memory of a shard
+    na_cache_set(cache, "l1:big", 6, na_test_value, (int)esize * NA_TEST_SHARD_ENTRIES, na_cache_generation(cache, "l1:big", 6), 0.);
+    NA_TEST_ASSERT(!na_test_has(cache, "l1:big", 0.));
+
+    na_cache_destroy(cache);
+}
+
+static void na_test_ttl (void)
+{
+    na_cache_t *cache;
+
+    cache = na_test_create(1.);
+    NA_TEST_ASSERT(na_test_set(cache, "l1:foo", 100.));
+    NA_TEST_ASSERT(na_test_has(cache, "l1:foo", 100.5));
+    NA_TEST_ASSERT(!na_test_has(cache, "l1:foo", 101.));
+
+    // the entry expired is dropped when it is missed
+    NA_TEST_ASSERT(na_cache_entry_cnt(cache) == 0);
+    NA_TEST_ASSERT(na_cache_memory(cache) == 0);
+    na_cache_destroy(cache);
+}
+
+/**
+ * entries referenced since the hand passed them get another round, unless they have expired
+ */
+static void na_test_clock (void)
+{
+    na_cache_t *cache;
+    char keys[6][8];
+
+    cache = na_test_create(10.);
+    na_test_keys(cache, keys, 6);
+
+    for (int i=0;i<NA_TEST_SHARD_ENTRIES;++i) {
+        NA_TEST_ASSERT(na_test_set(cache, keys[i], 0.));
+    }
+    NA_TEST_ASSERT(na_cache_eviction_cnt(cache) == 0);
+
+    // the hand is at keys[0], which is referenced, so keys[1] goes
+    NA_TEST_ASSERT(na_test_has(cache, keys[0], 0.));
+    NA_TEST_ASSERT(na_test_set(cache, keys[3], 0.));
+    NA_TEST_ASSERT(na_cache_eviction_cnt(cache) == 1);
+    NA_TEST_ASSERT(na_test_has(cache, keys[0], 0.));
+    NA_TEST_ASSERT(!na_test_has(cache, keys[1], 0.));
+    NA_TEST_ASSERT(na_test_has(cache, keys[2], 0.));
+    NA_TEST_ASSERT(na_test_has(cache, keys[3], 0.));
+    NA_TEST_ASSERT(na_cache_entry_cnt(cache) == NA_TEST_SHARD_ENTRIES);
+
+    // every one is referenced now, so the hand goes round once and takes keys[2] after it
+    NA_TEST_ASSERT(na_test_set(cache, keys[4], 0.));
+    NA_TEST_ASSERT(na_cache_eviction_cnt(cache) == 2);
+    NA_TEST_ASSERT(!na_test_has(cache, keys[2], 0.));
+    NA_TEST_ASSERT(na_test_has(cache, keys[0], 0.));
+    NA_TEST_ASSERT(na_test_has(cache, keys[3], 0.));
+    NA_TEST_ASSERT(na_test_has(cache, keys[4], 0.));
+
+    // referenced but expired
+    NA_TEST_ASSERT(na_test_set(cache, keys[5], 20.));
+    NA_TEST_ASSERT(na_cache_eviction_cnt(cache) == 3);
+    NA_TEST_ASSERT(na_cache_entry_cnt(cache) == NA_TEST_SHARD_ENTRIES);
+
+    // no other shard has lost an entry
+    for (int i=1;i<cache->shard_cnt;++i) {
+        NA_TEST_ASSERT(cache->shards[i].eviction_cnt == 0);
+    }
+
+    na_cache_destroy(cache);
+}
+
+/**
+ * a response to a get sent before a write to its key is not stored
+ */
+static void na_test_generation (void)
+{
+    na_cache_t *cache;
+    uint32_t gen, hash;
+
+    cache = na_test_create(10.);
+
+    gen  = na_cache_generation(cache, "l1:foo", 6);
+    hash = na_cache_write_begin(cache, "l1:foo", 6);
+    na_cache_write_end(cache, hash);
+    na_cache_set(cache, "l1:foo", 6, na_test_value, NA_TEST_VALUE_SIZE, gen, 0.);
+    NA_TEST_ASSERT(!na_test_has(cache, "l1:foo", 0.));
+
+    // the generation after the write
+    NA_TEST_ASSERT(na_test_set(cache, "l1:foo", 0.));
+    NA_TEST_ASSERT(na_test_has(cache, "l1:foo", 0.));
+
+    // a write to another key of another bucket doesn't matter
+    gen  = na_cache_generation(cache, "l1:bar", 6);
+    hash = na_cache_write_begin(cache, "l1:baz", 6);
+    na_cache_write_end(cache, hash);
+    if (na_cache_hash("l1:bar", 6) % (cache->shard_cnt * cache->bucket_cnt) != hash % (cache->shard_cnt * cache->bucket_cnt)) {
+        na_cache_set(cache, "l1:bar", 6, na_test_value, NA_TEST_VALUE_SIZE, gen, 0.);
+        NA_TEST_ASSERT(na_test_has(cache, "l1:bar", 0.));
+    }
+
+    na_cache_destroy(cache);
+}
+
+/**
+ * while a write is on the way, its key is dropped and no get of it stores the response
+ */
+static void na_test_write (void)
+{
+    na_cache_t *cache;
+    uint32_t gen, hash, hash2;
+
+    cache = na_test_create(10.);
+    NA_TEST_ASSERT(na_test_set(cache, "l1:foo", 0.));
+
+    hash = na_cache_write_begin(cache, "l1:foo", 6);
+    NA_TEST_ASSERT(!na_test_has(cache, "l1:foo", 0.));
+
+    // a get sent during the write may read the old value, even though the write is answered before it
+    gen = na_cache_generation(cache, "l1:foo", 6);
+    NA_TEST_ASSERT(!na_test_set(cache, "l1:foo", 0.));
+    na_cache_write_end(cache, hash);
+    na_cache_set(cache, "l1:foo", 6, na_test_value, NA_TEST_VALUE_SIZE, gen, 0.);
+    NA_TEST_ASSERT(!na_test_has(cache, "l1:foo", 0.));
+
+    // writes overlap, and gets are stored after the last one only
+    hash  = na_cache_write_begin(cache, "l1:foo", 6);
+    hash2 = na_cache_write_begin(cache, "l1:foo", 6);
+    NA_TEST_ASSERT(hash == hash2);
+    na_cache_write_end(cache, hash);
+    NA_TEST_ASSERT(!na_test_set(cache, "l1:foo", 0.));
+    na_cache_write_end(cache, hash2);
+    NA_TEST_ASSERT(na_test_set(cache, "l1:foo", 0.));
+
+    na_cache_destroy(cache);
+}
+
+int main (int argc, char *argv[])
+{
+    memset(na_test_value, 'v', sizeof(na_test_value));
+
+    na_test_target();
+    na_test_hit();
+    na_test_ttl();
+    na_test_clock();
+    na_test_generation();
+    na_test_write();
+
+    if (na_test_failed > 0) {
+        printf("test_cache: %d failed\n", na_test_failed);
+        return 1;
+    }
+    printf("test_cache: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * table of gets in flight which identical gets are collapsed into.
+ * the tables of one bucket make every get collide.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../collapse.c"
+
+#define NA_TEST_ASSERT(cond) do {                                   \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++na_test_failed;                                       \
+        }                                                           \
+    } while (false)
+
+static int na_test_failed = 0;
+
+// private functions
+static void na_test_join (int bucket_cnt);
+static void na_test_invalidate (int bucket_cnt);
+static void na_test_remove (int bucket_cnt);
+
+/**
+ * a get finds the one of the same server and key in flight to join
+ */
+static void na_test_join (int bucket_cnt)
+{
+    na_collapse_t *collapse;
+    na_request_t a, b, c, d;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&c, 0, sizeof(c));
+    memset(&d, 0, sizeof(d));
+    collapse = na_collapse_create(bucket_cnt);
+
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == NULL);
+    NA_TEST_ASSERT(na_collapse_add(collapse, &a, 0, "foo", 3));
+    NA_TEST_ASSERT(a.collapse == collapse);
+    NA_TEST_ASSERT(collapse->cnt == 1);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == &a);
+
+    // the one in flight is joined instead
+    NA_TEST_ASSERT(!na_collapse_add(collapse, &b, 0, "foo", 3));
+    NA_TEST_ASSERT(b.collapse == NULL);
+    NA_TEST_ASSERT(collapse->cnt == 1);
+
+    // keys differ only in length, or the same key goes to another server
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "fo", 2) == NULL);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "fooo", 4) == NULL);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 1, "foo", 3) == NULL);
+    NA_TEST_ASSERT(na_collapse_add(collapse, &c, 1, "foo", 3));
+    NA_TEST_ASSERT(na_collapse_add(collapse, &d, 0, "bar", 3));
+    NA_TEST_ASSERT(collapse->cnt == 3);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == &a);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 1, "foo", 3) == &c);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "bar", 3) == &d);
+
+    // the key is copied, so the buffer it was read into can be reused
+    NA_TEST_ASSERT(a.key_len == 3 && memcmp(a.key, "foo", 3) == 0);
+
+    na_collapse_remove(&a);
+    na_collapse_remove(&c);
+    na_collapse_remove(&d);
+    NA_TEST_ASSERT(collapse->cnt == 0);
+    na_collapse_destroy(collapse);
+}
+
+/**
+ * after a write to the key, gets are forwarded again while the one invalidated keeps its key for its waiters
+ */
+static void na_test_invalidate (int bucket_cnt)
+{
+    na_collapse_t *collapse;
+    na_request_t a, b, c;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(&c, 0, sizeof(c));
+    collapse = na_collapse_create(bucket_cnt);
+
+    NA_TEST_ASSERT(na_collapse_add(collapse, &a, 0, "foo", 3));
+    NA_TEST_ASSERT(na_collapse_add(collapse, &c, 0, "bar", 3));
+
+    // no get of the key in flight, or of the key on another server
+    na_collapse_invalidate(collapse, 0, "baz", 3);
+    na_collapse_invalidate(collapse, 1, "foo", 3);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == &a);
+    NA_TEST_ASSERT(collapse->cnt == 2);
+
+    na_collapse_invalidate(collapse, 0, "foo", 3);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == NULL);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "bar", 3) == &c);
+    NA_TEST_ASSERT(a.collapse == NULL);
+    NA_TEST_ASSERT(a.key != NULL && a.key_len == 3 && memcmp(a.key, "foo", 3) == 0);
+    NA_TEST_ASSERT(collapse->cnt == 1);
+
+    // the get after the write leads the gets after it
+    NA_TEST_ASSERT(na_collapse_add(collapse, &b, 0, "foo", 3));
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == &b);
+
+    // the one invalidated is answered later, which doesn't unindex the new one
+    na_collapse_remove(&a);
+    NA_TEST_ASSERT(a.key == NULL);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == &b);
+    NA_TEST_ASSERT(collapse->cnt == 2);
+
+    na_collapse_remove(&b);
+    na_collapse_remove(&c);
+    NA_TEST_ASSERT(collapse->cnt == 0);
+    na_collapse_destroy(collapse);
+}
+
+/**
+ * a request removed twice, or never added, leaves the table as it is
+ */
+static void na_test_remove (int bucket_cnt)
+{
+    na_collapse_t *collapse;
+    na_request_t a, b;
+
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    collapse = na_collapse_create(bucket_cnt);
+
+    NA_TEST_ASSERT(na_collapse_add(collapse, &a, 0, "foo", 3));
+    na_collapse_remove(&b);
+    NA_TEST_ASSERT(collapse->cnt == 1);
+    na_collapse_remove(&a);
+    na_collapse_remove(&a);
+    NA_TEST_ASSERT(collapse->cnt == 0);
+    NA_TEST_ASSERT(na_collapse_find(collapse, 0, "foo", 3) == NULL);
+
+    na_collapse_destroy(collapse);
+}
+
+int main (int argc, char *argv[])
+{
+    int bucket_cnts[] = { 1, 1024 };
+
+    for (int i=0;i<sizeof(bucket_cnts)/sizeof(bucket_cnts[0]);++i) {
+        na_test_join(bucket_cnts[i]);
+        na_test_invalidate(bucket_cnts[i]);
+        na_test_remove(bucket_cnts[i]);
+    }
+
+    if (na_test_failed > 0) {
+        printf("test_collapse: %d failed\n", na_test_failed);
+        return 1;
+    }
+    printf("test_collapse: ok\n");
+
+    return 0;
+}
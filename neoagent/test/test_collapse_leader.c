@@ -0,0 +1,470 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * a client whose get is collapsed into the get of another client is still answered
+ * when that client goes away. neoagent given as the first argument is run in front of
+ * a tiny memcached in this program, which holds the first get of the key.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define NA_TEST_ASSERT(cond) do {                                   \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++na_test_failed;                                       \
+        }                                                           \
+    } while (false)
+
+#define NA_TEST_KEY       "collapse:leader"
+#define NA_TEST_CONN_MAX  32
+#define NA_TEST_BUF_MAX   4096
+#define NA_TEST_ITEM_MAX  8
+#define NA_TEST_WAIT_MSEC 5000
+
+#define NA_TEST_PORT_MIN     20000
+#define NA_TEST_PORT_MAX     32000
+#define NA_TEST_PORT_TRY_MAX 1000
+
+typedef struct na_test_conn_t {
+    int  fd;
+    char buf[NA_TEST_BUF_MAX];
+    int  size;
+} na_test_conn_t;
+
+typedef struct na_test_item_t {
+    char key[256];
+    char val[256];
+    int  len;
+} na_test_item_t;
+
+/**
+ * memcached enough for health checks and gets of NA_TEST_KEY.
+ * the first get of NA_TEST_KEY is never answered.
+ */
+typedef struct na_test_server_t {
+    int             fd;
+    int             port;
+    pthread_t       th;
+    pthread_mutex_t lock;
+    int             get_cnt;
+    na_test_conn_t  conns[NA_TEST_CONN_MAX];
+    na_test_item_t  items[NA_TEST_ITEM_MAX];
+} na_test_server_t;
+
+static int na_test_failed = 0;
+static int na_test_port   = 0;
+
+// private functions
+static int na_test_listen (int *port);
+static int na_test_connect (int port);
+static int na_test_get_cnt (na_test_server_t *server);
+static bool na_test_wait_get_cnt (na_test_server_t *server, int cnt);
+static int na_test_recv (int fd, char *buf, int bufsize, const char *end, int msec);
+static void na_test_sleep (int msec);
+static na_test_item_t *na_test_item (na_test_server_t *server, const char *key, bool is_create);
+static int na_test_process (na_test_server_t *server, na_test_conn_t *conn);
+static void *na_test_server_loop (void *arg);
+static pid_t na_test_spawn (const char *bin, const char *conf);
+
+static int na_test_listen (int *port)
+{
+    struct sockaddr_in addr;
+    int fd, on;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    // below the ephemeral ports, as neoagent takes the port of a server as int16_t
+    for (int i=0;i<NA_TEST_PORT_TRY_MAX;++i) {
+        na_test_port = na_test_port < NA_TEST_PORT_MIN || na_test_port >= NA_TEST_PORT_MAX ? NA_TEST_PORT_MIN + getpid() % (NA_TEST_PORT_MAX - NA_TEST_PORT_MIN) : na_test_port + 1;
+        addr.sin_port = htons(na_test_port);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(fd, 64) == 0) {
+            *port = na_test_port;
+            return fd;
+        }
+    }
+    close(fd);
+
+    return -1;
+}
+
+static int na_test_connect (int port)
+{
+    struct sockaddr_in addr;
+    int fd, on;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return fd;
+}
+
+static int na_test_get_cnt (na_test_server_t *server)
+{
+    int cnt;
+
+    pthread_mutex_lock(&server->lock);
+    cnt = server->get_cnt;
+    pthread_mutex_unlock(&server->lock);
+
+    return cnt;
+}
+
+static bool na_test_wait_get_cnt (na_test_server_t *server, int cnt)
+{
+    for (int i=0;i<NA_TEST_WAIT_MSEC / 10;++i) {
+        if (na_test_get_cnt(server) >= cnt) {
+            return true;
+        }
+        na_test_sleep(10);
+    }
+
+    return false;
+}
+
+/**
+ * read from fd until what is read ends with end, the peer closes or msec passes
+ */
+static int na_test_recv (int fd, char *buf, int bufsize, const char *end, int msec)
+{
+    struct pollfd pfd;
+    int size, n, elen;
+
+    size = 0;
+    elen = strlen(end);
+    buf[0] = '\0';
+    while (size < bufsize - 1) {
+        pfd.fd     = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, msec) <= 0) {
+            break;
+        }
+        n = read(fd, buf + size, bufsize - 1 - size);
+        if (n <= 0) {
+            break;
+        }
+        size      += n;
+        buf[size]  = '\0';
+        if (size >= elen && memcmp(buf + size - elen, end, elen) == 0) {
+            break;
+        }
+    }
+
+    return size;
+}
+
+static void na_test_sleep (int msec)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = msec / 1000;
+    ts.tv_nsec = (msec % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+static na_test_item_t *na_test_item (na_test_server_t *server, const char *key, bool is_create)
+{
+    na_test_item_t *free_item;
+
+    free_item = NULL;
+    for (int i=0;i<NA_TEST_ITEM_MAX;++i) {
+        if (server->items[i].key[0] == '\0') {
+            if (free_item == NULL) {
+                free_item = &server->items[i];
+            }
+        } else if (strcmp(server->items[i].key, key) == 0) {
+            return &server->items[i];
+        }
+    }
+    if (!is_create || free_item == NULL) {
+        return NULL;
+    }
+    snprintf(free_item->key, sizeof(free_item->key), "%s", key);
+
+    return free_item;
+}
+
+/**
+ * answer the commands read on conn so far. return -1 when conn should be closed.
+ */
+static int na_test_process (na_test_server_t *server, na_test_conn_t *conn)
+{
+    char out[NA_TEST_BUF_MAX], key[256];
+    char *lf;
+    int outsize, used, flags, exptime, len;
+    na_test_item_t *item;
+
+    outsize = 0;
+    used    = 0;
+    while ((lf = memchr(conn->buf + used, '\n', conn->size - used)) != NULL) {
+        char *line = conn->buf + used;
+        int linesize = lf - line + 1;
+
+        if (sscanf(line, "set %255s %d %d %d", key, &flags, &exptime, &len) == 4) {
+            if (conn->size - used < linesize + len + 2) {
+                break;
+            }
+            item = na_test_item(server, key, true);
+            if (item != NULL && len < sizeof(item->val)) {
+                memcpy(item->val, lf + 1, len);
+                item->len = len;
+            }
+            outsize += snprintf(out + outsize, sizeof(out) - outsize, "STORED\r\n");
+            used    += linesize + len + 2;
+            continue;
+        }
+
+        if (sscanf(line, "get %255s", key) == 1) {
+            if (strcmp(key, NA_TEST_KEY) == 0) {
+                pthread_mutex_lock(&server->lock);
+                ++server->get_cnt;
+                pthread_mutex_unlock(&server->lock);
+                if (na_test_get_cnt(server) == 1) {
+                    // held, so that the other get is collapsed into it
+                    used += linesize;
+                    continue;
+                }
+                outsize += snprintf(out + outsize, sizeof(out) - outsize, "VALUE %s 0 1\r\nv\r\nEND\r\n", key);
+            } else if ((item = na_test_item(server, key, false)) != NULL) {
+                outsize += snprintf(out + outsize, sizeof(out) - outsize, "VALUE %s 0 %d\r\n%.*s\r\nEND\r\n", key, item->len, item->len, item->val);
+            } else {
+                outsize += snprintf(out + outsize, sizeof(out) - outsize, "END\r\n");
+            }
+        } else if (sscanf(line, "delete %255s", key) == 1) {
+            item = na_test_item(server, key, false);
+            if (item != NULL) {
+                item->key[0] = '\0';
+            }
+            outsize += snprintf(out + outsize, sizeof(out) - outsize, item != NULL ? "DELETED\r\n" : "NOT_FOUND\r\n");
+        } else if (strncmp(line, "version", 7) == 0) {
+            outsize += snprintf(out + outsize, sizeof(out) - outsize, "VERSION 1.4.0\r\n");
+        } else {
+            outsize += snprintf(out + outsize, sizeof(out) - outsize, "ERROR\r\n");
+        }
+        used += linesize;
+    }
+
+    memmove(conn->buf, conn->buf + used, conn->size - used);
+    conn->size -= used;
+    if (conn->size == sizeof(conn->buf)) {
+        return -1;
+    }
+    if (outsize > 0 && write(conn->fd, out, outsize) != outsize) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void *na_test_server_loop (void *arg)
+{
+    na_test_server_t *server;
+    struct pollfd pfds[NA_TEST_CONN_MAX + 1];
+    int n, fd;
+
+    server = (na_test_server_t *)arg;
+    for (int i=0;i<NA_TEST_CONN_MAX;++i) {
+        server->conns[i].fd = -1;
+    }
+
+    while (true) {
+        pfds[0].fd     = server->fd;
+        pfds[0].events = POLLIN;
+        for (int i=0;i<NA_TEST_CONN_MAX;++i) {
+            pfds[i + 1].fd     = server->conns[i].fd;
+            pfds[i + 1].events = POLLIN;
+        }
+        if (poll(pfds, NA_TEST_CONN_MAX + 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return NULL;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            fd = accept(server->fd, NULL, NULL);
+            for (int i=0;fd >= 0 && i<NA_TEST_CONN_MAX;++i) {
+                if (server->conns[i].fd < 0) {
+                    server->conns[i].fd   = fd;
+                    server->conns[i].size = 0;
+                    fd                    = -1;
+                }
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+
+        for (int i=0;i<NA_TEST_CONN_MAX;++i) {
+            na_test_conn_t *conn = &server->conns[i];
+            if (conn->fd < 0 || pfds[i + 1].fd != conn->fd || pfds[i + 1].revents == 0) {
+                continue;
+            }
+            n = read(conn->fd, conn->buf + conn->size, sizeof(conn->buf) - conn->size);
+            if (n <= 0 || (conn->size += n, na_test_process(server, conn)) < 0) {
+                close(conn->fd);
+                conn->fd = -1;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static pid_t na_test_spawn (const char *bin, const char *conf)
+{
+    pid_t pid;
+
+    pid = fork();
+    if (pid == 0) {
+        execl(bin, bin, "-f", conf, (char *)NULL);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+int main (int argc, char *argv[])
+{
+    na_test_server_t server;
+    char conf[] = "/tmp/test_collapse_leader_XXXXXX";
+    char buf[NA_TEST_BUF_MAX];
+    struct linger linger;
+    int conf_fd, port, stport, fd, leader, waiter;
+    FILE *fp;
+    pid_t pid;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s neoagent\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    memset(&server, 0, sizeof(server));
+    pthread_mutex_init(&server.lock, NULL);
+    server.fd = na_test_listen(&server.port);
+    if (server.fd < 0) {
+        perror("listen");
+        return 1;
+    }
+    pthread_create(&server.th, NULL, na_test_server_loop, &server);
+
+    // ports for neoagent, free as of now
+    fd = na_test_listen(&port);
+    close(fd);
+    fd = na_test_listen(&stport);
+    close(fd);
+
+    conf_fd = mkstemp(conf);
+    fp      = fdopen(conf_fd, "w");
+    fprintf(fp,
+            "{\n"
+            "    \"ctl\" : { \"sockpath\" : \"%s_ctl.sock\" },\n"
+            "    \"environments\" : [\n"
+            "        {\n"
+            "            \"name\"               : \"test_collapse_leader\",\n"
+            "            \"port\"               : %d,\n"
+            "            \"target_server\"      : \"127.0.0.1:%d\",\n"
+            "            \"stport\"             : %d,\n"
+            "            \"worker_max\"         : 1,\n"
+            "            \"multiplex_conn_max\" : 0,\n"
+            "            \"get_collapse\"       : true\n"
+            "        }\n"
+            "    ]\n"
+            "}\n",
+            conf, port, server.port, stport);
+    fclose(fp);
+
+    pid = na_test_spawn(argv[1], conf);
+
+    leader = -1;
+    for (int i=0;leader < 0 && i<NA_TEST_WAIT_MSEC / 10;++i) {
+        leader = na_test_connect(port);
+        if (leader < 0) {
+            na_test_sleep(10);
+        }
+    }
+    NA_TEST_ASSERT(leader >= 0);
+
+    if (leader >= 0) {
+        NA_TEST_ASSERT(write(leader, "get " NA_TEST_KEY "\r\n", strlen(NA_TEST_KEY) + 6) > 0);
+        NA_TEST_ASSERT(na_test_wait_get_cnt(&server, 1));
+
+        // the same get of another client is collapsed into the one held
+        waiter = na_test_connect(port);
+        NA_TEST_ASSERT(waiter >= 0);
+        NA_TEST_ASSERT(write(waiter, "get " NA_TEST_KEY "\r\n", strlen(NA_TEST_KEY) + 6) > 0);
+        na_test_sleep(200);
+        NA_TEST_ASSERT(na_test_get_cnt(&server) == 1);
+
+        // the leader goes away by reset, as the responses on the way are still returned after a close
+        linger.l_onoff  = 1;
+        linger.l_linger = 0;
+        setsockopt(leader, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        close(leader);
+
+        // and the get of the waiter goes on by itself
+        na_test_recv(waiter, buf, sizeof(buf), "END\r\n", NA_TEST_WAIT_MSEC);
+        NA_TEST_ASSERT(strcmp(buf, "VALUE " NA_TEST_KEY " 0 1\r\nv\r\nEND\r\n") == 0);
+        NA_TEST_ASSERT(na_test_get_cnt(&server) == 2);
+
+        // and the client is still served
+        NA_TEST_ASSERT(write(waiter, "get " NA_TEST_KEY "\r\n", strlen(NA_TEST_KEY) + 6) > 0);
+        na_test_recv(waiter, buf, sizeof(buf), "END\r\n", NA_TEST_WAIT_MSEC);
+        NA_TEST_ASSERT(strcmp(buf, "VALUE " NA_TEST_KEY " 0 1\r\nv\r\nEND\r\n") == 0);
+        close(waiter);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    snprintf(buf, sizeof(buf), "%s_ctl.sock", conf);
+    unlink(buf);
+    unlink(conf);
+
+    if (na_test_failed > 0) {
+        printf("test_collapse_leader: %d failed\n", na_test_failed);
+        return 1;
+    }
+    printf("test_collapse_leader: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,189 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * health of servers from live traffic: EWMAs of error rate and latency which
+ * servers are ejected by, and the share of keys given back step by step.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "../health.c"
+
+#define NA_TEST_ASSERT(cond) do {                                   \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++na_test_failed;                                       \
+        }                                                           \
+    } while (false)
+
+static int na_test_failed = 0;
+
+static const int NA_TEST_MIN_REQUESTS = 10;
+
+// private functions
+static void na_test_round (na_health_t *health, int cnt, int err_cnt, double latency);
+static void na_test_evaluate (void);
+static void na_test_eject (void);
+static void na_test_readmit (void);
+static void na_test_first (void);
+
+/**
+ * cnt requests of which err_cnt fail, each answered in latency seconds
+ */
+static void na_test_round (na_health_t *health, int cnt, int err_cnt, double latency)
+{
+    for (int i=0;i<cnt;++i) {
+        na_health_count(health, i < err_cnt, latency);
+    }
+}
+
+static void na_test_evaluate (void)
+{
+    na_health_t *health;
+
+    health = na_health_create(1);
+    NA_TEST_ASSERT(na_health_admit(health) == NA_HEALTH_ADMIT_FULL);
+
+    // too few requests since the last time are left for the next
+    na_test_round(health, NA_TEST_MIN_REQUESTS - 1, NA_TEST_MIN_REQUESTS - 1, 0.01);
+    NA_TEST_ASSERT(!na_health_evaluate(health, NA_TEST_MIN_REQUESTS));
+    NA_TEST_ASSERT(health->error_rate == 0 && health->latency == 0);
+    na_test_round(health, 1, 1, 0.01);
+    NA_TEST_ASSERT(na_health_evaluate(health, NA_TEST_MIN_REQUESTS));
+    NA_TEST_ASSERT(fabs(health->error_rate - NA_HEALTH_EWMA_ALPHA) < 1e-9);
+    NA_TEST_ASSERT(fabs(health->latency - NA_HEALTH_EWMA_ALPHA * 0.01) < 1e-9);
+
+    // the counts folded are not folded again
+    NA_TEST_ASSERT(!na_health_evaluate(health, 1));
+
+    // a round without errors pulls the rate down by alpha
+    na_test_round(health, NA_TEST_MIN_REQUESTS, 0, 0.01);
+    NA_TEST_ASSERT(na_health_evaluate(health, NA_TEST_MIN_REQUESTS));
+    NA_TEST_ASSERT(fabs(health->error_rate - NA_HEALTH_EWMA_ALPHA * (1 - NA_HEALTH_EWMA_ALPHA)) < 1e-9);
+
+    NA_FREE(health);
+}
+
+/**
+ * a server failing for some rounds goes over the threshold, and one failing
+ * once in a while doesn't. the EWMAs of one ejected start again from zero
+ */
+static void na_test_eject (void)
+{
+    na_health_t *health;
+    double threshold;
+    int rounds;
+
+    health    = na_health_create(1);
+    threshold = 0.5;
+
+    // 1 of 10 fails
+    for (int i=0;i<100;++i) {
+        na_test_round(health, NA_TEST_MIN_REQUESTS, 1, 0.001);
+        na_health_evaluate(health, NA_TEST_MIN_REQUESTS);
+        NA_TEST_ASSERT(health->error_rate <= threshold);
+    }
+    NA_TEST_ASSERT(fabs(health->error_rate - 0.1) < 1e-3);
+
+    // every request fails from here on
+    rounds = 0;
+    while (health->error_rate <= threshold && rounds < 100) {
+        na_test_round(health, NA_TEST_MIN_REQUESTS, NA_TEST_MIN_REQUESTS, 0.001);
+        na_health_evaluate(health, NA_TEST_MIN_REQUESTS);
+        ++rounds;
+    }
+    // 0.1 + 0.9 * (1 - 0.7^n) > 0.5 first at n = 2
+    NA_TEST_ASSERT(rounds == 2);
+
+    na_health_eject(health);
+    NA_TEST_ASSERT(na_health_admit(health) == 0);
+    NA_TEST_ASSERT(health->error_rate == 0 && health->latency == 0);
+    NA_TEST_ASSERT(health->eject_cnt == 1);
+
+    // slow responses make latency go over the threshold in the same way
+    rounds = 0;
+    while (health->latency <= 0.05 && rounds < 100) {
+        na_test_round(health, NA_TEST_MIN_REQUESTS, 0, 0.1);
+        na_health_evaluate(health, NA_TEST_MIN_REQUESTS);
+        ++rounds;
+    }
+    // 0.1 * (1 - 0.7^n) > 0.05 first at n = 2
+    NA_TEST_ASSERT(rounds == 2);
+    NA_TEST_ASSERT(health->error_rate == 0);
+
+    NA_FREE(health);
+}
+
+/**
+ * each probe passed gives back 1/steps of keys, up to all of them
+ */
+static void na_test_readmit (void)
+{
+    na_health_t *health;
+    int admits[] = { 34, 68, 100, 100 };
+
+    health = na_health_create(1);
+    na_health_eject(health);
+    for (int i=0;i<sizeof(admits)/sizeof(admits[0]);++i) {
+        na_health_readmit(health, 3);
+        NA_TEST_ASSERT(na_health_admit(health) == admits[i]);
+    }
+
+    na_health_eject(health);
+    na_health_readmit(health, 1);
+    NA_TEST_ASSERT(na_health_admit(health) == NA_HEALTH_ADMIT_FULL);
+
+    // more steps than the share has
+    na_health_eject(health);
+    for (int i=0;i<NA_HEALTH_ADMIT_FULL;++i) {
+        na_health_readmit(health, NA_HEALTH_ADMIT_FULL * 2);
+        NA_TEST_ASSERT(na_health_admit(health) == i + 1);
+    }
+
+    NA_FREE(health);
+}
+
+/**
+ * commands without key go to the first server which gets keys
+ */
+static void na_test_first (void)
+{
+    na_health_t *healths;
+
+    healths = na_health_create(3);
+    NA_TEST_ASSERT(na_health_first(healths, 3) == 0);
+    na_health_eject(&healths[0]);
+    NA_TEST_ASSERT(na_health_first(healths, 3) == 1);
+    na_health_eject(&healths[1]);
+    na_health_readmit(&healths[0], 4);
+    NA_TEST_ASSERT(na_health_first(healths, 3) == 0);
+    na_health_eject(&healths[0]);
+    na_health_eject(&healths[2]);
+    NA_TEST_ASSERT(na_health_first(healths, 3) == 0);
+
+    NA_FREE(healths);
+}
+
+int main (int argc, char *argv[])
+{
+    na_test_evaluate();
+    na_test_eject();
+    na_test_readmit();
+    na_test_first();
+
+    if (na_test_failed > 0) {
+        printf("test_health: %d failed\n", na_test_failed);
+        return 1;
+    }
+    printf("test_health: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,267 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * counting of the most requested keys by Space-Saving. after each step the
+ * buckets are walked to see every slot is in the one of its count, and every
+ * bucket is either in use or free.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../hotkey.c"
+
+#define NA_TEST_ASSERT(cond) do {                                   \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++na_test_failed;                                       \
+        }                                                           \
+    } while (false)
+
+static int na_test_failed = 0;
+
+static const int NA_TEST_KEYS     = 1000;
+static const int NA_TEST_REQUESTS = 100000;
+
+// private functions
+static na_hotkey_slot_t *na_test_count (na_hotkey_t *hotkey, const char *key, uint32_t *gen);
+static void na_test_check (na_hotkey_t *hotkey);
+static void na_test_exact (void);
+static void na_test_long_key (void);
+static void na_test_error (void);
+static void na_test_replace (void);
+static void na_test_window (void);
+
+static na_hotkey_slot_t *na_test_count (na_hotkey_t *hotkey, const char *key, uint32_t *gen)
+{
+    return na_hotkey_count(hotkey, key, strlen(key), 0., gen);
+}
+
+/**
+ * buckets in order of count hold every slot in use once, and the others are free
+ */
+static void na_test_check (na_hotkey_t *hotkey)
+{
+    uint64_t last;
+    int slots, buckets, free_buckets;
+
+    last    = 0;
+    slots   = 0;
+    buckets = 0;
+    for (int b=hotkey->bucket_min;b!=-1;b=hotkey->buckets[b].next) {
+        NA_TEST_ASSERT(hotkey->buckets[b].count > last);
+        NA_TEST_ASSERT(hotkey->buckets[b].head != -1);
+        last = hotkey->buckets[b].count;
+        for (int i=hotkey->buckets[b].head;i!=-1;i=hotkey->nodes[i].next) {
+            NA_TEST_ASSERT(hotkey->nodes[i].bucket == b);
+            NA_TEST_ASSERT(hotkey->slots[i].count == hotkey->buckets[b].count);
+            NA_TEST_ASSERT(na_hotkey_find(hotkey, hotkey->slots[i].key, hotkey->slots[i].key_len, hotkey->slots[i].hash) == i);
+            ++slots;
+        }
+        ++buckets;
+    }
+    free_buckets = 0;
+    for (int b=hotkey->bucket_free;b!=-1;b=hotkey->buckets[b].next) {
+        ++free_buckets;
+    }
+    NA_TEST_ASSERT(slots == hotkey->slot_cnt);
+    NA_TEST_ASSERT(buckets + free_buckets == hotkey->slot_max);
+}
+
+/**
+ * as many slots as keys count every request
+ */
+static void na_test_exact (void)
+{
+    na_hotkey_t *hotkey;
+    na_hotkey_slot_t snapshot[8];
+    char key[16];
+    uint32_t gen;
+    int n;
+
+    hotkey = na_hotkey_create(8, 0);
+    for (int i=0;i<8;++i) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        for (int j=0;j<=i;++j) {
+            na_test_count(hotkey, key, &gen);
+        }
+    }
+    na_test_check(hotkey);
+
+    n = na_hotkey_snapshot(hotkey, snapshot, 0.);
+    NA_TEST_ASSERT(n == 8);
+    for (int i=0;i<n;++i) {
+        NA_TEST_ASSERT(snapshot[i].error == 0);
+        NA_TEST_ASSERT(snapshot[i].count == (uint64_t)atoi(snapshot[i].key + 4) + 1);
+    }
+
+    na_hotkey_destroy(hotkey);
+}
+
+/**
+ * a key longer than a slot is counted by its head
+ */
+static void na_test_long_key (void)
+{
+    na_hotkey_t *hotkey;
+    na_hotkey_slot_t *a, *b;
+    char key[NA_HOTKEY_KEY_MAX + 10];
+    uint32_t gen;
+
+    hotkey = na_hotkey_create(8, 0);
+    memset(key, 'k', sizeof(key));
+    a = na_hotkey_count(hotkey, key, sizeof(key), 0., &gen);
+    b = na_hotkey_count(hotkey, key, NA_HOTKEY_KEY_MAX, 0., &gen);
+    NA_TEST_ASSERT(a == b);
+    NA_TEST_ASSERT(a->key_len == NA_HOTKEY_KEY_MAX && a->count == 2);
+    na_hotkey_destroy(hotkey);
+}
+
+/**
+ * counts are never under and over by error at most, and a key requested more than
+ * requests / slots times is never lost
+ */
+static void na_test_error (void)
+{
+    na_hotkey_t *hotkey;
+    na_hotkey_slot_t *slot;
+    char key[16];
+    uint64_t *counts, total;
+    uint32_t gen, seed;
+    int k, slot_max;
+
+    slot_max = 32;
+    hotkey   = na_hotkey_create(slot_max, 0);
+    counts   = calloc(sizeof(uint64_t), NA_TEST_KEYS);
+
+    // a skewed stream, in which key:0 is the most requested
+    seed = 1;
+    for (int i=0;i<NA_TEST_REQUESTS;++i) {
+        seed = seed * 1103515245 + 12345;
+        k    = NA_TEST_KEYS / (1 + (seed >> 16) % NA_TEST_KEYS) - 1;
+        snprintf(key, sizeof(key), "key:%d", k);
+        na_test_count(hotkey, key, &gen);
+        ++counts[k];
+        if (i % 1000 == 0) {
+            na_test_check(hotkey);
+        }
+    }
+    na_test_check(hotkey);
+    NA_TEST_ASSERT(hotkey->slot_cnt == slot_max);
+
+    total = 0;
+    for (int i=0;i<slot_max;++i) {
+        slot = &hotkey->slots[i];
+        k    = atoi(slot->key + 4);
+        NA_TEST_ASSERT(slot->count >= counts[k]);
+        NA_TEST_ASSERT(slot->count - slot->error <= counts[k]);
+        NA_TEST_ASSERT(slot->error <= NA_TEST_REQUESTS / slot_max);
+        total += slot->count;
+    }
+    // every request is on one of the slots
+    NA_TEST_ASSERT(total == NA_TEST_REQUESTS);
+
+    for (int i=0;i<NA_TEST_KEYS;++i) {
+        if (counts[i] > NA_TEST_REQUESTS / slot_max) {
+            snprintf(key, sizeof(key), "key:%d", i);
+            NA_TEST_ASSERT(na_hotkey_find(hotkey, key, strlen(key), na_hotkey_hash(key, strlen(key))) != -1);
+        }
+    }
+
+    NA_FREE(counts);
+    na_hotkey_destroy(hotkey);
+}
+
+/**
+ * a new key takes over the slot of the fewest count. the bucket freed by it is reused,
+ * and the bytes of a response to the key before are not added
+ */
+static void na_test_replace (void)
+{
+    na_hotkey_t *hotkey;
+    na_hotkey_slot_t *a, *b, *c;
+    char key[16];
+    uint32_t agen, bgen, cgen;
+
+    hotkey = na_hotkey_create(2, 0);
+    a = na_test_count(hotkey, "a", &agen);
+    na_test_count(hotkey, "a", &agen);
+    b = na_test_count(hotkey, "b", &bgen);
+    na_test_check(hotkey);
+
+    // c takes the slot of b with the count of b as its error
+    c = na_test_count(hotkey, "c", &cgen);
+    NA_TEST_ASSERT(c == b);
+    NA_TEST_ASSERT(cgen != bgen);
+    NA_TEST_ASSERT(c->count == 2 && c->error == 1);
+    NA_TEST_ASSERT(strcmp(c->key, "c") == 0);
+    NA_TEST_ASSERT(na_hotkey_find(hotkey, "b", 1, na_hotkey_hash("b", 1)) == -1);
+    na_test_check(hotkey);
+
+    na_hotkey_add_bytes(b, bgen, 100);
+    NA_TEST_ASSERT(c->bytes == 0);
+    na_hotkey_add_bytes(c, cgen, 10);
+    na_hotkey_add_bytes(a, agen, 20);
+    NA_TEST_ASSERT(c->bytes == 10 && a->bytes == 20);
+
+    // slots take over each other again and again, which runs out of buckets unless they are reused
+    for (int i=0;i<NA_TEST_KEYS;++i) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        na_test_count(hotkey, key, &cgen);
+        na_test_check(hotkey);
+    }
+    NA_TEST_ASSERT(hotkey->slot_cnt == 2);
+
+    na_hotkey_destroy(hotkey);
+}
+
+/**
+ * counts start again from zero in the next window
+ */
+static void na_test_window (void)
+{
+    na_hotkey_t *hotkey;
+    na_hotkey_slot_t snapshot[4], *slot;
+    uint32_t gen, gen2;
+
+    hotkey = na_hotkey_create(4, 10.);
+    slot = na_hotkey_count(hotkey, "a", 1, 100., &gen);
+    na_hotkey_count(hotkey, "a", 1, 105., &gen);
+    NA_TEST_ASSERT(slot->count == 2);
+    NA_TEST_ASSERT(na_hotkey_snapshot(hotkey, snapshot, 105.) == 1);
+
+    // the window is over before a request resets it
+    NA_TEST_ASSERT(na_hotkey_snapshot(hotkey, snapshot, 110.) == 0);
+
+    slot = na_hotkey_count(hotkey, "a", 1, 110., &gen2);
+    NA_TEST_ASSERT(slot->count == 1 && slot->error == 0);
+    NA_TEST_ASSERT(gen2 != gen);
+    NA_TEST_ASSERT(na_hotkey_snapshot(hotkey, snapshot, 110.) == 1);
+    na_test_check(hotkey);
+
+    na_hotkey_destroy(hotkey);
+}
+
+int main (int argc, char *argv[])
+{
+    na_test_exact();
+    na_test_long_key();
+    na_test_error();
+    na_test_replace();
+    na_test_window();
+
+    if (na_test_failed > 0) {
+        printf("test_hotkey: %d failed\n", na_test_failed);
+        return 1;
+    }
+    printf("test_hotkey: ok\n");
+
+    return 0;
+}
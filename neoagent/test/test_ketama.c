@@ -0,0 +1,247 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * routing of keys by ketama. the servers and keys of the reference vectors are
+ * routed as libketama does: its float share of weight for the number of points
+ * and its search of the continuum.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ketama.c"
+#include "../health.c"
+#include "../ext/md5.c"
+
+#define NA_TEST_ASSERT(cond) do {                                   \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++na_test_failed;                                       \
+        }                                                           \
+    } while (false)
+
+static int na_test_failed = 0;
+
+static const int NA_TEST_KEYS = 1000;
+
+typedef struct na_test_vector_t {
+    const char *key;
+    int server;
+} na_test_vector_t;
+
+// private functions
+static void na_test_servers (na_server_t *servers, int cnt, const int *weights);
+static int na_test_lookup (na_ketama_t *ketama, const char *key, na_health_t *healths);
+static void na_test_reference (void);
+static void na_test_equal (void);
+static void na_test_leave (void);
+static void na_test_eject (void);
+
+/**
+ * 10.0.1.1:11211, 10.0.1.2:11211, ... with weights
+ */
+static void na_test_servers (na_server_t *servers, int cnt, const int *weights)
+{
+    memset(servers, 0, sizeof(na_server_t) * cnt);
+    for (int i=0;i<cnt;++i) {
+        snprintf(servers[i].host.ipaddr, sizeof(servers[i].host.ipaddr), "10.0.1.%d", i + 1);
+        servers[i].host.port = 11211;
+        servers[i].weight    = weights[i];
+    }
+}
+
+static int na_test_lookup (na_ketama_t *ketama, const char *key, na_health_t *healths)
+{
+    return na_ketama_lookup(ketama, key, strlen(key), healths);
+}
+
+static void na_test_reference (void)
+{
+    na_server_t servers[8];
+    na_ketama_t *ketama;
+    char key[251];
+    const int weights[] = { 600, 300, 200, 350, 1000, 800, 950, 100 };
+    const na_test_vector_t vectors[] = {
+        { "foo",            6 },
+        { "bar",            5 },
+        { "hello",          6 },
+        { "neoagent",       6 },
+        { "key:1",          4 },
+        { "key:2",          4 },
+        { "key:3",          6 },
+        { "user:42",        6 },
+        { "session:abcdef", 1 },
+        { "12345",          4 },
+        { "",               3 },
+    };
+
+    na_test_servers(servers, 8, weights);
+    ketama = na_ketama_create(servers, 8);
+    NA_TEST_ASSERT(ketama != NULL);
+    NA_TEST_ASSERT(ketama->point_cnt == 1264);
+
+    for (int i=0;i<sizeof(vectors)/sizeof(vectors[0]);++i) {
+        if (na_test_lookup(ketama, vectors[i].key, NULL) != vectors[i].server) {
+            fprintf(stderr, "key \"%s\" went to %d\n", vectors[i].key, na_test_lookup(ketama, vectors[i].key, NULL));
+            ++na_test_failed;
+        }
+    }
+
+    // the longest key of memcached
+    memset(key, 'a', 250);
+    key[250] = '\0';
+    NA_TEST_ASSERT(na_test_lookup(ketama, key, NULL) == 5);
+
+    // libketama reads the hash from the first 4 bytes of MD5 in little endian
+    NA_TEST_ASSERT(na_ketama_key_hash("foo", 3) == 0xdb18bdac);
+    NA_TEST_ASSERT(na_ketama_key_hash("neoagent", 8) == 0x0dc12424);
+
+    na_ketama_destroy(ketama);
+}
+
+static void na_test_equal (void)
+{
+    na_server_t servers[3];
+    na_ketama_t *ketama;
+    const int weights[] = { 1, 1, 1 };
+    const na_test_vector_t vectors[] = {
+        { "foo",            1 },
+        { "bar",            0 },
+        { "hello",          2 },
+        { "neoagent",       1 },
+        { "key:1",          2 },
+        { "key:2",          1 },
+        { "key:3",          2 },
+        { "user:42",        0 },
+        { "session:abcdef", 1 },
+        { "12345",          2 },
+    };
+
+    na_test_servers(servers, 3, weights);
+    ketama = na_ketama_create(servers, 3);
+    NA_TEST_ASSERT(ketama->point_cnt == 480);
+    for (int i=0;i<sizeof(vectors)/sizeof(vectors[0]);++i) {
+        if (na_test_lookup(ketama, vectors[i].key, NULL) != vectors[i].server) {
+            fprintf(stderr, "key \"%s\" went to %d\n", vectors[i].key, na_test_lookup(ketama, vectors[i].key, NULL));
+            ++na_test_failed;
+        }
+    }
+    na_ketama_destroy(ketama);
+
+    // every server has no point
+    for (int i=0;i<3;++i) {
+        servers[i].weight = 0;
+    }
+    ketama = na_ketama_create(servers, 3);
+    NA_TEST_ASSERT(ketama->point_cnt == 0);
+    NA_TEST_ASSERT(na_test_lookup(ketama, "foo", NULL) == -1);
+    na_ketama_destroy(ketama);
+}
+
+/**
+ * a server of weight 0 leaves the continuum, and only the keys it had move
+ */
+static void na_test_leave (void)
+{
+    na_server_t servers[3];
+    na_ketama_t *all, *left;
+    char key[32];
+    int from, to, moved;
+    const int weights[] = { 1, 1, 1 };
+
+    na_test_servers(servers, 3, weights);
+    all = na_ketama_create(servers, 3);
+    servers[2].weight = 0;
+    left = na_ketama_create(servers, 3);
+
+    moved = 0;
+    for (int i=0;i<NA_TEST_KEYS;++i) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        from = na_test_lookup(all, key, NULL);
+        to   = na_test_lookup(left, key, NULL);
+        NA_TEST_ASSERT(to != 2);
+        if (from != 2) {
+            NA_TEST_ASSERT(from == to);
+        } else {
+            ++moved;
+        }
+    }
+    // about a third of keys
+    NA_TEST_ASSERT(moved > NA_TEST_KEYS / 5 && moved < NA_TEST_KEYS / 2);
+
+    na_ketama_destroy(all);
+    na_ketama_destroy(left);
+}
+
+/**
+ * keys of an ejected server go on along the continuum, and come back in order of their hash
+ */
+static void na_test_eject (void)
+{
+    na_server_t servers[3];
+    na_ketama_t *ketama;
+    na_health_t *healths;
+    char key[32];
+    int server, routed;
+    const int weights[] = { 1, 1, 1 };
+
+    na_test_servers(servers, 3, weights);
+    ketama  = na_ketama_create(servers, 3);
+    healths = na_health_create(3);
+
+    // all admitted is the same as no healths
+    for (int i=0;i<NA_TEST_KEYS;++i) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        NA_TEST_ASSERT(na_test_lookup(ketama, key, healths) == na_test_lookup(ketama, key, NULL));
+    }
+
+    na_health_eject(&healths[1]);
+    for (int i=0;i<NA_TEST_KEYS;++i) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        server = na_test_lookup(ketama, key, NULL);
+        routed = na_test_lookup(ketama, key, healths);
+        NA_TEST_ASSERT(routed != 1);
+        if (server != 1) {
+            NA_TEST_ASSERT(routed == server);
+        }
+    }
+
+    na_health_readmit(&healths[1], 4);
+    NA_TEST_ASSERT(na_health_admit(&healths[1]) == NA_HEALTH_ADMIT_FULL / 4);
+    for (int i=0;i<NA_TEST_KEYS;++i) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        server = na_test_lookup(ketama, key, NULL);
+        routed = na_test_lookup(ketama, key, healths);
+        if (server == 1) {
+            NA_TEST_ASSERT((routed == 1) == (na_ketama_key_hash(key, strlen(key)) % NA_HEALTH_ADMIT_FULL < NA_HEALTH_ADMIT_FULL / 4));
+        } else {
+            NA_TEST_ASSERT(routed == server);
+        }
+    }
+
+    NA_FREE(healths);
+    na_ketama_destroy(ketama);
+}
+
+int main (int argc, char *argv[])
+{
+    na_test_reference();
+    na_test_equal();
+    na_test_leave();
+    na_test_eject();
+
+    if (na_test_failed > 0) {
+        printf("test_ketama: %d failed\n", na_test_failed);
+        return 1;
+    }
+    printf("test_ketama: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,386 @@
+/**
+ *  Copyright (c) 2013 Tatsuhiko Kubo <cubicdaiya@gmail.com>
+ *
+ *  Use and distribution licensed under the BSD license.
+ *  See the COPYING file for full text.
+ *
+ */
+
+/**
+ * framing of requests and responses by memproto. every message is also fed
+ * cut at each byte offset, as it comes in more than one read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../memproto.c"
+#include "../scan.c"
+
+#define NA_TEST_ASSERT(cond) do {                                   \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            ++na_test_failed;                                       \
+        }                                                           \
+    } while (false)
+
+static int na_test_failed = 0;
+
+// private functions
+static na_memproto_parse_result_t na_test_parse (na_memproto_parser_t *parser, bool is_response, na_memproto_cmd_t cmd, char *buf, int bufsize);
+static void na_test_frame_split (const char *msg, int len, bool is_response, na_memproto_cmd_t cmd, na_memproto_parser_t *framed);
+static void na_test_error (const char *msg, int len, bool is_response, na_memproto_cmd_t cmd);
+static int na_test_binary (char *buf, uint8_t magic, uint8_t opcode, const char *key, int extlen, const char *value);
+
+static na_memproto_parse_result_t na_test_parse (na_memproto_parser_t *parser, bool is_response, na_memproto_cmd_t cmd, char *buf, int bufsize)
+{
+    if (is_response) {
+        return na_memproto_parse_response(parser, cmd, buf, bufsize);
+    }
+    return na_memproto_parse_request(parser, buf, bufsize);
+}
+
+/**
+ * msg must be framed as one message at the end and not before, wherever it is cut.
+ * the parser of the last try is stored into framed
+ */
+static void na_test_frame_split (const char *msg, int len, bool is_response, na_memproto_cmd_t cmd, na_memproto_parser_t *framed)
+{
+    na_memproto_parser_t parser;
+    na_memproto_parse_result_t result;
+    char *buf;
+
+    buf = malloc(len + 1);
+    memcpy(buf, msg, len);
+    buf[len] = '\0';
+
+    for (int cut=0;cut<len;++cut) {
+        na_memproto_parser_init(&parser);
+        if (is_response) {
+            parser.protocol = cmd == NA_MEMPROTO_CMD_BINARY ? NA_MEMPROTO_PROTOCOL_BINARY : NA_MEMPROTO_PROTOCOL_TEXT;
+        }
+        if (cut > 0) {
+            NA_TEST_ASSERT(na_test_parse(&parser, is_response, cmd, buf, cut) == NA_MEMPROTO_PARSE_AGAIN);
+        }
+        result = na_test_parse(&parser, is_response, cmd, buf, len);
+        NA_TEST_ASSERT(result == NA_MEMPROTO_PARSE_DONE);
+        NA_TEST_ASSERT(parser.start == 0);
+        NA_TEST_ASSERT(parser.off == len);
+    }
+
+    // a byte at a time
+    na_memproto_parser_init(&parser);
+    for (int size=1;size<=len;++size) {
+        result = na_test_parse(&parser, is_response, cmd, buf, size);
+        NA_TEST_ASSERT(result == (size == len ? NA_MEMPROTO_PARSE_DONE : NA_MEMPROTO_PARSE_AGAIN));
+    }
+
+    if (framed != NULL) {
+        memcpy(framed, &parser, sizeof(parser));
+    }
+    free(buf);
+}
+
+static void na_test_error (const char *msg, int len, bool is_response, na_memproto_cmd_t cmd)
+{
+    na_memproto_parser_t parser;
+
+    na_memproto_parser_init(&parser);
+    NA_TEST_ASSERT(na_test_parse(&parser, is_response, cmd, (char *)msg, len) == NA_MEMPROTO_PARSE_ERROR);
+}
+
+/**
+ * put a binary protocol message into buf and return its size
+ */
+static int na_test_binary (char *buf, uint8_t magic, uint8_t opcode, const char *key, int extlen, const char *value)
+{
+    int keylen, bodylen;
+
+    keylen  = strlen(key);
+    bodylen = extlen + keylen + strlen(value);
+    memset(buf, 0, NA_MEMPROTO_BINARY_HEADER_SIZE + extlen);
+    buf[0]  = magic;
+    buf[1]  = opcode;
+    buf[2]  = keylen >> 8;
+    buf[3]  = keylen & 0xff;
+    buf[4]  = extlen;
+    buf[8]  = bodylen >> 24;
+    buf[9]  = (bodylen >> 16) & 0xff;
+    buf[10] = (bodylen >> 8) & 0xff;
+    buf[11] = bodylen & 0xff;
+    memcpy(buf + NA_MEMPROTO_BINARY_HEADER_SIZE + extlen, key, keylen);
+    memcpy(buf + NA_MEMPROTO_BINARY_HEADER_SIZE + extlen + keylen, value, strlen(value));
+
+    return NA_MEMPROTO_BINARY_HEADER_SIZE + bodylen;
+}
+
+static void na_test_text_request (void)
+{
+    na_memproto_parser_t parser;
+    const char *set = "set foo 0 0 7\r\nEND\r\nab\r\n";
+
+    na_test_frame_split("get foo\r\n", 9, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_GET);
+    NA_TEST_ASSERT(parser.key_cnt == 1);
+    NA_TEST_ASSERT(parser.key == 4 && parser.key_len == 3);
+
+    na_test_frame_split("gets a bb ccc\r\n", 15, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_GETS);
+    NA_TEST_ASSERT(parser.key_cnt == 3);
+
+    // the data block has CRLF and END in it
+    na_test_frame_split(set, strlen(set), false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_SET);
+    NA_TEST_ASSERT(!parser.is_noreply);
+
+    na_test_frame_split("delete foo noreply\r\n", 20, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_DELETE);
+    NA_TEST_ASSERT(parser.is_noreply);
+
+    // LF alone ends a line too
+    na_test_frame_split("incr foo 1\n", 11, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_INCR);
+}
+
+static void na_test_meta_request (void)
+{
+    na_memproto_parser_t parser;
+
+    na_test_frame_split("mg foo v q\r\n", 12, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_MG);
+    NA_TEST_ASSERT(parser.is_quiet);
+
+    na_test_frame_split("ms foo 4 T0\r\na\r\nb\r\n", 19, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_MS);
+    NA_TEST_ASSERT(!parser.is_quiet);
+    NA_TEST_ASSERT(parser.key_len == 3);
+
+    na_test_frame_split("mn\r\n", 4, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_MN);
+    NA_TEST_ASSERT(parser.key_len == 0);
+}
+
+/**
+ * requests read at once are framed one by one
+ */
+static void na_test_pipeline (void)
+{
+    na_memproto_parser_t parser;
+    char buf[] = "set a 0 0 1\r\nx\r\nget a\r\nmn\r\n";
+    int len;
+
+    len = strlen(buf);
+    na_memproto_parser_init(&parser);
+    NA_TEST_ASSERT(na_memproto_parse_request(&parser, buf, len) == NA_MEMPROTO_PARSE_DONE);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_SET && parser.start == 0 && parser.off == 16);
+    NA_TEST_ASSERT(na_memproto_parse_request(&parser, buf, len) == NA_MEMPROTO_PARSE_DONE);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_GET && parser.start == 16 && parser.off == 23);
+    NA_TEST_ASSERT(na_memproto_parse_request(&parser, buf, len) == NA_MEMPROTO_PARSE_DONE);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_MN && parser.start == 23 && parser.off == len);
+    NA_TEST_ASSERT(na_memproto_parse_request(&parser, buf, len) == NA_MEMPROTO_PARSE_AGAIN);
+
+    // the buffer is shifted after the framed ones are forwarded
+    na_memproto_parser_shift(&parser, len);
+    NA_TEST_ASSERT(parser.off == 0);
+}
+
+static void na_test_malformed_request (void)
+{
+    char buf[64];
+    int len;
+
+    na_test_error("bogus foo\r\n", 11, false, 0);
+    na_test_error("get\r\n", 5, false, 0);
+    na_test_error("set foo 0 0\r\n", 13, false, 0);
+    na_test_error("set foo 0 0 -1\r\n", 16, false, 0);
+    na_test_error("set foo 0 0 1x\r\n", 16, false, 0);
+    na_test_error("set foo 0 0 99999999999\r\n", 25, false, 0);
+    na_test_error("ms foo\r\n", 8, false, 0);
+    // the data block is longer than its length
+    na_test_error("set foo 0 0 2\r\nabc\r\n", 20, false, 0);
+
+    // key and extras longer than the body
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x00, "foo", 0, "");
+    buf[11] = 2;
+    na_test_error(buf, len, false, 0);
+}
+
+static void na_test_binary_request (void)
+{
+    na_memproto_parser_t parser;
+    char buf[64];
+    int len;
+
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x00, "foo", 0, "");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(parser.protocol == NA_MEMPROTO_PROTOCOL_BINARY);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_BINARY);
+    NA_TEST_ASSERT(parser.key == NA_MEMPROTO_BINARY_HEADER_SIZE && parser.key_len == 3);
+    NA_TEST_ASSERT(!parser.is_quiet);
+
+    // setq with extras
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x11, "foo", 8, "bar");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(parser.key == NA_MEMPROTO_BINARY_HEADER_SIZE + 8 && parser.key_len == 3);
+    NA_TEST_ASSERT(parser.is_quiet);
+
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, NA_MEMPROTO_BINARY_OPCODE_QUIT, "", 0, "");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_QUIT);
+}
+
+/**
+ * requests which change the value of their key, which drop it from L1 cache
+ */
+static void na_test_write (void)
+{
+    na_memproto_parser_t parser;
+    char buf[256];
+    int len;
+    struct {
+        const char *msg;
+        bool is_write;
+    } msgs[] = {
+        { "get foo\r\n",                false },
+        { "gets foo\r\n",               false },
+        { "touch foo 10\r\n",           false },
+        { "mg foo v\r\n",               false },
+        { "mn\r\n",                     false },
+        { "set foo 0 0 1\r\na\r\n",     true  },
+        { "add foo 0 0 1\r\na\r\n",     true  },
+        { "replace foo 0 0 1\r\na\r\n", true  },
+        { "append foo 0 0 1\r\na\r\n",  true  },
+        { "prepend foo 0 0 1\r\na\r\n", true  },
+        { "cas foo 0 0 1 7\r\na\r\n",   true  },
+        { "incr foo 1\r\n",             true  },
+        { "decr foo 1\r\n",             true  },
+        { "delete foo\r\n",             true  },
+        { "ms foo 1\r\na\r\n",          true  },
+        { "md foo\r\n",                 true  },
+        { "ma foo\r\n",                 true  },
+    };
+
+    for (int i=0;i<sizeof(msgs)/sizeof(msgs[0]);++i) {
+        na_test_frame_split(msgs[i].msg, strlen(msgs[i].msg), false, 0, &parser);
+        NA_TEST_ASSERT(na_memproto_is_write(&parser) == msgs[i].is_write);
+    }
+
+    // set, getq, deleteq and gat
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x01, "foo", 8, "a");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(na_memproto_is_write(&parser));
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x09, "foo", 0, "");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(!na_memproto_is_write(&parser));
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x14, "foo", 0, "");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(na_memproto_is_write(&parser));
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x1d, "foo", 4, "");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(!na_memproto_is_write(&parser));
+}
+
+static void na_test_text_response (void)
+{
+    na_memproto_parser_t parser;
+    const char *res = "VALUE a 0 5\r\nEND\r\n\r\nVALUE b 0 1 7\r\nx\r\nEND\r\n";
+
+    // END in a value doesn't end the response
+    na_test_frame_split(res, strlen(res), true, NA_MEMPROTO_CMD_GET, &parser);
+    NA_TEST_ASSERT(parser.key_cnt == 2);
+
+    na_test_frame_split("END\r\n", 5, true, NA_MEMPROTO_CMD_GET, &parser);
+    NA_TEST_ASSERT(parser.key_cnt == 0);
+
+    na_test_frame_split("STORED\r\n", 8, true, NA_MEMPROTO_CMD_SET, NULL);
+    na_test_frame_split("SERVER_ERROR out of memory\r\n", 28, true, NA_MEMPROTO_CMD_GET, NULL);
+
+    na_test_error("VALUE a 0 x\r\n", 13, true, NA_MEMPROTO_CMD_GET);
+    na_test_error("VALUE a 0 1\r\nxy\r\nEND\r\n", 22, true, NA_MEMPROTO_CMD_GET);
+}
+
+/**
+ * responses to quiet meta commands are framed together up to MN
+ */
+static void na_test_meta_response (void)
+{
+    na_memproto_parser_t parser;
+    const char *res = "VA 4 t0\r\nMN\r\n\r\nHD\r\nMN\r\n";
+
+    na_test_frame_split(res, strlen(res), true, NA_MEMPROTO_CMD_MN, &parser);
+    NA_TEST_ASSERT(parser.key_cnt == 1);
+
+    na_test_frame_split("VA 2\r\nhi\r\n", 10, true, NA_MEMPROTO_CMD_MG, &parser);
+    na_test_frame_split("EN\r\n", 4, true, NA_MEMPROTO_CMD_MG, NULL);
+    na_test_frame_split("HD\r\n", 4, true, NA_MEMPROTO_CMD_MS, NULL);
+
+    na_test_error("VA x\r\n", 6, true, NA_MEMPROTO_CMD_MG);
+}
+
+/**
+ * responses to quiet binary commands are framed together with the next one
+ */
+static void na_test_binary_response (void)
+{
+    char buf[256];
+    na_memproto_parser_t parser;
+    int len;
+
+    len  = na_test_binary(buf,       NA_MEMPROTO_BINARY_MAGIC_RESPONSE, 0x0d, "a", 4, "1");
+    len += na_test_binary(buf + len, NA_MEMPROTO_BINARY_MAGIC_RESPONSE, 0x0d, "b", 4, "22");
+    len += na_test_binary(buf + len, NA_MEMPROTO_BINARY_MAGIC_RESPONSE, NA_MEMPROTO_BINARY_OPCODE_NOOP, "", 0, "");
+    na_test_frame_split(buf, len, true, NA_MEMPROTO_CMD_BINARY, &parser);
+    NA_TEST_ASSERT(parser.key_cnt == 2);
+
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_RESPONSE, 0x00, "", 4, "value");
+    na_test_frame_split(buf, len, true, NA_MEMPROTO_CMD_BINARY, NULL);
+
+    // a stat request has one response of one packet per stat up to the one with an empty key
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, NA_MEMPROTO_BINARY_OPCODE_STAT, "", 0, "");
+    na_test_frame_split(buf, len, false, 0, &parser);
+    NA_TEST_ASSERT(parser.cmd == NA_MEMPROTO_CMD_BINARY && !parser.is_quiet);
+
+    len  = na_test_binary(buf,       NA_MEMPROTO_BINARY_MAGIC_RESPONSE, NA_MEMPROTO_BINARY_OPCODE_STAT, "pid", 0, "4242");
+    len += na_test_binary(buf + len, NA_MEMPROTO_BINARY_MAGIC_RESPONSE, NA_MEMPROTO_BINARY_OPCODE_STAT, "uptime", 0, "17");
+    len += na_test_binary(buf + len, NA_MEMPROTO_BINARY_MAGIC_RESPONSE, NA_MEMPROTO_BINARY_OPCODE_STAT, "", 0, "");
+    na_test_frame_split(buf, len, true, NA_MEMPROTO_CMD_BINARY, &parser);
+    NA_TEST_ASSERT(parser.opcode == NA_MEMPROTO_BINARY_OPCODE_STAT);
+    NA_TEST_ASSERT(parser.key_len == 0);
+    NA_TEST_ASSERT(parser.key_cnt == 0);
+
+    // and a response to the command after it is framed alone
+    len += na_test_binary(buf + len, NA_MEMPROTO_BINARY_MAGIC_RESPONSE, NA_MEMPROTO_BINARY_OPCODE_NOOP, "", 0, "");
+    na_memproto_parser_init(&parser);
+    parser.protocol = NA_MEMPROTO_PROTOCOL_BINARY;
+    NA_TEST_ASSERT(na_memproto_parse_response(&parser, NA_MEMPROTO_CMD_BINARY, buf, len) == NA_MEMPROTO_PARSE_DONE);
+    NA_TEST_ASSERT(parser.opcode == NA_MEMPROTO_BINARY_OPCODE_STAT);
+    NA_TEST_ASSERT(na_memproto_parse_response(&parser, NA_MEMPROTO_CMD_BINARY, buf, len) == NA_MEMPROTO_PARSE_DONE);
+    NA_TEST_ASSERT(parser.opcode == NA_MEMPROTO_BINARY_OPCODE_NOOP);
+    NA_TEST_ASSERT(parser.off == len);
+
+    len = na_test_binary(buf, NA_MEMPROTO_BINARY_MAGIC_REQUEST, 0x00, "", 0, "");
+    na_test_error(buf, len, true, NA_MEMPROTO_CMD_BINARY);
+}
+
+int main (int argc, char *argv[])
+{
+    na_scan_init();
+
+    na_test_text_request();
+    na_test_meta_request();
+    na_test_pipeline();
+    na_test_malformed_request();
+    na_test_binary_request();
+    na_test_write();
+    na_test_text_response();
+    na_test_meta_response();
+    na_test_binary_response();
+
+    if (na_test_failed > 0) {
+        printf("test_memproto: %d failed (scan kernel: %s)\n", na_test_failed, na_scan_kernel_name());
+        return 1;
+    }
+    printf("test_memproto: ok (scan kernel: %s)\n", na_scan_kernel_name());
+
+    return 0;
+}